@@ -0,0 +1,339 @@
+/***************************************************************
+ *
+ * Benchmarks of the library's hot paths, written as JSON:
+ *      oclutils-bench [platform] [output.json]
+ * The platform defaults to "-1" (the first one) and the output to
+ * "oclutils-bench.json". Everything runs on a CPU OpenCL runtime too.
+ *
+ *
+ * Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * https://github.com/nbigaouette/oclutils
+ ***************************************************************/
+
+#include <OclUtils.hpp>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unistd.h>     // getpid()
+#include <time.h>       // clock_gettime()
+
+// Every measurement is repeated until it lasts at least this long (seconds).
+const double Min_Duration   = 0.05;
+const int    Max_Repetitions = 1000;
+
+// **************************************************************
+double Bench_Now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return double(now.tv_sec) + double(now.tv_nsec) * 1.0e-9;
+}
+
+// **************************************************************
+// A measured operation: Run() is timed, repeatedly.
+class Bench_Operation
+{
+    public:
+        virtual ~Bench_Operation() {}
+        virtual void Run() = 0;
+};
+
+// **************************************************************
+double Time_Operation(Bench_Operation &operation, const int max_repetitions = Max_Repetitions)
+/**
+ * @return      Mean duration (seconds) of one Run(), after a warmup run
+ */
+{
+    operation.Run();
+
+    int repetitions = 0;
+    const double start = Bench_Now();
+    double elapsed = 0.0;
+    while (elapsed < Min_Duration and repetitions < max_repetitions)
+    {
+        operation.Run();
+        repetitions++;
+        elapsed = Bench_Now() - start;
+    }
+    return elapsed / double(repetitions);
+}
+
+// **************************************************************
+class Array_Host_to_Device : public Bench_Operation
+{
+    public:
+        OpenCL_Array<char> *array;
+        void Run()
+        {
+            array->Host_to_Device();
+        }
+};
+
+// **************************************************************
+class Array_Device_to_Host : public Bench_Operation
+{
+    public:
+        OpenCL_Array<char> *array;
+        void Run()
+        {
+            array->Device_to_Host();
+        }
+};
+
+// **************************************************************
+class Launch_Kernel : public Bench_Operation
+{
+    public:
+        cl_command_queue queue; OpenCL_Kernel *kernel;
+        void Run()
+        {
+            kernel->Launch(queue);
+            cl_int err = clFinish(queue);
+            OpenCL_Test_Success(err, "clFinish()");
+        }
+};
+
+// **************************************************************
+class Lock_Device : public Bench_Operation
+{
+    public:
+        OpenCL_device *device;
+        void Run()
+        {
+            if (not device->Try_Lock())
+            {
+                std_cout << "ERROR: Could not lock " << device->Get_Name() << "!\n";
+                abort();
+            }
+            device->Unlock();
+        }
+};
+
+// **************************************************************
+class Host_SHA512 : public Bench_Operation
+{
+    public:
+        void *array; uint64_t size_bits; uint8_t checksum[64];
+        void Run()
+        {
+            OpenCL_SHA512::Calculate_Checksum(array, size_bits, checksum);
+        }
+};
+
+#ifdef OpenCLSHA512Checksum
+// **************************************************************
+class Validate_Array : public Bench_Operation
+{
+    public:
+        OpenCL_Array<char> *array;
+        void Run()
+        {
+            array->Validate_Data();
+        }
+};
+#endif // #ifdef OpenCLSHA512Checksum
+
+// **************************************************************
+void Bench_Transfers(std::ostringstream &json, OpenCL_device &device, cl_command_queue queue)
+/**
+ * Transfers of an OpenCL_Array, as the library's users do them. The array
+ * itself decides to share page-aligned host memory with devices using the
+ * host's memory (zero-copy) instead of copying it.
+ */
+{
+    cl_context context = device.Get_Context();
+    cl_device_id device_id = device.Get_Device();
+    const std::string platform_key = device.Get_Parent_Platform()->Key();
+    cl_int err;
+
+    json << "  \"transfers\": [";
+    bool first = true;
+    for (size_t size = 4096 ; size <= (size_t(64) << 20) ; size *= 4)
+    {
+        // Pageable host memory
+        std::vector<char> pageable(size);
+        // Pinned host memory: mapped from a buffer allocated by the runtime
+        cl_mem pinned_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &err);
+        OpenCL_Test_Success(err, "clCreateBuffer()");
+        char *pinned = (char *) clEnqueueMapBuffer(queue, pinned_buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size, 0, NULL, NULL, &err);
+        OpenCL_Test_Success(err, "clEnqueueMapBuffer()");
+        // Page-aligned host memory: zero-copy where the device allows it
+        void *aligned = NULL;
+        if (posix_memalign(&aligned, 4096, size) != 0)
+            abort();
+
+        const char *modes[3] = {"pageable", "pinned", "page-aligned"};
+        char *hosts[3] = {&pageable[0], pinned, (char *) aligned};
+        for (int mode = 0 ; mode < 3 ; mode++)
+        {
+            memset(hosts[mode], 1, size);
+            OpenCL_Array<char> array;
+            array.Initialize(int(size), sizeof(char), hosts[mode], context, CL_MEM_READ_WRITE,
+                             platform_key, queue, device_id, false);
+
+            Array_Host_to_Device h2d;
+            Array_Device_to_Host d2h;
+            h2d.array = d2h.array = &array;
+            const double h2d_time = Time_Operation(h2d);
+            const double d2h_time = Time_Operation(d2h);
+            array.Release_Memory();
+
+            json << (first ? "\n" : ",\n")
+                 << "    {\"mode\": \"" << modes[mode] << "\", \"bytes\": " << size
+                 << ", \"host_to_device_gb_per_s\": " << double(size) / h2d_time * 1.0e-9
+                 << ", \"device_to_host_gb_per_s\": " << double(size) / d2h_time * 1.0e-9 << "}";
+            first = false;
+        }
+
+        free(aligned);
+        clEnqueueUnmapMemObject(queue, pinned_buffer, pinned, 0, NULL, NULL);
+        clFinish(queue);
+        clReleaseMemObject(pinned_buffer);
+    }
+    json << "\n  ],\n";
+}
+
+// **************************************************************
+void Bench_Kernels(std::ostringstream &json, OpenCL_device &device, cl_command_queue queue)
+{
+    // Cold build: a source the runtime can't have cached. The library keeps
+    // no binaries: a build repeated by the runtime only measures its own cache.
+    char unique[128];
+    sprintf(unique, "// oclutils-bench %d %f\n", int(getpid()), Bench_Now());
+    const std::string source = std::string(unique) + "__kernel void Empty(__global float *a) { }\n";
+
+    const double start = Bench_Now();
+    OpenCL_Kernel cold;
+    cold.Initialize(source, device.Get_Context(), device.Get_Device());
+    cold.Build("Empty");
+    const double cold_build = Bench_Now() - start;
+
+    json << "  \"program_build_ms\": " << cold_build * 1.0e3 << ",\n";
+
+    // Launch latency: an empty kernel, waited for.
+    cl_int err;
+    cl_mem argument = clCreateBuffer(device.Get_Context(), CL_MEM_READ_WRITE, sizeof(float), NULL, &err);
+    OpenCL_Test_Success(err, "clCreateBuffer()");
+    err = clSetKernelArg(cold.Get_Kernel(), 0, sizeof(cl_mem), &argument);
+    OpenCL_Test_Success(err, "clSetKernelArg()");
+    cold.Compute_Work_Size(1, 1, 1, 1);
+
+    Launch_Kernel launch;
+    launch.queue  = queue;
+    launch.kernel = &cold;
+    json << "  \"kernel_launch_latency_us\": " << Time_Operation(launch) * 1.0e6 << ",\n";
+
+    clReleaseMemObject(argument);
+}
+
+// **************************************************************
+#ifdef OpenCLSHA512Checksum
+void Bench_SHA512_Device(std::ostringstream &json, OpenCL_device &device, cl_command_queue queue,
+                         const size_t size, const double host_time)
+{
+    // Validate_Data() checksums on both sides: the host's part is subtracted.
+    char *device_array = (char *) calloc(size, 1);
+    OpenCL_Array<char> checksummed;
+    checksummed.Initialize(int(size), sizeof(char), device_array, device.Get_Context(), CL_MEM_READ_WRITE,
+                           device.Get_Parent_Platform()->Key(), queue, device.Get_Device(), true);
+    Validate_Array validate;
+    validate.array = &checksummed;
+    const double device_time = Time_Operation(validate) - host_time;
+    json << (device_time > 0.0 ? double(size) / device_time * 1.0e-6 : 0.0);
+    checksummed.Release_Memory();
+}
+#else
+void Bench_SHA512_Device(std::ostringstream &json, OpenCL_device &, cl_command_queue,
+                         const size_t, const double)
+{
+    json << "null";     // The library was built without OpenCLSHA512Checksum
+}
+#endif // #ifdef OpenCLSHA512Checksum
+
+// **************************************************************
+void Bench_SHA512(std::ostringstream &json, OpenCL_device &device, cl_command_queue queue)
+{
+    const size_t size = size_t(16) << 20;
+    char *array = (char *) calloc(size, 1);
+    for (size_t i = 0 ; i < size ; i++)
+        array[i] = char(i);
+    uint64_t size_bits = uint64_t(size) * CHAR_BIT;
+    OpenCL_SHA512::Prepare_Array_for_Checksuming((void **) &array, sizeof(char), size_bits);
+
+    Host_SHA512 host;
+    host.array      = array;
+    host.size_bits  = size_bits;
+    const double host_time = Time_Operation(host);
+    json << "  \"sha512\": {\"host_mb_per_s\": " << double(size) / host_time * 1.0e-6 << ", \"device_mb_per_s\": ";
+    Bench_SHA512_Device(json, device, queue, size, host_time);
+    json << "},\n";
+
+    free(array);
+}
+
+// **************************************************************
+int main(int argc, char *argv[])
+{
+    const std::string platform_key = (argc > 1 ? argv[1] : "-1");
+    const std::string output       = (argc > 2 ? argv[2] : "oclutils-bench.json");
+
+    OpenCL_platforms_list platforms_list;
+    platforms_list.Initialize(platform_key);
+    const std::string platform = platforms_list.Get_Running_Platform();
+    platforms_list[platform].Lock_Best_Device();
+
+    OpenCL_device &device = platforms_list[platform].Preferred_OpenCL();
+    cl_command_queue queue = device.Get_Command_Queue();
+
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"platform\": \"" << Escape_JSON(platforms_list[platform].Name()) << "\",\n"
+         << "  \"device\": \"" << Escape_JSON(device.Get_Name()) << "\",\n";
+
+    Bench_Transfers(json, device, queue);
+    Bench_Kernels(json, device, queue);
+    Bench_SHA512(json, device, queue);
+
+    // Lock acquisition, uncontended. The device is locked again afterward.
+    // Locking logs every attempt: only errors are kept while timing it.
+    device.Unlock();
+    Lock_Device lock;
+    lock.device = &device;
+    const OpenCL_Log_Level log_level = OpenCL_Logger::Instance().Level();
+    OpenCL_Logger::Instance().Set_Level(OPENCL_LOG_ERROR);
+    const double lock_time = Time_Operation(lock);
+    OpenCL_Logger::Instance().Set_Level(log_level);
+    json << "  \"lock_acquire_us\": " << lock_time * 1.0e6 << "\n";
+    device.Lock();
+
+    json << "}\n";
+
+    std::ofstream file(output.c_str());
+    file << json.str();
+    file.close();
+    if (file.fail())
+    {
+        std_cout << "ERROR: Could not write " << output << "!\n";
+        return EXIT_FAILURE;
+    }
+    std_cout << "Results written to " << output << ":\n" << json.str();
+
+    return EXIT_SUCCESS;
+}
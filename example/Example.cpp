@@ -41,11 +41,20 @@ int main(int argc, char *argv[])
     //      "nvidia"    NVIDIA CUDA OpenCL
     //                  http://developer.nvidia.com/opencl
     //      "apple"     Apple OpenCL (only on MacOSX)
+    //      "pocl"      Portable Computing Language (CPU)
+    //                  http://portablecl.org/
+    //      Other vendors are registered under a key derived from their
+    //      name ("Foo Bar, Inc." becomes "foo_bar_inc").
     //      "-1"        Default value. This will take the first
     //                  platform available, in alphabetical order.
     // By default, the library will use lock files to prevent multiple
     // programs from using a single devices. If you want to prevent
     // that, append "false" to Initialize()'s arguments.
+    // Devices a job can't run on can be excluded before anything is locked:
+    //      OpenCL_Device_Requirements requirements;
+    //      requirements.extensions          = "cl_khr_fp64";
+    //      requirements.min_global_mem_size = cl_ulong(8) << 30;   // 8 GiB
+    //      platforms_list.Set_Device_Requirements(requirements);
     platforms_list.Initialize("-1");
 
     // By passing "-1", to Initialize(), the first platform in the list
@@ -58,17 +67,23 @@ int main(int argc, char *argv[])
     // CPUs, CL_DEVICE_MAX_COMPUTE_UNITS is the number of cores.
     // The locking is done by creating the file /tmp/gpu_usage.txt
     // where the platform and device is saved.
+    // On a CPU, many processes can share the node by partitioning the device
+    // first (OpenCL 1.2): each sub-device is then locked independently.
+    //      platforms_list[platform].Partition_CPU_Devices(OPENCL_PARTITION_BY_NUMA);
+    // To use many devices of the platform through a single context (programs
+    // built once, buffers usable from every device's queue), give their ids:
+    //      std::vector<int> ids; ids.push_back(0); ids.push_back(1);
+    //      platforms_list[platform].Set_Shared_Context(ids);
     platforms_list[platform].Lock_Best_Device();
 
     // Print All information possible on the platforms and their devices.
     platforms_list.Print();
 
-    // Create a command queue on "platform"'s preferred device.
-    cl_int err;
-    cl_command_queue command_queue = clCreateCommandQueue(
-        platforms_list[platform].Preferred_OpenCL_Device_Context(),  // OpenCL context
-        platforms_list[platform].Preferred_OpenCL_Device(),          // OpenCL device id
-        0, &err);
+    // Get a command queue on "platform"'s preferred device. The device owns
+    // it (one per host thread) and releases it with its context. Other
+    // threads, or independent streams of work, get their own:
+    //      Preferred_OpenCL().Get_Stream_Queue(1, CL_QUEUE_PROFILING_ENABLE);
+    cl_command_queue command_queue = platforms_list[platform].Preferred_OpenCL().Get_Command_Queue();
 
     // Pause
     std::string answer;
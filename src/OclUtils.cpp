@@ -20,18 +20,38 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/file.h>
+#include <dirent.h>
+#include <sys/mman.h>     // mmap()
+#include <sys/syscall.h>  // mbind(), get_mempolicy() without libnuma
 
 #include <cerrno>       // errno, EWOULDBLOCK
 #include <cstring>      // strlen()
 #include <cmath>
+#include <climits>      // INT_MAX
 #include <algorithm>    // std::ostringstream
 #include <sstream>
+#include <fstream>
+#include <vector>
 #include <unistd.h>     // getpid()
+#include <pthread.h>
 
-#include <sys/time.h> // timeval
+#include <time.h>     // nanosleep(), clock_gettime()
 
 #include "OclUtils.hpp"
 
+// NUMA memory policies (see linux/mempolicy.h). Only available on Linux.
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
+#define OCLUTILS_HAVE_NUMA
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED  1
+#endif
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE     (1<<0)
+#endif
+#ifndef MPOL_F_ADDR
+#define MPOL_F_ADDR     (1<<1)
+#endif
+#endif // #if defined(__linux__) && defined(SYS_mbind) && defined(SYS_get_mempolicy)
 
 // *****************************************************************************
 // Quote something, usefull to quote a macro's value
@@ -44,8 +64,8 @@
 
 #define assert(x)                                       \
     if (!(x)) {                                         \
-        std_cout                                        \
-            << "##########################"             \
+        OpenCL_Log_Error(                               \
+               "##########################"             \
             << "##########################"             \
             << "##########################\n"           \
             << "Assertion failed in \"" << __FILE__     \
@@ -53,8 +73,7 @@
             << "!(" << QUOTEME(x) << ")\n"              \
             << "##########################"             \
             << "##########################"             \
-            << "##########################\n"           \
-            << std::flush;                              \
+            << "##########################\n");         \
         abort();                                        \
     }
 
@@ -75,11 +94,31 @@ const double GiB_to_MiB = 1024.0;
 // *****************************************************************************
 // **************** Local functions prototypes *********************************
 void Print_N_Times(const std::string x, const int N, const bool newline = true);
+std::string Filename_Safe(const std::string &s);
+void Make_Directories(const std::string &path, const mode_t mode);
+cl_device_type Tuning_Device_Type(const cl_device_type type);
 std::string Get_Lock_Filename(const int device_id, const int platform_id_offset,
                               const std::string &platform_name, const std::string &device_name);
-int Lock_File(const char *path, const bool quiet = false);
+int Lock_File(const char *path, const bool quiet = false,
+              const OpenCL_Retry_Policy &policy = OpenCL_Retry_Policy(),
+              double *time_waited = NULL, const bool shared = false);
+bool Verify_if_Lock_File_is_Used(const std::string &path, const bool shared, const bool quiet,
+                                 const OpenCL_Retry_Policy &policy);
 void Unlock_File(int f, const bool quiet = false);
 void Wait(const double duration_sec);
+double Now();
+std::string Device_Queue_Directory(const std::string &platform_name);
+int Device_Queue_Enter(const std::string &directory, int &ticket);
+bool Device_Queue_Is_First(const std::string &directory, const int ticket);
+bool Device_Queue_Is_Empty(const std::string &directory);
+void Device_Queue_Leave(const std::string &directory, const int ticket, const int f);
+std::vector<int> Read_Sysfs_List(const std::string &path);
+std::vector<int> NUMA_Nodes_with_CPUs();
+#ifdef CL_VERSION_1_2
+int Sub_Device_NUMA_Node(const cl_device_id sub_device, const cl_uint index, const cl_uint nb_sub_devices);
+#endif // #ifdef CL_VERSION_1_2
+int PCI_NUMA_Node(const cl_uint domain, const cl_uint bus, const cl_uint device, const cl_uint function);
+void Device_Names(cl_device_id device, std::string &platform_name, std::string &device_name);
 
 void * calloc_and_check(uint64_t nb, size_t s, std::string msg = "");
 
@@ -91,20 +130,17 @@ void * calloc_and_check(uint64_t nb, size_t s, std::string msg)
     p = calloc(nb, s);
     if (p == NULL)
     {
-        std_cout << "ERROR!!!\n";
-        std_cout << "    Allocation of ";
-        std_cout << nb << " x " << s << " bytes = " << nb_s << " bytes\n";
-        std_cout << "                                               (";
-        std_cout
+        OpenCL_Log_Error(
+               "ERROR!!!\n"
+            << "    Allocation of "
+            << nb << " x " << s << " bytes = " << nb_s << " bytes\n"
+            << "                                               ("
             << nb_s * B_to_KiB << " KiB, "
             << nb_s * B_to_KiB << " MiB, "
             << nb_s * B_to_GiB << " GiB)\n"
-            << "    FAILED!!!\n";
-        if (msg != "")
-        {
-            std_cout << "Comment: " << msg << std::endl;
-        }
-        std_cout << "Aborting.\n" << std::flush;
+            << "    FAILED!!!\n"
+            << (msg != "" ? "Comment: " + msg + "\n" : "")
+            << "Aborting.\n");
         abort();
     }
 
@@ -138,42 +174,71 @@ void Print_N_Times(const std::string x, const int N, const bool newline)
 }
 
 // *****************************************************************************
-std::string Get_Lock_Filename(const int device_id, const int platform_id_offset,
-                              const std::string &platform_name, const std::string &device_name)
+std::string Filename_Safe(const std::string &s)
 {
-    std::string f = "/tmp/OpenCL_"; // Beginning of lock filename
-    char t[4096];
-    sprintf(t, "Platform%d_Device%d__%s_%s", platform_id_offset, device_id, platform_name.c_str(), device_name.c_str()); //generate string filename
-    unsigned int len = (unsigned int) strlen(t);
-    for (unsigned int i = 0; i < len; i++)
+    std::string f = s;
+    for (unsigned int i = 0; i < f.size(); i++)
     {
         // Replace all non alphanumeric characters with underscore
-        if (!isalpha(t[i]) && !isdigit(t[i]))
+        if (!isalpha(f[i]) && !isdigit(f[i]))
         {
-            t[i] = '_';
+            f[i] = '_';
         }
     }
-    f += t;
+    return f;
+}
+
+// *****************************************************************************
+void Make_Directories(const std::string &path, const mode_t mode)
+/**
+ * Create the directory "path" and its missing parents (like "mkdir -p").
+ * Errors are ignored: using the directory will tell.
+ */
+{
+    std::string::size_type slash = path.find('/', 1);
+    while (slash != std::string::npos)
+    {
+        mkdir(path.substr(0, slash).c_str(), mode);
+        slash = path.find('/', slash + 1);
+    }
+    mkdir(path.c_str(), mode);
+}
+
+// *****************************************************************************
+std::string Get_Lock_Filename(const int device_id, const int platform_id_offset,
+                              const std::string &platform_name, const std::string &device_name)
+{
+    std::string f = "/tmp/OpenCL_"; // Beginning of lock filename
+    char t[4096];
+    sprintf(t, "Platform%d_Device%d__%s_%s", platform_id_offset, device_id, platform_name.c_str(), device_name.c_str()); //generate string filename
+    f += Filename_Safe(t);
     f += ".lck"; // File suffix
     return f;
 }
 
 // *****************************************************************************
-int Lock_File(const char *path, const bool quiet)
+int Lock_File(const char *path, const bool quiet,
+              const OpenCL_Retry_Policy &policy, double *time_waited, const bool shared)
 /**
  * Attempt to lock file, and check lock status on lock file
+ * @param policy        How to retry when the lock is held by someone else
+ * @param time_waited   If not NULL, set to the time (seconds) spent waiting between attempts
+ * @param shared        Acquire a shared lock instead of an exclusive one
  * @return      file handle if locked, or -1 if failed
  */
 {
+    if (time_waited != NULL)
+        *time_waited = 0.0;
+
     if (not quiet)
-        std_cout << "OpenCL: Attempt to acquire lock on file " << path << "..." << std::flush;
+        OpenCL_Log_Info("OpenCL: Attempt to acquire lock on file " << path << "...");
 
     // Open file
     int f = open(path, O_CREAT | O_TRUNC, 0666);
     if (f == -1)
     {
         if (not quiet)
-            std_cout << "Could not open lock file!\n" << std::flush;
+            OpenCL_Log_Info("Could not open lock file!\n");
         return -1; // Open failed
     }
 
@@ -186,54 +251,67 @@ int Lock_File(const char *path, const bool quiet)
     fchmod(f, 0666);
 
     // Aquire the lock. Since the locking might fail (because another process is checking the lock too)
-    // we try a maximum of 5 times, with a random delay  between 1 and 10 seconds between tries.
-    pid_t pid = getpid();
-    const int max_retry = 5;
-    srand(pid * (unsigned int)time(NULL));
+    // we retry following the policy (by default a few times, with a growing random delay between tries).
+    OpenCL_Retry retry(policy);
+    double delay;
     int err;
-    for (int i = 0 ; i < max_retry ; i++)
+    int flock_errno;
+    while (true)
     {
         // Try to acquire lock
-        err = flock(f, LOCK_EX | LOCK_NB);
+        err = flock(f, (shared ? LOCK_SH : LOCK_EX) | LOCK_NB);
+        flock_errno = errno;
 
-        // If it succeeds, exist the loop
-        if (err != -1)
+        // If it succeeds, exist the loop. Don't retry on unexpected errors.
+        if (err != -1 or flock_errno != EWOULDBLOCK)
+            break;
+
+        if (not retry.Prepare_Retry(delay))
             break;
+        OpenCL_Metrics::Instance().lock_retries->Add();
 
-        // If it it did not succeeds, sleep for a random
-        // time (between 1 and 10 seconds) and retry
-        const double delay = ((double(rand()) / double(RAND_MAX)) * 9.0) + 1.0;
+        // If it it did not succeeds, sleep and retry
         char delay_string[64];
         sprintf(delay_string, "%.4f", delay);
-        std_cout
-            << "\nOpenCL: WARNING: Failed to acquire a lock on file '" << path << "'.\n"
-            << "                 Waiting " << delay_string << " seconds before retrying (" << i+1 << "/" << max_retry << ")...\n" << std::flush;
-        Wait(delay);
-        std_cout << "                 Done waiting.";
-        if (i+1 < max_retry)
-            std_cout << " Retrying.";
-        std_cout << "\n";
+        if (not quiet)
+        {
+            OpenCL_Log_Warning(
+                   "\nOpenCL: WARNING: Failed to acquire a lock on file '" << path << "'.\n"
+                << "                 Waiting " << delay_string << " seconds before retrying (" << retry.Attempt() << "/" << retry.Max_Attempts() << ")...\n");
+        }
+        retry.Sleep(delay);
+        if (not quiet)
+            OpenCL_Log_Info("                 Done waiting. Retrying.\n");
     }
 
+    if (time_waited != NULL)
+        *time_waited = retry.Time_Waited();
+
     if (err == -1)
     {
-        if (errno == EWOULDBLOCK)
+        if (flock_errno == EWOULDBLOCK)
         {
             close(f);
             if (not quiet)
-                std_cout << "Lock file is already locked!\n";
+                OpenCL_Log_Info("Lock file is already locked! (waited " << retry.Time_Waited() << " seconds)\n");
             return -1; // File is locked
         }
         else
         {
-            std_cout << "File lock operation failed!\n";
+            if (not quiet)
+                OpenCL_Log_Warning("File lock operation failed!\n");
             close(f);
             return -1; // Another error occurred
         }
     }
 
     if (not quiet)
-        std_cout << "Success!\n" << std::flush;
+    {
+        if (retry.Time_Waited() > 0.0)
+            OpenCL_Log_Info("Success! (waited " << retry.Time_Waited() << " seconds)\n");
+        else
+            OpenCL_Log_Info("Success!\n");
+    }
 
     return f;
 }
@@ -245,287 +323,1008 @@ void Unlock_File(int f, const bool quiet)
  */
 {
     if (not quiet)
-        std_cout << "Closing lock file.\n";
+        OpenCL_Log_Info("Closing lock file.\n");
     close(f); // Close file automatically unlocks file
 }
 
 // *****************************************************************************
-void Wait(const double duration_sec)
+// FIFO queue of processes waiting for a device. Each waiter holds an flock()
+// on its own ticket file in "directory"; tickets come from a counter file.
+// A waiter is first in line once no lower ticket is held. Tickets of dead
+// processes are not held anymore: they are removed by the next waiter.
+std::string Device_Queue_Directory(const std::string &platform_name)
 {
-    double delay = 0.0;
-    timeval initial, now;
-    gettimeofday(&initial, NULL);
-    while (delay <= duration_sec)
-    {
-        gettimeofday(&now, NULL);
-        // Transform time into double delay
-        delay = double(now.tv_sec - initial.tv_sec) + 1.0e-6*double(now.tv_usec - initial.tv_usec);
-        //printf("Delay = %.6f   max = %.6f\n", delay, duration_sec);
-    }
+    return "/tmp/OpenCL_Queue__" + Filename_Safe(platform_name);
 }
 
 // *****************************************************************************
-bool Verify_if_Device_is_Used(const int device_id, const int platform_id_offset,
-                              const std::string &platform_name, const std::string &device_name)
+int Device_Queue_Enter(const std::string &directory, int &ticket)
+/**
+ * @return      file handle of the ticket file (keep it open while in line)
+ */
 {
-    int check = Lock_File(Get_Lock_Filename(device_id, platform_id_offset, platform_name, device_name).c_str());
-
-    if (check == -1)
+    // Shared between users, like /tmp: sticky so that nobody removes the others' tickets.
+    mkdir(directory.c_str(), 01777);
+    chmod(directory.c_str(), 01777);
+
+    // Take a ticket.
+    const std::string counter_path = directory + "/counter";
+    int counter = open(counter_path.c_str(), O_CREAT | O_RDWR, 0666);
+    if (counter == -1 or flock(counter, LOCK_EX) == -1)
     {
-        return true;                // Device is used
+        OpenCL_Log_Error("OpenCL: ERROR: Cannot use the device queue in " << directory << "!\n");
+        abort();
     }
-    else
+    fchmod(counter, 0666);
+    char buffer[32] = {0};
+    ticket = (read(counter, buffer, sizeof(buffer)-1) > 0 ? atoi(buffer) : 0);
+    sprintf(buffer, "%d\n", ticket+1);
+    if (pwrite(counter, buffer, strlen(buffer), 0) == -1 or ftruncate(counter, strlen(buffer)) == -1)
     {
-        Unlock_File(check, true);   // Close file, quiet == true
-        return false;               // Device not in use
+        OpenCL_Log_Error("OpenCL: ERROR: Cannot update the device queue's counter!\n");
+        abort();
+    }
+    close(counter);
+
+    // Lock the ticket before it becomes visible (rename() is atomic), so others never see it unlocked.
+    char name[64];
+    sprintf(name, "/ticket_%010d", ticket);
+    const std::string path = directory + name;
+    const std::string tmp_path = path + ".tmp";
+    int f = open(tmp_path.c_str(), O_CREAT | O_RDWR, 0666);
+    if (f == -1 or flock(f, LOCK_EX) == -1 or rename(tmp_path.c_str(), path.c_str()) == -1)
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: Cannot create a ticket in the device queue!\n");
+        abort();
     }
+    fchmod(f, 0666);
+
+    return f;
 }
 
 // *****************************************************************************
-char *read_opencl_kernel(const std::string filename, int *length)
+bool Device_Queue_Is_First(const std::string &directory, const int ticket)
 {
-    FILE *f = fopen(filename.c_str(), "r");
-    void *buffer;
+    DIR *dir = opendir(directory.c_str());
+    if (dir == NULL)
+        return true;
 
-    if (!f)
+    bool first = true;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
     {
-        std_cout << "OpenCL: Unable to open " << filename << " for reading\n";
-        abort();
+        int other_ticket;
+        char extra;
+        if (sscanf(entry->d_name, "ticket_%d%c", &other_ticket, &extra) != 1 or other_ticket >= ticket)
+            continue;
+
+        // Someone is before us. Is it still alive?
+        const std::string path = directory + "/" + entry->d_name;
+        int f = open(path.c_str(), O_RDONLY);
+        if (f == -1)
+            continue;       // Just left
+        if (flock(f, LOCK_EX | LOCK_NB) == 0)
+            unlink(path.c_str());   // Its owner died
+        else
+            first = false;
+        close(f);
     }
+    closedir(dir);
 
-    fseek(f, 0, SEEK_END);
-    *length = int(ftell(f));
-    fseek(f, 0, SEEK_SET);
-
-    buffer = malloc(*length+1);
-    *length = int(fread(buffer, 1, *length, f));
-    fclose(f);
-    ((char*)buffer)[*length] = '\0';
-
-    return (char*)buffer;
+    return first;
 }
 
 // *****************************************************************************
-OpenCL_platform::OpenCL_platform()
+bool Device_Queue_Is_Empty(const std::string &directory)
+/**
+ * No process is waiting in line: callers not waiting can take a device.
+ */
 {
-    id      = NULL;
-    vendor  = "Not set";
-    name    = "Not set";
-    version = "Not set";
-    extensions = "Not set";
-    profile = "Not set";
-    id_offset  = 0;
+    return Device_Queue_Is_First(directory, INT_MAX);
 }
 
 // *****************************************************************************
-void OpenCL_platform::Initialize(const std::string _key, int _id_offset, cl_platform_id _id,
-                                 OpenCL_platforms_list *_platform_list,
-                                 const std::string preferred_platform)
+void Device_Queue_Leave(const std::string &directory, const int ticket, const int f)
 {
-    key             = _key;
-    id_offset       = _id_offset;
-    id              = _id;
-    platform_list   = _platform_list;
-
-    cl_int err;
-    char tmp_string[4096];
-
-    // Query platform information
-    err = clGetPlatformInfo(id, CL_PLATFORM_PROFILE, sizeof(tmp_string), &tmp_string, NULL);
-    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_PROFILE)");
-    profile = std::string(tmp_string);
-
-    err = clGetPlatformInfo(id, CL_PLATFORM_VERSION, sizeof(tmp_string), &tmp_string, NULL);
-    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VERSION)");
-    version = std::string(tmp_string);
-
-    err = clGetPlatformInfo(id, CL_PLATFORM_NAME, sizeof(tmp_string), &tmp_string, NULL);
-    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_NAME)");
-    name = std::string(tmp_string);
+    char name[64];
+    sprintf(name, "/ticket_%010d", ticket);
+    unlink((directory + name).c_str());
+    close(f);
+}
 
-    err = clGetPlatformInfo(id, CL_PLATFORM_VENDOR, sizeof(tmp_string), &tmp_string, NULL);
-    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VENDOR)");
-    vendor = std::string(tmp_string);
+// *****************************************************************************
+void Wait(const double duration_sec)
+/**
+ * Sleep (without using the CPU) for the given duration.
+ */
+{
+    if (duration_sec <= 0.0)
+        return;
 
-    err = clGetPlatformInfo(id, CL_PLATFORM_EXTENSIONS, sizeof(tmp_string), &tmp_string, NULL);
-    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_EXTENSIONS)");
-    extensions = std::string(tmp_string);
+    timespec remaining;
+    remaining.tv_sec  = time_t(duration_sec);
+    remaining.tv_nsec = long((duration_sec - double(remaining.tv_sec)) * 1.0e9);
 
-    // Initialize the platform's devices
-    devices_list.Initialize(*this, preferred_platform);
+    // Sleep again if interrupted by a signal
+    while (nanosleep(&remaining, &remaining) == -1 and errno == EINTR)
+        ;
 }
 
 // *****************************************************************************
-void OpenCL_platform::Print_Preferred() const
+double Now()
+/**
+ * Monotonic time, in seconds.
+ */
 {
-    Print_N_Times("-", 109);
-    std_cout << "OpenCL: Platform and device to be used:\n";
-    std_cout << "OpenCL: Platform's name:             " << Name() << "\n";
-    std_cout << "OpenCL: Platform's best device:      " << devices_list.preferred_device->Get_Name() << " (id = "
-                                                        << devices_list.preferred_device->Get_ID()   << ")\n";
-    Print_N_Times("-", 109);
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return double(now.tv_sec) + 1.0e-9*double(now.tv_nsec);
 }
+
 // *****************************************************************************
-void OpenCL_platform::Lock_Best_Device()
+OpenCL_Retry_Policy::OpenCL_Retry_Policy()
 {
-    if (Preferred_OpenCL().Is_Lockable())
-    {
-        Preferred_OpenCL().Lock();
-    }
+    max_attempts    = 5;
+    initial_delay   = 1.0;
+    max_delay       = 10.0;
+    backoff_factor  = 2.0;
+    jitter          = 0.5;
+    deadline        = 60.0;
 }
 
 // *****************************************************************************
-void OpenCL_platform::Print() const
+OpenCL_Retry::OpenCL_Retry(const OpenCL_Retry_Policy &_policy)
 {
-    std_cout
-        << "    Platform information:\n"
-        << "        vendor:     " << vendor << "\n"
-        << "        name:       " << name << "\n"
-        << "        version:    " << version << "\n"
-        << "        extensions: " << extensions << "\n"
-        << "        id:         " << id << "\n"
-        << "        profile:    " << profile << "\n"
-        << "        key:        " << key << "\n"
-        << "        list:       " << platform_list << "\n"
-    ;
+    policy      = _policy;
+    attempt     = 1;
+    time_waited = 0.0;
 
-    std_cout
-        << "    Available OpenCL devices on platform:\n";
-    devices_list.Print();
+    // rand() is shared between threads; use a private seed.
+    seed = (unsigned int)getpid() * (unsigned int)time(NULL) ^ (unsigned int)(size_t)this;
 }
 
 // *****************************************************************************
-void OpenCL_platforms_list::Initialize(const std::string &_preferred_platform, const bool _use_locking)
+bool OpenCL_Retry::Prepare_Retry(double &delay)
+/**
+ * Called after a failed attempt.
+ * @param delay     Set to the time to wait before the next attempt
+ * @return          false if no more attempts are allowed by the policy
+ */
 {
-    preferred_platform = _preferred_platform;
-    use_locking = _use_locking;
-    if (use_locking)
-        std_cout << "OpenCL: File locking mechanism enabled. Will probably fail if run under a queueing system.\n" << std::flush;
-    else
-        std_cout << "OpenCL: File locking mechanism disabled. Must be disabled when using queueing system.\n" << std::flush;
-
-    cl_int err;
-    cl_uint nb_platforms;
-
-    Print_N_Times("-", 109);
-    std_cout << "OpenCL: Getting a list of platform(s)..." << std::flush;
+    if (attempt >= policy.max_attempts)
+        return false;
 
-    // Get number of platforms available
-    err = clGetPlatformIDs(0, NULL, &nb_platforms);
-    OpenCL_Test_Success(err, "clGetPlatformIDs");
-
-    if (nb_platforms == 0)
-    {
-        std_cout << "\nERROR: No OpenCL platform found! Exiting.\n";
-        abort();
-    }
+    if (policy.deadline > 0.0 and time_waited >= policy.deadline)
+        return false;
 
-    // Get a list of the OpenCL platforms available.
-    cl_platform_id *tmp_platforms;
-    tmp_platforms = new cl_platform_id[nb_platforms];
-    err = clGetPlatformIDs(nb_platforms, tmp_platforms, NULL);
-    OpenCL_Test_Success(err, "clGetPlatformIDs");
+    // Exponential backoff...
+    double base = policy.initial_delay;
+    for (int i = 1 ; i < attempt ; i++)
+        base *= policy.backoff_factor;
+    base = std::min(base, policy.max_delay);
 
-    std_cout << " done.\n";
+    // ...randomized so that processes in contention don't retry in lockstep...
+    const double u = double(rand_r(&seed)) / double(RAND_MAX);
+    delay = base * (1.0 + policy.jitter * (2.0*u - 1.0));
+    delay = std::max(0.0, std::min(delay, policy.max_delay));
 
-    if (nb_platforms == 1)
-        std_cout << "OpenCL: Initializing the available platform...\n";
-    else
-        std_cout << "OpenCL: Initializing the " << nb_platforms << " available platforms...\n";
+    // ...without going past the deadline.
+    if (policy.deadline > 0.0)
+        delay = std::min(delay, policy.deadline - time_waited);
 
-    char tmp_string[4096];
+    attempt++;
 
-    // Print the platform list first
-    for (unsigned int i = 0 ; i < nb_platforms ; i++)
-    {
-        cl_platform_id tmp_platform_id = tmp_platforms[i];
+    return true;
+}
 
-        err = clGetPlatformInfo(tmp_platform_id, CL_PLATFORM_VENDOR, sizeof(tmp_string), &tmp_string, NULL);
-        OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VENDOR)");
+// *****************************************************************************
+void OpenCL_Retry::Sleep(const double delay)
+{
+    const double start = Now();
+    Wait(delay);
+    time_waited += Now() - start;
+}
 
-        std_cout << "        (" << i+1 << "/" << nb_platforms << ") " << tmp_string << "\n";
-    }
+// *****************************************************************************
+bool Verify_if_Device_is_Used(const int device_id, const int platform_id_offset,
+                              const std::string &platform_name, const std::string &device_name,
+                              const bool quiet, const OpenCL_Retry_Policy &policy)
+{
+    return Verify_if_Lock_File_is_Used(Get_Lock_Filename(device_id, platform_id_offset, platform_name, device_name),
+                                       false, quiet, policy);
+}
 
-    // This offset allows distinguishing in LOCK_FILE the devices that can appear in different platforms.
-    int platform_id_offset = 0;
+// *****************************************************************************
+bool Verify_if_Lock_File_is_Used(const std::string &path, const bool shared, const bool quiet,
+                                 const OpenCL_Retry_Policy &policy)
+{
+    int check = Lock_File(path.c_str(), quiet, policy, NULL, shared);
 
-    // Add every platforms to the map
-    for (unsigned int i = 0 ; i < nb_platforms ; i++)
+    if (check == -1)
     {
-        cl_platform_id tmp_platform_id = tmp_platforms[i];
-
-        err = clGetPlatformInfo(tmp_platform_id, CL_PLATFORM_VENDOR, sizeof(tmp_string), &tmp_string, NULL);
-        OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VENDOR)");
-
-        std::string platform_vendor = std::string(tmp_string);
-        std::transform(platform_vendor.begin(), platform_vendor.end(), platform_vendor.begin(), tolower);
-        std::string key;
-        if      (platform_vendor.find("nvidia") != std::string::npos)
-            key = OPENCL_PLATFORMS_NVIDIA;
-        else if (platform_vendor.find("advanced micro devices") != std::string::npos or platform_vendor.find("amd") != std::string::npos)
-            key = OPENCL_PLATFORMS_AMD;
-        else if (platform_vendor.find("intel") != std::string::npos)
-            key = OPENCL_PLATFORMS_INTEL;
-        else if (platform_vendor.find("apple") != std::string::npos)
-            key = OPENCL_PLATFORMS_APPLE;
-        else
-        {
-            std_cout << "ERROR: Unknown OpenCL platform \"" << platform_vendor << "\"! Exiting.\n" << std::flush;
-            abort();
-        }
-
-        OpenCL_platform &platform = platforms[key];
-
-        platform.Initialize(key, platform_id_offset, tmp_platforms[i], this, preferred_platform);
-
-        ++platform_id_offset;
+        return true;                // Device is used
     }
-
-    delete[] tmp_platforms;
-
-    /*
-    // Debugging: Add dummy platform
+    else
     {
-        platforms["test"].vendor    = "Dummy Vendor";
-        platforms["test"].name      = "Dummy platform";
-        platforms["test"].version   = "Dummy Version 3.1415";
-        platforms["test"].extensions= "Dummy Extensions";
-        platforms["test"].profile   = "Dummy Profile";
-        ++nb_platforms;
+        Unlock_File(check, true);   // Close file, quiet == true
+        return false;               // Device not in use
     }
-    */
+}
 
-    // If the preferred platform is not specified, set it to the first one.
-    if (preferred_platform == "-1" or preferred_platform == "")
+// *****************************************************************************
+std::string OpenCL_Platform_Key(const std::string &_vendor)
+{
+    std::string vendor = _vendor;
+    std::transform(vendor.begin(), vendor.end(), vendor.begin(), tolower);
+
+    if      (vendor.find("nvidia") != std::string::npos)
+        return OPENCL_PLATFORMS_NVIDIA;
+    else if (vendor.find("advanced micro devices") != std::string::npos or vendor.find("amd") != std::string::npos)
+        return OPENCL_PLATFORMS_AMD;
+    else if (vendor.find("intel") != std::string::npos)
+        return OPENCL_PLATFORMS_INTEL;
+    else if (vendor.find("apple") != std::string::npos)
+        return OPENCL_PLATFORMS_APPLE;
+    else if (vendor.find("pocl") != std::string::npos or vendor.find("portable computing language") != std::string::npos)
+        return OPENCL_PLATFORMS_POCL;
+
+    // Unknown vendor: keep only alphanumeric characters, separated by underscores.
+    std::string key;
+    for (unsigned int i = 0 ; i < vendor.size() ; i++)
     {
-        preferred_platform = platforms.begin()->first;
+        if (isalnum(vendor[i]))
+            key += vendor[i];
+        else if (key.size() > 0 and key[key.size()-1] != '_')
+            key += '_';
     }
+    while (key.size() > 0 and key[key.size()-1] == '_')
+        key.erase(key.size()-1);
+    if (key == "")
+        key = "unknown";
 
-    // Initialize the best device on the preferred platform.
-    platforms[preferred_platform].devices_list.Set_Preferred_OpenCL();
+    return key;
 }
 
 // *****************************************************************************
-void OpenCL_platforms_list::Print() const
+OpenCL_Tuning_Profile::OpenCL_Tuning_Profile()
 {
-    std_cout << "OpenCL: Available platforms:\n";
-    std::map<std::string,OpenCL_platform>::const_iterator it = platforms.begin();
-    for (unsigned int i = 0 ; i < platforms.size() ; i++, it++)
-    {
-        it->second.Print();
-    }
+    compiler_options    = "";
+    local_size_multiple = 0;
+    zero_copy           = false;
+}
 
-    Print_Preferred();
+// *****************************************************************************
+std::map<std::string,OpenCL_Tuning_Profile> Default_Tuning_Profiles()
+{
+    std::map<std::string,OpenCL_Tuning_Profile> profiles;
+
+    // CPU runtimes vectorize work-items together: use work-groups filling
+    // the SIMD lanes. Options changing the numerics (-cl-mad-enable,
+    // -cl-denorms-are-zero) and zero-copy buffers are left to the
+    // application (OpenCL_Set_Tuning_Profile()).
+    OpenCL_Tuning_Profile cpu;
+    cpu.local_size_multiple = -1;
+    std::ostringstream key;
+    key << "*/" << CL_DEVICE_TYPE_CPU;
+    profiles[key.str()] = cpu;
+
+    return profiles;
 }
 
 // *****************************************************************************
-void OpenCL_platforms_list::Print_Preferred() const
+cl_device_type Tuning_Device_Type(const cl_device_type type)
+/**
+ * Runtimes can add CL_DEVICE_TYPE_DEFAULT (or others) to a device's type:
+ * profiles are registered by CPU, GPU or accelerator only.
+ */
 {
-    std::map<std::string,OpenCL_platform>::const_iterator it;
+    return (type & (CL_DEVICE_TYPE_CPU | CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_ACCELERATOR));
+}
+
+// *****************************************************************************
+std::map<std::string,OpenCL_Tuning_Profile> & Tuning_Profiles()
+/**
+ * Registered profiles, indexed by "<platform key>/<device type>".
+ */
+{
+    static std::map<std::string,OpenCL_Tuning_Profile> profiles = Default_Tuning_Profiles();
+    return profiles;
+}
+
+// *****************************************************************************
+void OpenCL_Set_Tuning_Profile(const std::string &platform_key, const cl_device_type device_type,
+                               const OpenCL_Tuning_Profile &profile)
+{
+    std::ostringstream key;
+    key << platform_key << "/" << Tuning_Device_Type(device_type);
+    Tuning_Profiles()[key.str()] = profile;
+}
+
+// *****************************************************************************
+OpenCL_Tuning_Profile OpenCL_Get_Tuning_Profile(const std::string &platform_key, const cl_device_type device_type)
+{
+    std::map<std::string,OpenCL_Tuning_Profile> &profiles = Tuning_Profiles();
+    std::map<std::string,OpenCL_Tuning_Profile>::const_iterator it;
+
+    std::ostringstream key;
+    key << platform_key << "/" << Tuning_Device_Type(device_type);
+    it = profiles.find(key.str());
+    if (it != profiles.end())
+        return it->second;
+
+    std::ostringstream default_key;
+    default_key << "*/" << Tuning_Device_Type(device_type);
+    it = profiles.find(default_key.str());
+    if (it != profiles.end())
+        return it->second;
+
+    return OpenCL_Tuning_Profile();
+}
+
+// *****************************************************************************
+OpenCL_Tuning_Profile OpenCL_Get_Tuning_Profile(cl_device_id device)
+/**
+ * Profile of a device, with the SIMD width resolved.
+ */
+{
+    cl_int err;
+    cl_platform_id platform;
+    cl_device_type type;
+    char vendor[4096];
+    err  = clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, NULL);
+    err |= clGetDeviceInfo(device, CL_DEVICE_TYPE,     sizeof(cl_device_type), &type,     NULL);
+    OpenCL_Test_Success(err, "clGetDeviceInfo()");
+    err = clGetPlatformInfo(platform, CL_PLATFORM_VENDOR, sizeof(vendor), &vendor, NULL);
+    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VENDOR)");
+
+    OpenCL_Tuning_Profile profile = OpenCL_Get_Tuning_Profile(OpenCL_Platform_Key(vendor), type);
+
+    if (profile.local_size_multiple < 0)
+    {
+        cl_uint simd_width;
+        err = clGetDeviceInfo(device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, sizeof(cl_uint), &simd_width, NULL);
+        OpenCL_Test_Success(err, "clGetDeviceInfo()");
+        profile.local_size_multiple = int(simd_width);
+    }
+
+    return profile;
+}
+
+// *****************************************************************************
+namespace OclUtils
+{
+    struct Task_Queue
+    {
+        pthread_mutex_t     mutex;
+        Task_Function       fct;
+        void              **args;
+        int                 nb_tasks;
+        int                 next_task;
+    };
+
+    // *************************************************************************
+    void * Task_Queue_Worker(void *_queue)
+    {
+        Task_Queue *queue = (Task_Queue *) _queue;
+        while (true)
+        {
+            pthread_mutex_lock(&queue->mutex);
+            const int task = queue->next_task++;
+            pthread_mutex_unlock(&queue->mutex);
+
+            if (task >= queue->nb_tasks)
+                break;
+
+            queue->fct(queue->args[task]);
+        }
+        return NULL;
+    }
+
+    // *************************************************************************
+    // Threads spawned by all the running pools. Nested pools (devices
+    // initialized from a platform's task) share the same budget, so that
+    // at most "max_threads" threads work at once overall.
+    pthread_mutex_t spawned_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+    int             nb_spawned_threads    = 0;
+
+    // *************************************************************************
+    int Reserve_Threads(const int wanted, const int max_threads)
+    /**
+     * Reserve up to "wanted" threads to spawn, the calling thread not
+     * counted. Returns how many were granted (possibly 0).
+     */
+    {
+        pthread_mutex_lock(&spawned_threads_mutex);
+        const int granted = std::max(0, std::min(wanted, max_threads - 1 - nb_spawned_threads));
+        nb_spawned_threads += granted;
+        pthread_mutex_unlock(&spawned_threads_mutex);
+        return granted;
+    }
+
+    // *************************************************************************
+    void Release_Threads(const int count)
+    {
+        pthread_mutex_lock(&spawned_threads_mutex);
+        nb_spawned_threads -= count;
+        pthread_mutex_unlock(&spawned_threads_mutex);
+    }
+
+    // *************************************************************************
+    void Run_Concurrently(Task_Function fct, void **args, const int nb_tasks, const int max_threads)
+    /**
+     * Small thread pool: the tasks are picked in order by at most
+     * "max_threads" workers, the calling thread being one of them. The
+     * limit is global: a nested call only spawns the threads left unused
+     * by the enclosing pools, the calling thread always working.
+     */
+    {
+        const int nb_threads = 1 + Reserve_Threads(std::min(nb_tasks, max_threads) - 1, max_threads);
+
+        // Nothing to gain from spawning threads, or no thread left.
+        if (nb_threads <= 1)
+        {
+            for (int i = 0 ; i < nb_tasks ; i++)
+                fct(args[i]);
+            return;
+        }
+
+        Task_Queue queue;
+        pthread_mutex_init(&queue.mutex, NULL);
+        queue.fct       = fct;
+        queue.args      = args;
+        queue.nb_tasks  = nb_tasks;
+        queue.next_task = 0;
+
+        // If a thread cannot be created, the remaining workers (at least
+        // the calling thread) will simply pick up more tasks.
+        std::vector<pthread_t> threads;
+        for (int i = 0 ; i < nb_threads-1 ; i++)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, Task_Queue_Worker, &queue) == 0)
+                threads.push_back(thread);
+        }
+
+        Task_Queue_Worker(&queue);
+
+        for (unsigned int i = 0 ; i < threads.size() ; i++)
+            pthread_join(threads[i], NULL);
+        Release_Threads(nb_threads-1);
+
+        pthread_mutex_destroy(&queue.mutex);
+    }
+}
+
+// *****************************************************************************
+std::vector<int> Read_Sysfs_List(const std::string &path)
+/**
+ * Content of a sysfs list file (format is a list of ranges: "0-3,6"), in
+ * increasing order. Empty if the file cannot be read.
+ */
+{
+    std::vector<int> values;
+    std::ifstream file(path.c_str());
+    if (not file.is_open())
+        return values;
+
+    std::string list;
+    std::getline(file, list);
+    std::istringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ','))
+    {
+        int first, last;
+        const int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1)
+            continue;
+        if (n == 1)
+            last = first;
+        for (int value = first ; value <= last ; value++)
+            values.push_back(value);
+    }
+
+    return values;
+}
+
+// *****************************************************************************
+std::vector<int> NUMA_Nodes_with_CPUs()
+/**
+ * List of the NUMA nodes having CPUs, in increasing order. Empty if unknown.
+ */
+{
+    std::vector<int> nodes = Read_Sysfs_List("/sys/devices/system/node/has_cpu");
+    if (nodes.empty())
+        nodes = Read_Sysfs_List("/sys/devices/system/node/online");
+    return nodes;
+}
+
+#ifdef CL_VERSION_1_2
+// *****************************************************************************
+int Sub_Device_NUMA_Node(const cl_device_id sub_device, const cl_uint index, const cl_uint nb_sub_devices)
+/**
+ * NUMA node of the "index"-th of the "nb_sub_devices" sub-devices created by
+ * partitioning by NUMA affinity domain. OpenCL does not report which cores a
+ * sub-device runs on, but runtimes create one sub-device per node, in the
+ * nodes' order: the "index"-th node having CPUs is taken, the sub-device's
+ * number of compute units only confirming it. -1 if unknown.
+ */
+{
+    // Make sure the sub-device really is a NUMA domain.
+    cl_device_partition_property partition[3] = {0, 0, 0};
+    if (clGetDeviceInfo(sub_device, CL_DEVICE_PARTITION_TYPE, sizeof(partition), partition, NULL) != CL_SUCCESS
+        or partition[0] != CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN
+        or partition[1] != CL_DEVICE_AFFINITY_DOMAIN_NUMA)
+        return -1;
+
+    // One sub-device per node, or the order tells nothing.
+    const std::vector<int> nodes = NUMA_Nodes_with_CPUs();
+    if (nodes.size() != nb_sub_devices or index >= nb_sub_devices)
+        return -1;
+
+    cl_uint nb_compute_units = 0;
+    if (clGetDeviceInfo(sub_device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &nb_compute_units, NULL) != CL_SUCCESS)
+        return -1;
+
+    std::ostringstream path;
+    path << "/sys/devices/system/node/node" << nodes[index] << "/cpulist";
+    if (Read_Sysfs_List(path.str()).size() != nb_compute_units)
+        return -1;
+
+    return nodes[index];
+}
+#endif // #ifdef CL_VERSION_1_2
+
+// *****************************************************************************
+int PCI_NUMA_Node(const cl_uint domain, const cl_uint bus, const cl_uint device, const cl_uint function)
+/**
+ * NUMA node a PCI device is attached to, as reported by the kernel. -1 if unknown.
+ */
+{
+    char path[256];
+    sprintf(path, "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node", domain, bus, device, function);
+    std::ifstream file(path);
+    int node = -1;
+    if (not (file >> node))
+        node = -1;
+    return node;
+}
+
+// *****************************************************************************
+void * OpenCL_NUMA_Allocate(const size_t size, const int numa_node)
+{
+    void *p = NULL;
+#ifdef OCLUTILS_HAVE_NUMA
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        OpenCL_Log_Error("ERROR: Could not allocate " << Bytes_in_String(size) << " of host memory!\n");
+        abort();
+    }
+
+    if (numa_node >= 0)
+    {
+        // "Preferred" instead of "bind": when the node is full, spill on other nodes instead of failing.
+        const int nb_bits_per_long = 8 * sizeof(unsigned long);
+        unsigned long nodemask[1024 / (8 * sizeof(unsigned long))];
+        memset(nodemask, 0, sizeof(nodemask));
+        if (numa_node < 1024)
+            nodemask[numa_node / nb_bits_per_long] = 1UL << (numa_node % nb_bits_per_long);
+
+        // The kernel reads "maxnode - 1" bits.
+        if (syscall(SYS_mbind, p, size, MPOL_PREFERRED, nodemask, 8 * sizeof(nodemask) + 1, 0) != 0)
+            OpenCL_Log_Warning("OpenCL: WARNING: Could not place host memory on NUMA node " << numa_node << " (" << strerror(errno) << ").\n");
+    }
+#else // #ifdef OCLUTILS_HAVE_NUMA
+    if (posix_memalign(&p, sysconf(_SC_PAGESIZE), size) != 0)
+    {
+        OpenCL_Log_Error("ERROR: Could not allocate " << Bytes_in_String(size) << " of host memory!\n");
+        abort();
+    }
+#endif // #ifdef OCLUTILS_HAVE_NUMA
+
+    // First touch: allocate the pages now, following the policy.
+    memset(p, 0, size);
+
+    return p;
+}
+
+// *****************************************************************************
+void * OpenCL_NUMA_Allocate(const size_t size, const OpenCL_device &device)
+{
+    void *p = OpenCL_NUMA_Allocate(size, device.Get_NUMA_Node());
+
+    OpenCL_Log_Info("OpenCL: Allocated " << Bytes_in_String(size) << " of host memory on NUMA node " << OpenCL_NUMA_Node_of(p)
+              << " (device \"" << device.Get_Name() << "\" is on node " << device.Get_NUMA_Node() << ").\n");
+
+    return p;
+}
+
+// *****************************************************************************
+void OpenCL_NUMA_Free(void *p, const size_t size)
+{
+    if (p == NULL)
+        return;
+#ifdef OCLUTILS_HAVE_NUMA
+    munmap(p, size);
+#else // #ifdef OCLUTILS_HAVE_NUMA
+    free(p);
+#endif // #ifdef OCLUTILS_HAVE_NUMA
+}
+
+// *****************************************************************************
+int OpenCL_NUMA_Node_of(const void *p)
+{
+    int node = -1;
+#ifdef OCLUTILS_HAVE_NUMA
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, p, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        node = -1;
+#endif // #ifdef OCLUTILS_HAVE_NUMA
+    return node;
+}
+
+// *****************************************************************************
+void Device_Names(cl_device_id device, std::string &platform_name, std::string &device_name)
+/**
+ * Names of a device and of its platform, for the startup profile.
+ */
+{
+    char tmp_string[4096] = "";
+    cl_platform_id platform = NULL;
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(tmp_string)-1, tmp_string, NULL);
+    device_name = tmp_string;
+    tmp_string[0] = '\0';
+    if (clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(cl_platform_id), &platform, NULL) == CL_SUCCESS)
+        clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(tmp_string)-1, tmp_string, NULL);
+    platform_name = tmp_string;
+}
+
+// *****************************************************************************
+char *read_opencl_kernel(const std::string filename, int *length)
+{
+    FILE *f = fopen(filename.c_str(), "r");
+    void *buffer;
+
+    if (!f)
+    {
+        OpenCL_Log_Error("OpenCL: Unable to open " << filename << " for reading\n");
+        abort();
+    }
+
+    fseek(f, 0, SEEK_END);
+    *length = int(ftell(f));
+    fseek(f, 0, SEEK_SET);
+
+    buffer = malloc(*length+1);
+    *length = int(fread(buffer, 1, *length, f));
+    fclose(f);
+    ((char*)buffer)[*length] = '\0';
+
+    return (char*)buffer;
+}
+
+// *****************************************************************************
+OpenCL_platform::OpenCL_platform()
+{
+    id      = NULL;
+    vendor  = "Not set";
+    name    = "Not set";
+    version = "Not set";
+    extensions = "Not set";
+    profile = "Not set";
+    id_offset  = 0;
+}
+
+// *****************************************************************************
+void OpenCL_platform::Initialize(const std::string _key, int _id_offset, cl_platform_id _id,
+                                 OpenCL_platforms_list *_platform_list,
+                                 const std::string preferred_platform)
+{
+    key             = _key;
+    id_offset       = _id_offset;
+    id              = _id;
+    platform_list   = _platform_list;
+
+    cl_int err;
+    char tmp_string[4096];
+
+    // Query platform information
+    const double info_start = Now();
+    err = clGetPlatformInfo(id, CL_PLATFORM_PROFILE, sizeof(tmp_string), &tmp_string, NULL);
+    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_PROFILE)");
+    profile = std::string(tmp_string);
+
+    err = clGetPlatformInfo(id, CL_PLATFORM_VERSION, sizeof(tmp_string), &tmp_string, NULL);
+    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VERSION)");
+    version = std::string(tmp_string);
+
+    err = clGetPlatformInfo(id, CL_PLATFORM_NAME, sizeof(tmp_string), &tmp_string, NULL);
+    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_NAME)");
+    name = std::string(tmp_string);
+
+    err = clGetPlatformInfo(id, CL_PLATFORM_VENDOR, sizeof(tmp_string), &tmp_string, NULL);
+    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VENDOR)");
+    vendor = std::string(tmp_string);
+
+    err = clGetPlatformInfo(id, CL_PLATFORM_EXTENSIONS, sizeof(tmp_string), &tmp_string, NULL);
+    OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_EXTENSIONS)");
+    extensions = std::string(tmp_string);
+    OpenCL_Startup_Profile::Instance().Record(OPENCL_STARTUP_PLATFORM_INFO, name, "", info_start, Now());
+
+    // Initialize the platform's devices
+    devices_list.Initialize(*this, preferred_platform);
+}
+
+// *****************************************************************************
+void OpenCL_platform::Print_Preferred() const
+{
+    Print_N_Times("-", 109);
+    std_cout << "OpenCL: Platform and device to be used:\n";
+    std_cout << "OpenCL: Platform's name:             " << Name() << "\n";
+    std_cout << "OpenCL: Platform's best device:      " << devices_list.preferred_device->Get_Name() << " (id = "
+                                                        << devices_list.preferred_device->Get_ID()   << ")\n";
+    Print_N_Times("-", 109);
+}
+// *****************************************************************************
+void OpenCL_platform::Lock_Best_Device()
+{
+    if (not platform_list->Is_Waiting_for_Device())
+        devices_list.Probe_Until_Free();
+
+    if (not Preferred_OpenCL().Is_Lockable() or Preferred_OpenCL().Is_Locked())
+        return;
+
+    // Processes waiting in line (Wait_for_Free_Device()) are served first.
+    const std::string queue_directory = Device_Queue_Directory(name);
+    if (platform_list->Is_Waiting_for_Device())
+    {
+        // Get behind them.
+        if (Device_Queue_Is_Empty(queue_directory))
+            Preferred_OpenCL().Lock();
+        else
+            devices_list.Wait_for_Free_Device();
+        return;
+    }
+
+    // Not waiting in line: give them the retry policy's time to be served, then give up.
+    OpenCL_Retry retry(platform_list->Retry_Policy());
+    double delay;
+    while (not Device_Queue_Is_Empty(queue_directory))
+    {
+        if (not retry.Prepare_Retry(delay))
+        {
+            OpenCL_Log_Error("Other processes are waiting for a device on platform '" << name << "'!\n");
+            abort();
+        }
+        char delay_string[64];
+        sprintf(delay_string, "%.4f", delay);
+        OpenCL_Log_Warning(
+               "OpenCL: WARNING: Other processes are waiting for a device on platform '" << name << "'.\n"
+            << "                 Waiting " << delay_string << " seconds before checking again (" << retry.Attempt() << "/" << retry.Max_Attempts() << ")...\n");
+        retry.Sleep(delay);
+    }
+    Preferred_OpenCL().Lock();
+}
+
+// *****************************************************************************
+void OpenCL_platform::Print() const
+{
+    std_cout
+        << "    Platform information:\n"
+        << "        vendor:     " << vendor << "\n"
+        << "        name:       " << name << "\n"
+        << "        version:    " << version << "\n"
+        << "        extensions: " << extensions << "\n"
+        << "        id:         " << id << "\n"
+        << "        profile:    " << profile << "\n"
+        << "        key:        " << key << "\n"
+        << "        list:       " << platform_list << "\n"
+    ;
+
+    std_cout
+        << "    Available OpenCL devices on platform:\n";
+    devices_list.Print();
+}
+
+// *****************************************************************************
+struct Platform_Init_Task
+{
+    OpenCL_platform            *platform;
+    std::string                 key;
+    int                         id_offset;
+    cl_platform_id              id;
+    OpenCL_platforms_list      *platform_list;
+    std::string                 preferred_platform;
+};
+
+// *****************************************************************************
+void Initialize_Platform_Task(void *_task)
+{
+    Platform_Init_Task *task = (Platform_Init_Task *) _task;
+    task->platform->Initialize(task->key, task->id_offset, task->id, task->platform_list, task->preferred_platform);
+}
+
+// *****************************************************************************
+OpenCL_platforms_list::OpenCL_platforms_list()
+{
+    preferred_platform  = "-1";
+    use_locking         = true;
+    max_init_threads    = 8;
+    use_benchmark_ranking = false;
+    device_slots        = 1;
+    memory_per_slot     = 0;
+    use_registry        = true;
+    use_least_loaded    = false;
+    wait_for_device     = false;
+    wait_timeout        = -1.0;
+    device_granted_callback = NULL;
+    device_granted_data = NULL;
+}
+
+// *****************************************************************************
+void OpenCL_platforms_list::Initialize(const std::string &_preferred_platform, const bool _use_locking)
+{
+    preferred_platform = _preferred_platform;
+    use_locking = _use_locking;
+    if (use_locking)
+        OpenCL_Log_Info("OpenCL: File locking mechanism enabled. Will probably fail if run under a queueing system.\n");
+    else
+        OpenCL_Log_Info("OpenCL: File locking mechanism disabled. Must be disabled when using queueing system.\n");
+
+    cl_int err;
+    cl_uint nb_platforms;
+
+    OpenCL_Log_Info(std::string(109, '-') << "\n");
+    OpenCL_Log_Info("OpenCL: Getting a list of platform(s)...");
+    const double enumeration_start = Now();
+
+    // Get number of platforms available
+    err = clGetPlatformIDs(0, NULL, &nb_platforms);
+    OpenCL_Test_Success(err, "clGetPlatformIDs");
+
+    if (nb_platforms == 0)
+    {
+        OpenCL_Log_Error("\nERROR: No OpenCL platform found! Exiting.\n");
+        abort();
+    }
+
+    // Get a list of the OpenCL platforms available.
+    cl_platform_id *tmp_platforms;
+    tmp_platforms = new cl_platform_id[nb_platforms];
+    err = clGetPlatformIDs(nb_platforms, tmp_platforms, NULL);
+    OpenCL_Test_Success(err, "clGetPlatformIDs");
+
+    OpenCL_Log_Info(" done.\n");
+
+    if (nb_platforms == 1)
+        OpenCL_Log_Info("OpenCL: Initializing the available platform...\n");
+    else
+        OpenCL_Log_Info("OpenCL: Initializing the " << nb_platforms << " available platforms...\n");
+
+    char tmp_string[4096];
+
+    // Print the platform list first
+    for (unsigned int i = 0 ; i < nb_platforms ; i++)
+    {
+        cl_platform_id tmp_platform_id = tmp_platforms[i];
+
+        err = clGetPlatformInfo(tmp_platform_id, CL_PLATFORM_VENDOR, sizeof(tmp_string), &tmp_string, NULL);
+        OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VENDOR)");
+
+        OpenCL_Log_Info("        (" << i+1 << "/" << nb_platforms << ") " << tmp_string << "\n");
+    }
+    OpenCL_Startup_Profile::Instance().Record(OPENCL_STARTUP_ENUMERATION, "", "", enumeration_start, Now());
+
+    // This offset allows distinguishing in LOCK_FILE the devices that can appear in different platforms.
+    // It is assigned here, serially, so that the numbering does not depend on the order
+    // in which the (concurrent) initialization of the platforms completes.
+    int platform_id_offset = 0;
+
+    // Add every platforms to the map
+    std::vector<Platform_Init_Task> tasks;
+    for (unsigned int i = 0 ; i < nb_platforms ; i++)
+    {
+        cl_platform_id tmp_platform_id = tmp_platforms[i];
+
+        err = clGetPlatformInfo(tmp_platform_id, CL_PLATFORM_VENDOR, sizeof(tmp_string), &tmp_string, NULL);
+        OpenCL_Test_Success(err, "clGetPlatformInfo (CL_PLATFORM_VENDOR)");
+
+        // Two platforms can share a vendor (e.g. Intel's CPU and GPU runtimes):
+        // give the next ones a numbered key so that none of them gets lost.
+        const std::string vendor_key = OpenCL_Platform_Key(std::string(tmp_string));
+        std::string key = vendor_key;
+        for (int n = 2 ; platforms.find(key) != platforms.end() ; n++)
+        {
+            char suffix[32];
+            sprintf(suffix, "_%d", n);
+            key = vendor_key + suffix;
+        }
+        if (key != vendor_key)
+            OpenCL_Log_Warning("OpenCL: WARNING: Platform " << i+1 << " (" << tmp_string << ") shares the key \"" << vendor_key
+                               << "\" with a previous platform. Using key \"" << key << "\" for it.\n");
+
+        // The map must not be modified while the platforms are being initialized,
+        // so create the entries now.
+        Platform_Init_Task task;
+        task.platform           = &platforms[key];
+        task.key                = key;
+        task.id_offset          = platform_id_offset;
+        task.id                 = tmp_platforms[i];
+        task.platform_list      = this;
+        task.preferred_platform = preferred_platform;
+        tasks.push_back(task);
+
+        ++platform_id_offset;
+    }
+
+    // Initialize all platforms (and their devices) concurrently. Some drivers
+    // take a long time to answer, so the total time is bounded by the slowest
+    // platform instead of the sum of all of them.
+    std::vector<void *> tasks_args(tasks.size());
+    for (unsigned int i = 0 ; i < tasks.size() ; i++)
+        tasks_args[i] = &tasks[i];
+    OclUtils::Run_Concurrently(Initialize_Platform_Task, &tasks_args[0], int(tasks.size()), max_init_threads);
+
+    // Now that every platform is done, print what happened in a deterministic order.
+    for (unsigned int i = 0 ; i < tasks.size() ; i++)
+        OpenCL_Log_Info(tasks[i].platform->devices_list.Init_Log());
+
+    delete[] tmp_platforms;
+
+    /*
+    // Debugging: Add dummy platform
+    {
+        platforms["test"].vendor    = "Dummy Vendor";
+        platforms["test"].name      = "Dummy platform";
+        platforms["test"].version   = "Dummy Version 3.1415";
+        platforms["test"].extensions= "Dummy Extensions";
+        platforms["test"].profile   = "Dummy Profile";
+        ++nb_platforms;
+    }
+    */
+
+    // If the preferred platform is not specified, set it to the first one
+    // having a free device meeting the requirements (or just the first one).
+    if (preferred_platform == "-1" or preferred_platform == "")
+    {
+        preferred_platform = platforms.begin()->first;
+        for (std::map<std::string,OpenCL_platform>::iterator it = platforms.begin() ; it != platforms.end() ; ++it)
+        {
+            if (it->second.devices_list.Nb_Usable_Devices() > 0)
+            {
+                preferred_platform = it->first;
+                break;
+            }
+        }
+    }
+
+    // Initialize the best device on the preferred platform.
+    if (wait_for_device and use_locking)
+        platforms[preferred_platform].devices_list.Wait_for_Free_Device();
+    else
+        platforms[preferred_platform].devices_list.Set_Preferred_OpenCL();
+}
+
+// *****************************************************************************
+void OpenCL_platforms_list::Print() const
+{
+    std_cout << "OpenCL: Available platforms:\n";
+    std::map<std::string,OpenCL_platform>::const_iterator it = platforms.begin();
+    for (unsigned int i = 0 ; i < platforms.size() ; i++, it++)
+    {
+        it->second.Print();
+    }
+
+    Print_Preferred();
+}
+
+// *****************************************************************************
+void OpenCL_platforms_list::Print_Preferred() const
+{
+    std::map<std::string,OpenCL_platform>::const_iterator it;
     it = platforms.find(preferred_platform);
     if (it == platforms.end())
     {
-        std_cout << "ERROR: Cannot find platform '" << preferred_platform << "'. Aborting.\n" << std::flush;
+        OpenCL_Log_Error("ERROR: Cannot find platform '" << preferred_platform << "'. Aborting.\n");
         abort();
     }
     assert(it->second.devices_list.preferred_device != NULL);
@@ -542,7 +1341,7 @@ OpenCL_platform & OpenCL_platforms_list::operator[](const std::string key)
     {
         if (platforms.size() == 0)
         {
-            std_cout << "ERROR: Trying to access a platform but the list is uninitialized! Aborting.\n" << std::flush;
+            OpenCL_Log_Error("ERROR: Trying to access a platform but the list is uninitialized! Aborting.\n");
             abort();
         }
         // Just take the first one.
@@ -555,7 +1354,7 @@ OpenCL_platform & OpenCL_platforms_list::operator[](const std::string key)
         if (it == platforms.end())
         {
             Print();
-            std_cout << "Cannot find platform \"" << key << "\"! Aborting.\n" << std::flush;
+            OpenCL_Log_Error("Cannot find platform \"" << key << "\"! Aborting.\n");
             abort();
         }
     }
@@ -568,6 +1367,61 @@ void OpenCL_platforms_list::Set_Preferred_OpenCL(const int _preferred_device)
     platforms[preferred_platform].devices_list.Set_Preferred_OpenCL(_preferred_device);
 }
 
+// *****************************************************************************
+OpenCL_Device_Requirements::OpenCL_Device_Requirements()
+{
+    device_type             = CL_DEVICE_TYPE_ALL;
+    min_global_mem_size     = 0;
+    min_max_mem_alloc_size  = 0;
+    min_local_mem_size      = 0;
+    extensions              = "";
+    vendor                  = "";
+}
+
+// *****************************************************************************
+bool OpenCL_Device_Requirements::Is_Satisfied_By(const OpenCL_device &device, std::string &reason) const
+/**
+ * @param reason    Set to what the device lacks when it does not satisfy the requirements
+ */
+{
+    reason = "";
+
+    if ((device.Get_Type() & device_type) == 0)
+        reason += "wrong device type, ";
+    if (device.Get_Global_Mem_Size() < min_global_mem_size)
+        reason += "not enough global memory (" + Bytes_in_String(device.Get_Global_Mem_Size()) + "), ";
+    if (device.Get_Max_Mem_Alloc_Size() < min_max_mem_alloc_size)
+        reason += "maximum allocation too small (" + Bytes_in_String(device.Get_Max_Mem_Alloc_Size()) + "), ";
+    if (device.Get_Local_Mem_Size() < min_local_mem_size)
+        reason += "not enough local memory (" + Bytes_in_String(device.Get_Local_Mem_Size()) + "), ";
+
+    // Compare whole words only ("cl_khr_fp64" should not match "cl_khr_fp64_foo").
+    const std::string device_extensions = " " + device.Get_Extensions() + " ";
+    std::istringstream required_extensions(extensions);
+    std::string extension;
+    while (required_extensions >> extension)
+    {
+        if (device_extensions.find(" " + extension + " ") == std::string::npos)
+            reason += "missing " + extension + ", ";
+    }
+
+    if (vendor != "")
+    {
+        std::string device_vendor = device.Get_Vendor();
+        std::string wanted_vendor = vendor;
+        std::transform(device_vendor.begin(), device_vendor.end(), device_vendor.begin(), tolower);
+        std::transform(wanted_vendor.begin(), wanted_vendor.end(), wanted_vendor.begin(), tolower);
+        if (device_vendor.find(wanted_vendor) == std::string::npos)
+            reason += "wrong vendor, ";
+    }
+
+    if (reason == "")
+        return true;
+
+    reason.erase(reason.size()-2);  // Remove trailing ", "
+    return false;
+}
+
 // *****************************************************************************
 OpenCL_device::OpenCL_device()
 {
@@ -582,26 +1436,243 @@ OpenCL_device::OpenCL_device()
     device_is_in_use            = false;
     is_lockable                 = true;
     file_locked                 = false;
+    unlock_with_context         = false;
+    lock_time_waited            = 0.0;
+    context_time_waited         = 0.0;
+    ranking_score               = 0.0;
+    load                        = 0.0;
+    numa_node                   = -1;
+    meets_requirements          = true;
+    parent_device               = NULL;
+    partition_name              = "";
+    is_partitioned              = false;
+    parent_lock_file            = -1;
+    slot                        = -1;
+    slot_lock_file              = -1;
+    pthread_mutex_init(&command_queues_mutex, NULL);
 }
 
 // *****************************************************************************
 OpenCL_device::~OpenCL_device()
 {
     Destructor();
+    pthread_mutex_destroy(&command_queues_mutex);
+
+#ifdef CL_VERSION_1_2
+    // Sub-devices were created by us (clCreateSubDevices()), not by the platform.
+    if (parent_device != NULL and device != NULL)
+    {
+        clReleaseDevice(device);
+        device = NULL;
+    }
+#endif // #ifdef CL_VERSION_1_2
 }
 
 // *****************************************************************************
 void OpenCL_device::Destructor()
 {
+    Release_Context();
+
+    Unlock();
+}
+
+// *****************************************************************************
+void OpenCL_device::Release_Context()
+{
+    Release_Command_Queues();
+
     if (context)
+    {
         clReleaseContext(context);
+        context = NULL;
+    }
 
-    Unlock();
+    if (unlock_with_context)
+    {
+        unlock_with_context = false;
+        Unlock();
+    }
+}
+
+// *****************************************************************************
+// Per thread queues are released when their thread exits. Each thread keeps
+// (in a thread-specific key) the devices it created queues on. Devices are
+// forgotten once their queues are released, so that an exiting thread never
+// touches a device that was destroyed.
+pthread_key_t               thread_queues_key;
+pthread_once_t              thread_queues_key_once = PTHREAD_ONCE_INIT;
+std::vector<OpenCL_device *> devices_with_thread_queues;
+pthread_mutex_t             devices_with_thread_queues_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// *****************************************************************************
+void Release_Thread_Queues(void *_devices)
+{
+    std::vector<OpenCL_device *> *devices = (std::vector<OpenCL_device *> *) _devices;
+
+    pthread_mutex_lock(&devices_with_thread_queues_mutex);
+    for (size_t i = 0 ; i < devices->size() ; i++)
+    {
+        if (std::find(devices_with_thread_queues.begin(), devices_with_thread_queues.end(), (*devices)[i]) != devices_with_thread_queues.end())
+            (*devices)[i]->Release_Thread_Command_Queues(pthread_self());
+    }
+    pthread_mutex_unlock(&devices_with_thread_queues_mutex);
+
+    delete devices;
+}
+
+// *****************************************************************************
+void Create_Thread_Queues_Key()
+{
+    pthread_key_create(&thread_queues_key, Release_Thread_Queues);
+}
+
+// *****************************************************************************
+void Remember_Thread_Queue(OpenCL_device *device)
+/**
+ * The calling thread created a queue on "device": release it when the thread exits.
+ */
+{
+    pthread_once(&thread_queues_key_once, Create_Thread_Queues_Key);
+
+    std::vector<OpenCL_device *> *devices = (std::vector<OpenCL_device *> *) pthread_getspecific(thread_queues_key);
+    if (devices == NULL)
+    {
+        devices = new std::vector<OpenCL_device *>;
+        pthread_setspecific(thread_queues_key, devices);
+    }
+    if (std::find(devices->begin(), devices->end(), device) == devices->end())
+        devices->push_back(device);
+
+    pthread_mutex_lock(&devices_with_thread_queues_mutex);
+    if (std::find(devices_with_thread_queues.begin(), devices_with_thread_queues.end(), device) == devices_with_thread_queues.end())
+        devices_with_thread_queues.push_back(device);
+    pthread_mutex_unlock(&devices_with_thread_queues_mutex);
+}
+
+// *****************************************************************************
+cl_command_queue OpenCL_device::Get_Command_Queue(const cl_command_queue_properties properties)
+{
+    return Find_Command_Queue(-1, properties);
+}
+
+// *****************************************************************************
+cl_command_queue OpenCL_device::Get_Stream_Queue(const int stream, const cl_command_queue_properties properties)
+{
+    assert(stream >= 0);
+    return Find_Command_Queue(stream, properties);
+}
+
+// *****************************************************************************
+cl_command_queue OpenCL_device::Find_Command_Queue(const int stream, cl_command_queue_properties properties)
+/**
+ * Queue of the pool for "stream" (or for the calling thread if -1), created if needed.
+ */
+{
+    if (context == NULL)
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: Can't create a command queue on " << name << ": it has no context.\n");
+        abort();
+    }
+
+    const cl_command_queue_properties unsupported = properties & ~queue_properties;
+    if (unsupported != 0)
+    {
+        OpenCL_Log_Warning("OpenCL: WARNING: Device " << name << " does not support the command queue properties 0x"
+                 << std::hex << unsupported << std::dec << ". Ignoring them.\n");
+        properties &= queue_properties;
+    }
+
+    const pthread_t thread = pthread_self();
+
+    pthread_mutex_lock(&command_queues_mutex);
+    cl_command_queue queue = NULL;
+    for (size_t i = 0 ; i < command_queues.size() and queue == NULL ; i++)
+    {
+        const Command_Queue_Entry &entry = command_queues[i];
+        if (entry.stream == stream and entry.properties == properties and
+            (stream >= 0 or pthread_equal(entry.thread, thread)))
+        {
+            queue = entry.queue;
+        }
+    }
+
+    bool created = false;
+    if (queue == NULL)
+    {
+        cl_int err;
+        queue = clCreateCommandQueue(context, device, properties, &err);
+        OpenCL_Test_Success(err, "clCreateCommandQueue()");
+
+        Command_Queue_Entry entry;
+        entry.queue         = queue;
+        entry.properties    = properties;
+        entry.thread        = thread;
+        entry.stream        = stream;
+        command_queues.push_back(entry);
+        created = true;
+    }
+    pthread_mutex_unlock(&command_queues_mutex);
+
+    // Not under the device's lock: Release_Thread_Queues() takes the locks the other way around.
+    if (created and stream < 0)
+        Remember_Thread_Queue(this);
+
+    return queue;
+}
+
+// *****************************************************************************
+void OpenCL_device::Release_Command_Queues()
+{
+    // The exiting threads have nothing left to release here.
+    pthread_mutex_lock(&devices_with_thread_queues_mutex);
+    std::vector<OpenCL_device *>::iterator it = std::find(devices_with_thread_queues.begin(), devices_with_thread_queues.end(), this);
+    if (it != devices_with_thread_queues.end())
+        devices_with_thread_queues.erase(it);
+    pthread_mutex_unlock(&devices_with_thread_queues_mutex);
+
+    pthread_mutex_lock(&command_queues_mutex);
+    for (size_t i = 0 ; i < command_queues.size() ; i++)
+    {
+        clFinish(command_queues[i].queue);
+        clReleaseCommandQueue(command_queues[i].queue);
+    }
+    command_queues.clear();
+    pthread_mutex_unlock(&command_queues_mutex);
+}
+
+// *****************************************************************************
+void OpenCL_device::Release_Thread_Command_Queues(const pthread_t thread)
+{
+    pthread_mutex_lock(&command_queues_mutex);
+    for (size_t i = 0 ; i < command_queues.size() ; )
+    {
+        if (command_queues[i].stream < 0 and pthread_equal(command_queues[i].thread, thread))
+        {
+            clFinish(command_queues[i].queue);
+            clReleaseCommandQueue(command_queues[i].queue);
+            command_queues.erase(command_queues.begin() + i);
+        }
+        else
+            i++;
+    }
+    pthread_mutex_unlock(&command_queues_mutex);
+}
+
+// *****************************************************************************
+void OpenCL_device::Set_Shared_Context(cl_context &_context, const bool _unlock_with_context)
+/**
+ * Use a context created for many devices. Every device keeps its own reference.
+ * @param _unlock_with_context  The device was locked for this context only: unlock it in Release_Context().
+ */
+{
+    Release_Context();
+    clRetainContext(_context);
+    context             = _context;
+    unlock_with_context = _unlock_with_context;
 }
 
 // *****************************************************************************
 void OpenCL_device::Set_Information(const int _id, cl_device_id _device,
-                                    const int platform_id_offset,
                                     const std::string &platform_name,
                                     const bool _device_is_gpu,
                                     const OpenCL_platform * const _parent_platform                                   )
@@ -616,6 +1687,9 @@ void OpenCL_device::Set_Information(const int _id, cl_device_id _device,
 
     cl_int err;
 
+    OpenCL_Startup_Profile &startup = OpenCL_Startup_Profile::Instance();
+    const double info_start = Now();
+
     // http://www.khronos.org/registry/cl/sdk/1.0/docs/man/xhtml/clGetDeviceInfo.html
     err  = clGetDeviceInfo(device, CL_DEVICE_ADDRESS_BITS,                  sizeof(cl_uint),                        &address_bits,                  NULL);
     err |= clGetDeviceInfo(device, CL_DEVICE_AVAILABLE,                     sizeof(cl_bool),                        &available,                     NULL);
@@ -667,7 +1741,7 @@ void OpenCL_device::Set_Information(const int _id, cl_device_id _device,
     err |= clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS,                    sizeof(tmp_string),                     &tmp_string,                    NULL);
     extensions = std::string(tmp_string);
     err |= clGetDeviceInfo(device, CL_DEVICE_NAME,                          sizeof(tmp_string),                     &tmp_string,                    NULL);
-    name = std::string(tmp_string);
+    name = std::string(tmp_string) + partition_name;
     err |= clGetDeviceInfo(device, CL_DEVICE_PROFILE,                       sizeof(tmp_string),                     &tmp_string,                    NULL);
     profile = std::string(tmp_string);
     err |= clGetDeviceInfo(device, CL_DEVICE_VENDOR,                        sizeof(tmp_string),                     &tmp_string,                    NULL);
@@ -707,6 +1781,46 @@ void OpenCL_device::Set_Information(const int _id, cl_device_id _device,
         nvidia_device_integrated_memory         = false;
     }
 
+    // NUMA node closest to the device. For GPUs, the one their PCI slot is attached to.
+    numa_node = -1;
+    if (type & CL_DEVICE_TYPE_CPU)
+    {
+        // A CPU device spans all the nodes, unless there is only one.
+        const std::vector<int> nodes = NUMA_Nodes_with_CPUs();
+        if (nodes.size() == 1)
+            numa_node = nodes[0];
+    }
+    else if (is_nvidia)
+    {
+        cl_uint pci_bus = 0, pci_slot = 0, pci_domain = 0;
+        if (clGetDeviceInfo(device, CL_DEVICE_PCI_BUS_ID_NV, sizeof(cl_uint), &pci_bus, NULL) == CL_SUCCESS and
+            clGetDeviceInfo(device, CL_DEVICE_PCI_SLOT_ID_NV, sizeof(cl_uint), &pci_slot, NULL) == CL_SUCCESS)
+        {
+            // Older drivers don't know about the domain.
+            if (clGetDeviceInfo(device, CL_DEVICE_PCI_DOMAIN_ID_NV, sizeof(cl_uint), &pci_domain, NULL) != CL_SUCCESS)
+                pci_domain = 0;
+            numa_node = PCI_NUMA_Node(pci_domain, pci_bus, pci_slot, 0);
+        }
+    }
+    else if (extensions.find("cl_khr_pci_bus_info") != std::string::npos)
+    {
+        cl_uint pci_bus_info[4];    // Domain, bus, device, function
+        if (clGetDeviceInfo(device, CL_DEVICE_PCI_BUS_INFO_KHR, sizeof(pci_bus_info), pci_bus_info, NULL) == CL_SUCCESS)
+            numa_node = PCI_NUMA_Node(pci_bus_info[0], pci_bus_info[1], pci_bus_info[2], pci_bus_info[3]);
+    }
+    else if (extensions.find("cl_amd_device_attribute_query") != std::string::npos)
+    {
+        // cl_device_topology_amd: type (1 == PCIe), 17 unused bytes, then bus, device and function.
+        cl_uchar topology[24];
+        cl_uint topology_type;
+        if (clGetDeviceInfo(device, CL_DEVICE_TOPOLOGY_AMD, sizeof(topology), topology, NULL) == CL_SUCCESS)
+        {
+            memcpy(&topology_type, topology, sizeof(cl_uint));
+            if (topology_type == 1)
+                numa_node = PCI_NUMA_Node(0, topology[21], topology[22], topology[23]);
+        }
+    }
+
     if      (type == CL_DEVICE_TYPE_CPU)
         type_string = "CL_DEVICE_TYPE_CPU";
     else if (type == CL_DEVICE_TYPE_GPU)
@@ -717,7 +1831,7 @@ void OpenCL_device::Set_Information(const int _id, cl_device_id _device,
         type_string = "CL_DEVICE_TYPE_DEFAULT";
     else
     {
-        std_cout << "ERROR: Unknown OpenCL type \"" << type << "\". Exiting.\n";
+        OpenCL_Log_Error("ERROR: Unknown OpenCL type \"" << type << "\". Exiting.\n");
         abort();
     }
 
@@ -741,28 +1855,84 @@ void OpenCL_device::Set_Information(const int _id, cl_device_id _device,
     if (single_fp_config & CL_FP_FMA)
         single_fp_config_string += "CL_FP_FMA, ";
 
+    startup.Record(OPENCL_STARTUP_DEVICE_INFO, platform_name, name, info_start, Now());
+
     assert(parent_platform                  != NULL);
     assert(parent_platform->Platform_List() != NULL);
+    init_log = "";
     if (parent_platform->Platform_List()->Use_Locking())
     {
-        device_is_in_use = Verify_if_Device_is_Used(device_id, platform_id_offset, platform_name, name);
+        // A single attempt: a busy device must not stall the enumeration. Waiting
+        // for a device is done when acquiring it (Lock() follows the retry policy).
+        OpenCL_Retry_Policy single_attempt;
+        single_attempt.max_attempts = 1;
+        const double probe_start = Now();
+        device_is_in_use = Probe_In_Use(single_attempt);
+        startup.Record(OPENCL_STARTUP_LOCK_PROBE, platform_name, name, probe_start, Now());
         is_lockable = true;
+
+        init_log += "OpenCL: Device \"" + name + "\" is " + (device_is_in_use ? "in use.\n" : "available.\n");
     }
     else
     {
         device_is_in_use = false;
         is_lockable = false;
     }
+
+    std::string missing;
+    meets_requirements = parent_platform->Platform_List()->Device_Requirements().Is_Satisfied_By(*this, missing);
+    if (not meets_requirements)
+        init_log += "OpenCL: Device \"" + name + "\" does not meet the requirements: " + missing + ".\n";
+}
+
+// *****************************************************************************
+bool OpenCL_device::Probe_In_Use(const OpenCL_Retry_Policy &policy) const
+{
+    // The registry knows about the holders using it without touching any file.
+    if (parent_platform->Platform_List()->Is_Using_Registry() and
+        OpenCL_Registry::Instance().Nb_Holders(Lock_Filename()) >= Nb_Slots())
+    {
+        return true;
+    }
+
+    // Quiet: the devices are verified concurrently, their output would be interleaved.
+    bool in_use = Verify_if_Lock_File_is_Used(Lock_Filename(), (Nb_Slots() > 1), true, policy);
+
+    // A sub-device is also in use when another process uses its parent as a whole.
+    if (parent_device != NULL and not in_use)
+        in_use = Verify_if_Lock_File_is_Used(parent_device->Lock_Filename(), true, true, policy);
+
+    // A shared device is in use once all its slots are taken.
+    if (Nb_Slots() > 1 and not in_use)
+        in_use = not Has_Free_Slot();
+
+    return in_use;
+}
+
+// *****************************************************************************
+void OpenCL_device::Refresh_In_Use()
+/**
+ * Check again, without waiting, if another process uses the device.
+ */
+{
+    if (not is_lockable or file_locked)
+        return;
+
+    OpenCL_Retry_Policy single_attempt;
+    single_attempt.max_attempts = 1;
+    const double probe_start = Now();
+    device_is_in_use = Probe_In_Use(single_attempt);
+    OpenCL_Startup_Profile::Instance().Record(OPENCL_STARTUP_LOCK_PROBE, parent_platform->Name(), name, probe_start, Now());
 }
 
 // *****************************************************************************
 cl_int OpenCL_device::Set_Context()
 {
     cl_int err = CL_SUCCESS+1;
-    pid_t pid = getpid();
-    const int max_retry = 5;
-    srand(pid * (unsigned int)time(NULL));
-    for (int i = 0 ; i < max_retry ; i++)
+    OpenCL_Retry retry(parent_platform->Platform_List()->Retry_Policy());
+    double delay;
+    const double context_start = Now();
+    while (true)
     {
         // Try to set an OpenCL context on the device
         context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
@@ -771,20 +1941,26 @@ cl_int OpenCL_device::Set_Context()
         if (err == CL_SUCCESS)
             break;
 
-        // If it it did not succeeds, sleep for a random
-        // time (between 1 and 10 seconds) and retry
-        const double delay = ((double(rand()) / double(RAND_MAX)) * 9.0) + 1.0;
+        if (not retry.Prepare_Retry(delay))
+            break;
+        OpenCL_Metrics::Instance().context_retries->Add();
+
+        // If it it did not succeeds, sleep and retry
         char delay_string[64];
         sprintf(delay_string, "%.4f", delay);
-        std_cout
-            << "\nOpenCL: WARNING: Failed to set an OpenCL context on the device.\n"
-            << "                 Waiting " << delay_string << " seconds before retrying (" << i+1 << "/" << max_retry << ")...\n" << std::flush;
-        Wait(delay);
-        std_cout << "                 Done waiting.";
-        if (i+1 < max_retry)
-            std_cout << " Retrying.";
-        std_cout << "\n";
+        OpenCL_Log_Warning(
+               "\nOpenCL: WARNING: Failed to set an OpenCL context on the device.\n"
+            << "                 Waiting " << delay_string << " seconds before retrying (" << retry.Attempt() << "/" << retry.Max_Attempts() << ")...\n");
+        retry.Sleep(delay);
+        OpenCL_Log_Info("                 Done waiting. Retrying.\n");
     }
+
+    context_time_waited = retry.Time_Waited();
+    OpenCL_Startup_Profile::Instance().Record(OPENCL_STARTUP_CONTEXT, parent_platform->Name(), name, context_start, Now());
+    OpenCL_Metrics::Instance().context_wait_seconds->Observe(context_time_waited);
+    if (context_time_waited > 0.0)
+        OpenCL_Log_Info("OpenCL: Waited " << context_time_waited << " seconds to set a context on " << name << ".\n");
+
     return err;
 }
 
@@ -800,6 +1976,11 @@ void OpenCL_device::Print() const
         << "        device_is_used:                 " << (device_is_in_use ? "yes" : "no ") << "\n"
         << "        max_compute_unit:               " << max_compute_units << "\n"
         << "        device is GPU?                  " << (device_is_gpu ? "yes" : "no ") << "\n"
+        << "        partitioned:                    " << (is_partitioned ? "yes" : "no ") << "\n"
+        << "        parent device:                  " << (parent_device != NULL ? parent_device->Get_Name() : "") << "\n"
+        << "        numa node:                      " << numa_node << "\n"
+        << "        meets requirements:             " << (meets_requirements ? "yes" : "no ") << "\n"
+        << "        slots:                          " << (parent_platform != NULL ? Nb_Slots() : 1) << " (holding: " << slot << ")\n"
 
         << "        address_bits:                   " << address_bits << "\n"
         << "        available:                      " << (available ? "yes" : "no") << "\n"
@@ -872,6 +2053,20 @@ void OpenCL_device::Print() const
             << "        GPU is NOT from NVidia\n";
     }
 
+    if (benchmark.valid)
+    {
+        std_cout
+            << "        Benchmark:\n"
+            << "            bandwidth:                  " << benchmark.bandwidth      << " GB/s\n"
+            << "            single precision:           " << benchmark.sp_gflops      << " GFLOP/s\n"
+            << "            double precision:           " << benchmark.dp_gflops      << " GFLOP/s\n"
+            << "            launch latency:             " << benchmark.launch_latency << " us\n"
+            << "            ranking score:              " << ranking_score << "\n";
+    }
+
+    if (load > 0.0)
+        std_cout << "        Load:                           " << load << "\n";
+
     // Avialable global memory on device
     std_cout << "        Available memory (global):   " << Bytes_in_String(global_mem_size) << "\n";
 
@@ -883,49 +2078,602 @@ void OpenCL_device::Print() const
 }
 
 // *****************************************************************************
-void OpenCL_device::Lock()
+std::string OpenCL_device::Lock_Filename() const
+{
+    // A sub-device's name already contains its parent's, the parent's id makes it unique.
+    const int id = (parent_device != NULL ? parent_device->Get_ID() : device_id);
+    return Get_Lock_Filename(id, parent_platform->Id_Offset(), parent_platform->Name(), name);
+}
+
+// *****************************************************************************
+void OpenCL_device::Lock()
+{
+    std::string error;
+    if (not Acquire_Lock(parent_platform->Platform_List()->Retry_Policy(), error))
+    {
+        OpenCL_Log_Error(error);
+        abort();
+    }
+}
+
+// *****************************************************************************
+void OpenCL_device::Declare_Memory(const cl_ulong bytes)
+{
+    if (file_locked and parent_platform->Platform_List()->Is_Using_Registry())
+        OpenCL_Registry::Instance().Declare_Memory(Lock_Filename(), bytes);
+}
+
+// *****************************************************************************
+int OpenCL_device::Nb_Slots() const
+{
+    assert(parent_platform != NULL);
+    const OpenCL_platforms_list *list = parent_platform->Platform_List();
+    if (list->Memory_per_Slot() > 0)
+        return std::max(1, int(global_mem_size / list->Memory_per_Slot()));
+    return list->Device_Slots();
+}
+
+// *****************************************************************************
+std::string OpenCL_device::Slot_Lock_Filename(const int _slot) const
+{
+    std::string f = Lock_Filename();
+    char suffix[64];
+    sprintf(suffix, "_Slot%d.lck", _slot);
+    return f.substr(0, f.size() - 4) + suffix;  // Replace ".lck"
+}
+
+// *****************************************************************************
+bool OpenCL_device::Has_Free_Slot() const
+{
+    OpenCL_Retry_Policy single_attempt;
+    single_attempt.max_attempts = 1;
+    for (int i = 0 ; i < Nb_Slots() ; i++)
+    {
+        if (not Verify_if_Lock_File_is_Used(Slot_Lock_Filename(i), false, true, single_attempt))
+            return true;
+    }
+    return false;
+}
+
+// *****************************************************************************
+int OpenCL_device::Lock_Free_Slot(const OpenCL_Retry_Policy &policy, double &time_waited)
+/**
+ * Try every slot in turn, then wait following the retry policy and start over.
+ * @return      file handle of the slot's lock file, or -1 if none could be locked
+ */
+{
+    OpenCL_Retry_Policy single_attempt;
+    single_attempt.max_attempts = 1;
+
+    OpenCL_Retry retry(policy);
+    double delay;
+    int f = -1;
+    while (true)
+    {
+        for (int i = 0 ; i < Nb_Slots() and f == -1 ; i++)
+        {
+            f = Lock_File(Slot_Lock_Filename(i).c_str(), true, single_attempt);
+            if (f != -1)
+                slot = i;
+        }
+
+        if (f != -1 or not retry.Prepare_Retry(delay))
+            break;
+
+        char delay_string[64];
+        sprintf(delay_string, "%.4f", delay);
+        OpenCL_Log_Warning(
+               "OpenCL: WARNING: All slots of device " << name << " are taken.\n"
+            << "                 Waiting " << delay_string << " seconds before retrying (" << retry.Attempt() << "/" << retry.Max_Attempts() << ")...\n");
+        retry.Sleep(delay);
+    }
+
+    time_waited = retry.Time_Waited();
+    return f;
+}
+
+// *****************************************************************************
+void OpenCL_device::Unlock()
+{
+    if (file_locked == true)
+    {
+        if (parent_platform->Platform_List()->Is_Using_Registry())
+        {
+            OpenCL_Registry::Untrack_Device(device);
+            OpenCL_Registry::Instance().Unregister_Holder(Lock_Filename());
+        }
+
+        Unlock_File(lock_file);
+        if (parent_lock_file != -1)
+        {
+            Unlock_File(parent_lock_file);
+            parent_lock_file = -1;
+        }
+        if (slot_lock_file != -1)
+        {
+            Unlock_File(slot_lock_file);
+            slot_lock_file = -1;
+            slot = -1;
+        }
+        file_locked = false;
+    }
+}
+
+// *****************************************************************************
+bool OpenCL_device::Try_Lock()
+/**
+ * Lock the device without waiting.
+ * @return      false if the device is used by another process
+ */
+{
+    OpenCL_Retry_Policy single_attempt;
+    single_attempt.max_attempts = 1;
+    std::string error;
+    return Acquire_Lock(single_attempt, error);
+}
+
+// *****************************************************************************
+bool OpenCL_device::Acquire_Lock(const OpenCL_Retry_Policy &policy, std::string &error)
+/**
+ * Lock the device's file, waiting following "policy". On failure, nothing
+ * stays locked and "error" tells why.
+ */
+{
+    // Devices granted by Wait_for_Free_Device() are already locked.
+    if (file_locked)
+        return true;
+
+    const bool quiet = (policy.max_attempts <= 1);
+    const double trace_start = OpenCL_Trace::Host_Time();
+
+    double parent_time_waited = 0.0;
+    if (parent_device != NULL)
+    {
+        parent_lock_file = Lock_File(parent_device->Lock_Filename().c_str(), quiet,
+                                     policy, &parent_time_waited, true);
+        if (parent_lock_file == -1)
+        {
+            error = "An error occurred locking the parent device's file!\n";
+            return false;
+        }
+    }
+
+    // A shared device's file is only locked to keep exclusive users away.
+    const bool shared = (Nb_Slots() > 1);
+    lock_file = Lock_File(Lock_Filename().c_str(), quiet, policy, &lock_time_waited, shared);
+    if (lock_file == -1)
+    {
+        if (parent_lock_file != -1)
+        {
+            Unlock_File(parent_lock_file, true);
+            parent_lock_file = -1;
+        }
+        error = "An error occurred locking the file!\n";
+        return false;
+    }
+    lock_time_waited += parent_time_waited;
+
+    if (shared)
+    {
+        double slot_time_waited = 0.0;
+        slot_lock_file = Lock_Free_Slot(policy, slot_time_waited);
+        lock_time_waited += slot_time_waited;
+        if (slot_lock_file == -1)
+        {
+            Unlock_File(lock_file, true);
+            if (parent_lock_file != -1)
+            {
+                Unlock_File(parent_lock_file, true);
+                parent_lock_file = -1;
+            }
+            char nb_slots[32];
+            sprintf(nb_slots, "%d", Nb_Slots());
+            error = "OpenCL: All " + std::string(nb_slots) + " slots of device " + name + " are taken!\n";
+            return false;
+        }
+        OpenCL_Log_Info("OpenCL: Acquired slot " << slot+1 << "/" << Nb_Slots() << " of device " << name << ".\n");
+    }
+
+    file_locked = true; // File is now locked
+    OpenCL_Metrics::Instance().lock_wait_seconds->Observe(lock_time_waited);
+    OpenCL_Trace::Instance().Add_Host_Span("Lock " + name, "lock", trace_start, OpenCL_Trace::Host_Time());
+
+    if (parent_platform->Platform_List()->Is_Using_Registry())
+    {
+        OpenCL_Registry::Instance().Register_Holder(Lock_Filename());
+        OpenCL_Registry::Track_Device(device, Lock_Filename());
+    }
+
+    return true;
+}
+
+// *****************************************************************************
+bool OpenCL_device::operator<(const OpenCL_device &other)
+{
+    // Start by checking if ones not in use. When this is the case give it priority.
+    // Then the load, if placement is driven by it.
+    // Then compare the maximum number of compute unit
+    // NOTE: We want a sorted list where device with higher compute units
+    //       are located at the top (front). We thus invert the test here.
+    // Partitioned devices always go last: only their sub-devices can be used.
+    bool result = false;
+
+    if      (this->is_partitioned == false && other.is_partitioned == true)      // "this" wins (it is not partitioned).
+        result = true;
+    else if (this->is_partitioned == true  && other.is_partitioned == false)     // "other" wins (it is not partitioned).
+        result = false;
+    else if (this->meets_requirements == true  && other.meets_requirements == false) // "this" wins (it can run the job).
+        result = true;
+    else if (this->meets_requirements == false && other.meets_requirements == true)  // "other" wins (it can run the job).
+        result = false;
+    else if (this->device_is_in_use == false && other.device_is_in_use == true)  // "this" wins (it is not in use).
+        result = true;
+    else if (this->device_is_in_use == true  && other.device_is_in_use == false) // "other" wins (it is not in use).
+        result = false;
+    else if (this->load != other.load) // the least loaded wins (only set with OpenCL_Placement_Policy).
+        result = (this->load < other.load);
+    else if (this->ranking_score > 0.0 or other.ranking_score > 0.0) // benchmarked devices win, then compare their scores.
+    {
+        result = (this->ranking_score > other.ranking_score);
+    }
+    else // both are used or not used. Thus, we must compare the ammount of compute units.
+    {
+        if (this->max_compute_units > other.max_compute_units) // "this" wins (having more compute units).
+            result = true;
+        else                                                 // "other" wins (having more or equal compute units).
+            result = false;
+    }
+
+    return result;
+}
+
+// *****************************************************************************
+OpenCL_Device_Benchmark::OpenCL_Device_Benchmark()
+{
+    valid           = false;
+    bandwidth       = 0.0;
+    sp_gflops       = 0.0;
+    dp_gflops       = 0.0;
+    launch_latency  = 0.0;
+}
+
+// *****************************************************************************
+OpenCL_Benchmark_Ranking::OpenCL_Benchmark_Ranking()
+{
+    bandwidth_weight    = 1.0;
+    sp_flops_weight     = 1.0;
+    dp_flops_weight     = 0.0;
+    latency_weight      = 0.25;
+
+    const char *env = getenv("OCLUTILS_CACHE_DIR");
+    const char *home = getenv("HOME");
+    if (env != NULL)
+        cache_directory = env;
+    else if (home != NULL)
+        cache_directory = std::string(home) + "/.cache/oclutils";
+    else
+        cache_directory = "/tmp";
+}
+
+// *****************************************************************************
+double OpenCL_Benchmark_Ranking::Score(const OpenCL_Device_Benchmark &b) const
+{
+    if (not b.valid)
+        return 0.0;
+
+    // Metrics are floored so that a missing capability (no double precision)
+    // makes the score tiny instead of zero (which would mean "not ranked").
+    const double floor = 1.0e-6;
+    double log_score = 0.0;
+    log_score += bandwidth_weight * std::log(std::max(b.bandwidth, floor));
+    log_score += sp_flops_weight  * std::log(std::max(b.sp_gflops, floor));
+    log_score += dp_flops_weight  * std::log(std::max(b.dp_gflops, floor));
+    log_score -= latency_weight   * std::log(std::max(b.launch_latency, floor));
+
+    return std::exp(log_score);
+}
+
+// *****************************************************************************
+OpenCL_Placement_Policy::OpenCL_Placement_Policy()
+{
+    memory_weight       = 1.0;
+    utilization_weight  = 1.0;
+    holders_weight      = 0.5;
+}
+
+// *****************************************************************************
+double OpenCL_Placement_Policy::Load(const OpenCL_Registry_Device &usage, const cl_ulong global_mem_size,
+                                     const int nb_slots) const
+{
+    double load = 0.0;
+    if (global_mem_size > 0)
+        load += memory_weight * double(usage.Declared_Memory()) / double(global_mem_size);
+    load += utilization_weight * usage.Utilization();
+    load += holders_weight * double(usage.nb_holders) / double(std::max(nb_slots, 1));
+
+    return load;
+}
+
+// *****************************************************************************
+void OpenCL_device::Update_Load(const OpenCL_Placement_Policy &policy)
+{
+    OpenCL_Registry_Device usage;
+    if (OpenCL_Registry::Instance().Get_Device(Lock_Filename(), usage))
+        load = policy.Load(usage, global_mem_size, Nb_Slots());
+    else
+        load = 0.0;     // Nobody ever used it
+}
+
+// *****************************************************************************
+const char benchmark_kernels_source[] =
+"__kernel void Benchmark_Copy(__global const float4 *in, __global float4 *out)\n"
+"{\n"
+"    const size_t i = get_global_id(0);\n"
+"    out[i] = in[i];\n"
+"}\n"
+"__kernel void Benchmark_Empty(__global float *out)\n"
+"{\n"
+"}\n"
+"#define BENCHMARK_FLOPS(name, real, real4)                                      \n"
+"__kernel void name(__global real *out, const int n)                            \n"
+"{                                                                              \n"
+"    real4 a = (real4)((real)get_global_id(0));                                 \n"
+"    real4 b = (real4)((real)0.9999);                                           \n"
+"    real4 c = (real4)((real)1.0001);                                           \n"
+"    real4 d = (real4)((real)0.5);                                              \n"
+"    for (int i = 0 ; i < n ; i++)                                              \n"
+"    {                                                                          \n"
+"        a = mad(a, b, c); b = mad(b, c, d); c = mad(c, d, a); d = mad(d, a, b);\n"
+"        a = mad(a, b, c); b = mad(b, c, d); c = mad(c, d, a); d = mad(d, a, b);\n"
+"    }                                                                          \n"
+"    out[get_global_id(0)] = a.x + b.y + c.z + d.w;                             \n"
+"}\n"
+"BENCHMARK_FLOPS(Benchmark_Flops_SP, float, float4)\n"
+"#ifdef BENCHMARK_FP64\n"
+"#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+"BENCHMARK_FLOPS(Benchmark_Flops_DP, double, double4)\n"
+"#endif\n";
+
+// *****************************************************************************
+double Time_Kernel(cl_command_queue queue, cl_kernel kernel, const cl_uint dimension,
+                   const size_t *global_size, const size_t *local_size,
+                   const double min_duration, int &repetitions)
+/**
+ * Time (seconds) of a single kernel execution. The kernel is repeated, doubling
+ * the repetitions, until the measurement lasts at least "min_duration".
+ * @return a negative value if a call failed.
+ */
+{
+    cl_int err;
+    double elapsed = 0.0;
+
+    // Warmup (the first launch can include a lazy compilation)
+    err  = clEnqueueNDRangeKernel(queue, kernel, dimension, NULL, global_size, local_size, 0, NULL, NULL);
+    err |= clFinish(queue);
+    if (err != CL_SUCCESS)
+        return -1.0;
+
+    for (repetitions = 1 ; repetitions <= 4096 ; repetitions *= 2)
+    {
+        const double start = Now();
+        for (int i = 0 ; i < repetitions ; i++)
+            err |= clEnqueueNDRangeKernel(queue, kernel, dimension, NULL, global_size, local_size, 0, NULL, NULL);
+        err |= clFinish(queue);
+        elapsed = Now() - start;
+        if (err != CL_SUCCESS)
+            return -1.0;
+        if (elapsed >= min_duration)
+            break;
+    }
+    repetitions = std::min(repetitions, 4096);
+
+    return elapsed / double(repetitions);
+}
+
+// *****************************************************************************
+double Time_Kernel(cl_command_queue queue, cl_kernel kernel, const size_t global_size,
+                   const double min_duration, int &repetitions)
+{
+    return Time_Kernel(queue, kernel, 1, &global_size, NULL, min_duration, repetitions);
+}
+
+// *****************************************************************************
+bool Run_Device_Benchmark(cl_device_id device, OpenCL_Device_Benchmark &b)
+{
+    const double min_duration = 0.02; // seconds
+
+    cl_int err;
+    cl_ulong max_mem_alloc_size, global_mem_size;
+    cl_uint compute_units;
+    char extensions[4096];
+    err  = clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,    sizeof(cl_ulong), &max_mem_alloc_size, NULL);
+    err |= clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE,       sizeof(cl_ulong), &global_mem_size,    NULL);
+    err |= clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,     sizeof(cl_uint),  &compute_units,      NULL);
+    err |= clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS,            sizeof(extensions), extensions,        NULL);
+    if (err != CL_SUCCESS)
+        return false;
+    const bool has_fp64 = (std::string(extensions).find("cl_khr_fp64") != std::string::npos);
+
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (err != CL_SUCCESS)
+        return false;
+    cl_command_queue queue = clCreateCommandQueue(context, device, 0, &err);
+    if (err != CL_SUCCESS)
+    {
+        clReleaseContext(context);
+        return false;
+    }
+
+    const char *source = benchmark_kernels_source;
+    cl_program program = clCreateProgramWithSource(context, 1, &source, NULL, &err);
+    if (err == CL_SUCCESS)
+        err = clBuildProgram(program, 1, &device, (has_fp64 ? "-DBENCHMARK_FP64" : ""), NULL, NULL);
+
+    // Buffers: large enough to defeat the caches, small enough for any device.
+    size_t copy_size = std::min(cl_ulong(64*1024*1024), std::min(max_mem_alloc_size / 2, global_mem_size / 8));
+    copy_size -= copy_size % (16*256);
+    const size_t flops_global_size = size_t(compute_units) * 1024;
+    const int flops_loop = 256;
+
+    cl_mem in  = NULL;
+    cl_mem out = NULL;
+    cl_kernel kernel = NULL;
+    int repetitions;
+    if (err == CL_SUCCESS) in  = clCreateBuffer(context, CL_MEM_READ_WRITE, std::max(copy_size, flops_global_size * sizeof(double)), NULL, &err);
+    if (err == CL_SUCCESS) out = clCreateBuffer(context, CL_MEM_READ_WRITE, std::max(copy_size, flops_global_size * sizeof(double)), NULL, &err);
+
+    // Memory bandwidth: each float4 is read once and written once.
+    if (err == CL_SUCCESS) kernel = clCreateKernel(program, "Benchmark_Copy", &err);
+    if (err == CL_SUCCESS)
+    {
+        err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &in);
+        err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &out);
+        const double t = Time_Kernel(queue, kernel, copy_size / 16, min_duration, repetitions);
+        if (t <= 0.0) err = CL_INVALID_OPERATION;
+        else          b.bandwidth = 2.0 * double(copy_size) / t * 1.0e-9;
+        clReleaseKernel(kernel);
+    }
+
+    // Launch latency
+    if (err == CL_SUCCESS) kernel = clCreateKernel(program, "Benchmark_Empty", &err);
+    if (err == CL_SUCCESS)
+    {
+        err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &out);
+        const double t = Time_Kernel(queue, kernel, 1, min_duration, repetitions);
+        if (t <= 0.0) err = CL_INVALID_OPERATION;
+        else          b.launch_latency = t * 1.0e6;
+        clReleaseKernel(kernel);
+    }
+
+    // Floating point rates: 8 four-wide mads (2 flops each) per iteration.
+    const double flops_per_launch = double(flops_global_size) * double(flops_loop) * 8.0 * 4.0 * 2.0;
+    const char *flops_kernels[2] = {"Benchmark_Flops_SP", "Benchmark_Flops_DP"};
+    double *flops_results[2] = {&b.sp_gflops, &b.dp_gflops};
+    for (int k = 0 ; k < (has_fp64 ? 2 : 1) ; k++)
+    {
+        if (err == CL_SUCCESS) kernel = clCreateKernel(program, flops_kernels[k], &err);
+        if (err == CL_SUCCESS)
+        {
+            err  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &out);
+            err |= clSetKernelArg(kernel, 1, sizeof(int),    &flops_loop);
+            const double t = Time_Kernel(queue, kernel, flops_global_size, min_duration, repetitions);
+            if (t <= 0.0) err = CL_INVALID_OPERATION;
+            else          *flops_results[k] = flops_per_launch / t * 1.0e-9;
+            clReleaseKernel(kernel);
+        }
+    }
+
+    if (in)      clReleaseMemObject(in);
+    if (out)     clReleaseMemObject(out);
+    if (program) clReleaseProgram(program);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+
+    b.valid = (err == CL_SUCCESS);
+    return b.valid;
+}
+
+// *****************************************************************************
+bool OpenCL_device::Run_Benchmark(const std::string &cache_directory)
+/**
+ * Measure the device's memory bandwidth, floating point rates and launch
+ * latency. Results are cached per device and driver version.
+ * @return false if the device could not be benchmarked.
+ */
+{
+    const std::string cache_filename = cache_directory + "/OpenCL_Benchmark__"
+        + Filename_Safe(parent_platform->Name() + "_" + name + "_" + driver_version) + ".txt";
+
+    std::ifstream cache(cache_filename.c_str());
+    if (cache.is_open())
+    {
+        cache >> benchmark.bandwidth >> benchmark.sp_gflops >> benchmark.dp_gflops >> benchmark.launch_latency;
+        benchmark.valid = not cache.fail();
+        cache.close();
+        if (benchmark.valid)
+            return true;
+    }
+
+    // The device is locked while benchmarked: another process starting on it
+    // would both disturb the measurements and be slowed down by them.
+    const bool locked_here = (is_lockable and not file_locked);
+    if (locked_here and not Try_Lock())
+    {
+        device_is_in_use = true;
+        return false;
+    }
+
+    OpenCL_Log_Info("OpenCL: Benchmarking " << name << " (id = " << device_id << ")...");
+    const bool success = Run_Device_Benchmark(device, benchmark);
+    OpenCL_Log_Info((success ? " done.\n" : " Failed.\n"));
+    if (locked_here)
+        Unlock();
+    if (not success)
+        return false;
+
+    // Create the cache directory if needed; failing to cache is not an error.
+    Make_Directories(cache_directory, 0755);
+    std::ofstream cache_out(cache_filename.c_str());
+    if (cache_out.is_open())
+    {
+        cache_out << benchmark.bandwidth << " " << benchmark.sp_gflops << " " << benchmark.dp_gflops << " " << benchmark.launch_latency << "\n";
+        cache_out.close();
+    }
+
+    return true;
+}
+
+// *****************************************************************************
+OpenCL_Device_Set::OpenCL_Device_Set()
 {
-    lock_file = Lock_File(Get_Lock_Filename(device_id, parent_platform->Id_Offset(), parent_platform->Name(), name).c_str());
-    if (lock_file == -1)
-    {
-        std_cout << "An error occurred locking the file!\n" << std::flush;
-        abort();
-    }
-    file_locked = true; // File is now locked
 }
 
 // *****************************************************************************
-void OpenCL_device::Unlock()
+OpenCL_Device_Set::~OpenCL_Device_Set()
 {
-    if (file_locked == true)
-    {
-        Unlock_File(lock_file);
-        file_locked = false;
-    }
+    Release();
 }
 
 // *****************************************************************************
-bool OpenCL_device::operator<(const OpenCL_device &other)
+void OpenCL_Device_Set::Add(OpenCL_device &device, const bool unlock_on_release)
+/**
+ * Add a locked device having a context, with its command queue from the device's pool.
+ * @param unlock_on_release     The set acquired the lock (the device was not locked before)
+ */
 {
-    // Start by checking if ones not in use. When this is the case give it priority.
-    // Then compare the maximum number of compute unit
-    // NOTE: We want a sorted list where device with higher compute units
-    //       are located at the top (front). We thus invert the test here.
-    bool result = false;
+    // The device owns the queue (see OpenCL_device::Get_Command_Queue()).
+    cl_command_queue queue = device.Get_Command_Queue();
 
-    if      (this->device_is_in_use == false && other.device_is_in_use == true)  // "this" wins (it is not in use).
-        result = true;
-    else if (this->device_is_in_use == true  && other.device_is_in_use == false) // "other" wins (it is not in use).
-        result = false;
-    else // both are used or not used. Thus, we must compare the ammount of compute units.
+    devices.push_back(&device);
+    queues.push_back(queue);
+    owns_lock.push_back(unlock_on_release);
+}
+
+// *****************************************************************************
+void OpenCL_Device_Set::Release()
+{
+    for (size_t i = 0 ; i < devices.size() ; i++)
     {
-        if (this->max_compute_units > other.max_compute_units) // "this" wins (having more compute units).
-            result = true;
-        else                                                 // "other" wins (having more or equal compute units).
-            result = false;
+        if (owns_lock[i])
+            devices[i]->Unlock();
     }
+    devices.clear();
+    queues.clear();
+    owns_lock.clear();
+}
 
-    return result;
+// *****************************************************************************
+void OpenCL_Device_Set::Print() const
+{
+    std_cout << "OpenCL: Set of " << devices.size() << " device(s):\n";
+    for (size_t i = 0 ; i < devices.size() ; i++)
+        std_cout << "        " << i << ".   " << devices[i]->Get_Name() << " (id = " << devices[i]->Get_ID() << ")\n";
+}
+
+// *****************************************************************************
+bool Compare_Lock_Filenames(const OpenCL_device *a, const OpenCL_device *b)
+{
+    return a->Lock_Filename() < b->Lock_Filename();
 }
 
 // *****************************************************************************
@@ -951,14 +2699,100 @@ OpenCL_device & OpenCL_devices_list::Preferred_OpenCL()
 {
     if (preferred_device == NULL)
     {
-        std_cout << "ERROR: No OpenCL device is present!\n"
-        << "Make sure you call OpenCL_platforms.platforms[<WANTED PLATFORM>] with a valid (i.e. created) platform!\n" << std::flush;
+        OpenCL_Log_Error("ERROR: No OpenCL device is present!\n"
+        << "Make sure you call OpenCL_platforms.platforms[<WANTED PLATFORM>] with a valid (i.e. created) platform!\n");
         abort();
     }
 
     return *preferred_device;
 }
 
+// *****************************************************************************
+OpenCL_device & OpenCL_devices_list::Get_Device_by_ID(const int id)
+{
+    for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+    {
+        if (it->Get_ID() == id)
+            return *it;
+    }
+
+    OpenCL_Log_Error("OpenCL: ERROR: No device with id " << id << " on platform \"" << platform->Name() << "\". Exiting.\n");
+    abort();
+}
+
+// *****************************************************************************
+void OpenCL_devices_list::Set_Shared_Context(const std::vector<int> &device_ids)
+{
+    if (device_ids.size() == 0)
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: A shared context needs at least one device. Exiting.\n");
+        abort();
+    }
+
+    std::vector<OpenCL_device *> devices;
+    std::vector<cl_device_id> cl_devices;
+    for (unsigned int i = 0 ; i < device_ids.size() ; i++)
+    {
+        OpenCL_device &device = Get_Device_by_ID(device_ids[i]);
+        if (device.Is_Partitioned())
+        {
+            OpenCL_Log_Error("OpenCL: ERROR: device " << device.Get_Name() << " (id = " << device.Get_ID() << ") was partitioned. Use one of its sub-devices instead. Exiting.\n");
+            abort();
+        }
+        device.Refresh_In_Use();
+        if (device.Is_In_Use())
+        {
+            OpenCL_Log_Error("OpenCL: ERROR: device " << device.Get_Name() << " (id = " << device.Get_ID() << ") is used by another process. Exiting.\n");
+            abort();
+        }
+        devices.push_back(&device);
+        cl_devices.push_back(device.Get_Device());
+    }
+
+    // Devices that were sharing the previous context get their own back on
+    // demand (Set_Context()). Those locked for it are unlocked.
+    for (unsigned int i = 0 ; i < shared_context_devices.size() ; i++)
+        shared_context_devices[i]->Release_Context();
+    shared_context_devices.clear();
+
+    // Lock the devices not locked yet, in a global order so that two processes
+    // sharing devices can't each hold a part of them.
+    std::vector<OpenCL_device *> ordered(devices);
+    std::sort(ordered.begin(), ordered.end(), Compare_Lock_Filenames);
+    std::vector<OpenCL_device *> newly_locked;
+    for (size_t i = 0 ; i < ordered.size() ; i++)
+    {
+        if (ordered[i]->Is_Locked() or not ordered[i]->Is_Lockable())
+            continue;
+        if (not ordered[i]->Try_Lock())
+        {
+            for (size_t j = 0 ; j < newly_locked.size() ; j++)
+                newly_locked[j]->Unlock();
+            OpenCL_Log_Error("OpenCL: ERROR: Could not lock device " << ordered[i]->Get_Name() << " (id = " << ordered[i]->Get_ID() << ") for a shared context. Exiting.\n");
+            abort();
+        }
+        newly_locked.push_back(ordered[i]);
+    }
+
+    OpenCL_Log_Info("OpenCL: Creating a context shared by " << devices.size() << " devices...");
+    cl_context context = clCreateContext(NULL, cl_uint(cl_devices.size()), &cl_devices[0], NULL, NULL, &err);
+    OpenCL_Test_Success(err, "clCreateContext()");
+    OpenCL_Log_Info(" Success!\n");
+
+    for (unsigned int i = 0 ; i < devices.size() ; i++)
+    {
+        const bool locked_here = (std::find(newly_locked.begin(), newly_locked.end(), devices[i]) != newly_locked.end());
+        devices[i]->Set_Shared_Context(context, locked_here);
+    }
+    clReleaseContext(context);  // Only the devices' references are left.
+    shared_context_devices = devices;
+
+    // The previously preferred device keeps its context only if it is part of the new one.
+    if (preferred_device != NULL and std::find(devices.begin(), devices.end(), preferred_device) == devices.end())
+        preferred_device->Release_Context();
+    preferred_device = devices[0];
+}
+
 // *****************************************************************************
 void OpenCL_devices_list::Print() const
 {
@@ -982,20 +2816,42 @@ void OpenCL_devices_list::Print() const
     }
 }
 
+// *****************************************************************************
+struct Device_Init_Task
+{
+    OpenCL_device              *device;
+    int                         id;
+    cl_device_id                cl_device;
+    std::string                 platform_name;
+    bool                        device_is_gpu;
+    const OpenCL_platform      *platform;
+};
+
+// *****************************************************************************
+void Initialize_Device_Task(void *_task)
+{
+    Device_Init_Task *task = (Device_Init_Task *) _task;
+    task->device->Set_Information(task->id, task->cl_device, task->platform_name,
+                                  task->device_is_gpu, task->platform);
+}
+
 // *****************************************************************************
 void OpenCL_devices_list::Initialize(const OpenCL_platform &_platform,
                                      const std::string &preferred_platform)
 {
-    std_cout << "OpenCL: Initialize platform \"" << _platform.Name() << "\"'s device(s)\n";
+    init_log = "OpenCL: Initialize platform \"" + _platform.Name() + "\"'s device(s)\n";
 
     platform            = &_platform;
 
+    const double enumeration_start = Now();
+
     // Get the number of GPU devices available to the platform
     // Number of GPU
     err = clGetDeviceIDs(platform->Id(), CL_DEVICE_TYPE_GPU, 0, NULL, &nb_gpu);
     if (err == CL_DEVICE_NOT_FOUND)
     {
-        std_cout << "OpenCL: WARNING: Can't find a usable GPU!\n";
+        init_log += "OpenCL: WARNING: Can't find a usable GPU!\n";
+        nb_gpu = 0;
         err = CL_SUCCESS;
     }
     OpenCL_Test_Success(err, "clGetDeviceIDs()");
@@ -1004,7 +2860,8 @@ void OpenCL_devices_list::Initialize(const OpenCL_platform &_platform,
     err = clGetDeviceIDs(platform->Id(), CL_DEVICE_TYPE_CPU, 0, NULL, &nb_cpu);
     if (err == CL_DEVICE_NOT_FOUND)
     {
-        std_cout << "OpenCL: WARNING: Can't find a usable CPU!\n";
+        init_log += "OpenCL: WARNING: Can't find a usable CPU!\n";
+        nb_cpu = 0;
         err = CL_SUCCESS;
     }
     OpenCL_Test_Success(err, "clGetDeviceIDs()");
@@ -1012,125 +2869,499 @@ void OpenCL_devices_list::Initialize(const OpenCL_platform &_platform,
 
     // Create the device list
     device_list.resize(nb_devices());
-    // Temporary list
-    cl_device_id *tmp_devices;
 
+    // CPUs come first in the list, then GPUs.
+    cl_device_id *tmp_devices = new cl_device_id[nb_devices()];
+    if (nb_cpu >= 1)
+    {
+        err = clGetDeviceIDs(platform->Id(), CL_DEVICE_TYPE_CPU, nb_cpu, tmp_devices, NULL);
+        OpenCL_Test_Success(err, "clGetDeviceIDs()");
+    }
+    if (nb_gpu >= 1)
+    {
+        err = clGetDeviceIDs(platform->Id(), CL_DEVICE_TYPE_GPU, nb_gpu, tmp_devices + nb_cpu, NULL);
+        OpenCL_Test_Success(err, "clGetDeviceIDs()");
+    }
+    OpenCL_Startup_Profile::Instance().Record(OPENCL_STARTUP_ENUMERATION, platform->Name(), "", enumeration_start, Now());
+
+    std::vector<Device_Init_Task> tasks(nb_devices());
+    std::vector<void *> tasks_args(nb_devices());
     std::list<OpenCL_device>::iterator it = device_list.begin();
+    for (int i = 0 ; i < nb_devices() ; ++i, ++it)
+    {
+        tasks[i].device        = &(*it);
+        tasks[i].id            = i;
+        tasks[i].cl_device     = tmp_devices[i];
+        tasks[i].platform_name = platform->Name();
+        tasks[i].device_is_gpu = (i >= int(nb_cpu));
+        tasks[i].platform      = &_platform;
+        tasks_args[i]          = &tasks[i];
+    }
+    assert(it == device_list.end());
+
+    // Query every device (information and lock status) concurrently.
+    OclUtils::Run_Concurrently(Initialize_Device_Task, &tasks_args[0], nb_devices(),
+                               _platform.Platform_List()->Max_Init_Threads());
+
+    delete[] tmp_devices;
 
     are_all_devices_in_use = true; // We want to know if all devices are in use.
+    for (it = device_list.begin() ; it != device_list.end() ; ++it)
+    {
+        init_log += it->Init_Log();
 
-    // Add CPUs to list
-    if (nb_cpu >= 1)
+        // When one device is not in use... One device is not in use!
+        if (!it->Is_In_Use())
+            are_all_devices_in_use = false;
+    }
+
+    // The devices are probed only once here. When all of them are in use and the
+    // retry policy allows it, Lock_Best_Device() gives them some time to be released.
+    if (are_all_devices_in_use == true and not _platform.Platform_List()->Is_Waiting_for_Device())
     {
-        tmp_devices = new cl_device_id[nb_cpu];
-        err = clGetDeviceIDs(platform->Id(), CL_DEVICE_TYPE_CPU, nb_cpu, tmp_devices, NULL);
-        OpenCL_Test_Success(err, "clGetDeviceIDs()");
+        if (_platform.Platform_List()->Retry_Policy().max_attempts <= 1)
+        {
+            OpenCL_Log_Error(init_log);
+            OpenCL_Log_Error("All devices on platform '" << _platform.Name() << "' are in use!\n");
+            abort();
+        }
+        init_log += "OpenCL: WARNING: All devices on platform '" + _platform.Name() + "' are in use. They will be probed again when locking one.\n";
+    }
+
+    preferred_device = NULL;    // The preferred device is unknown for now.
+
+    is_initialized = true;
+}
+
+// *****************************************************************************
+void OpenCL_devices_list::Set_Preferred_OpenCL(const int _preferred_device)
+{
+    std::list<OpenCL_device>::iterator it = device_list.begin();
+    if (_preferred_device == -1)
+    {
+        if (platform->Platform_List()->Is_Using_Benchmark_Ranking())
+            Rank_By_Benchmark(platform->Platform_List()->Benchmark_Ranking());
+        if (platform->Platform_List()->Is_Using_Least_Loaded_Placement())
+            Rank_By_Load(platform->Platform_List()->Placement_Policy());
+
+        // Sort the list. The order is defined by "OpenCL_device::operator<"
+        device_list.sort();
+
+        // Initialize context on a device
+        for (it = device_list.begin() ; it != device_list.end() ; ++it)
+        {
+            if (it->Is_Partitioned() or not it->Meets_Requirements())
+                continue;
+
+            OpenCL_Log_Info("OpenCL: Trying to set a context on " << it->Get_Name() << " (id = " << it->Get_ID() << ")...");
+            if (it->Set_Context() == CL_SUCCESS)
+            {
+                OpenCL_Log_Info(" Success!\n");
+                preferred_device = &(*it);
+
+                break;
+            }
+            else
+            {
+                OpenCL_Log_Info(" Failed. Maybe next one will work?\n");
+            }
+        }
+    }
+    else
+    {
+        if (_preferred_device >= int(device_list.size()))
+        {
+            OpenCL_Log_Error("OpenCL: ERROR: the device requested is out of range. Exiting.\n");
+            abort();
+        }
+
+        // Release any allocated context
+        for (it = device_list.begin() ; it != device_list.end() ; ++it)
+        {
+            it->Destructor();
+        }
+
+        for (it = device_list.begin() ; it != device_list.end() ; ++it)
+        {
+            if (_preferred_device == it->Get_ID())
+            {
+                if (it->Is_Partitioned())
+                {
+                    OpenCL_Log_Error("OpenCL: ERROR: device " << it->Get_Name() << " (id = " << it->Get_ID() << ") was partitioned. Use one of its sub-devices instead. Exiting.\n");
+                    abort();
+                }
+                if (not it->Meets_Requirements())
+                {
+                    OpenCL_Log_Error("OpenCL: ERROR: device " << it->Get_Name() << " (id = " << it->Get_ID() << ") does not meet the requirements. Exiting.\n");
+                    abort();
+                }
+                OpenCL_Log_Info("OpenCL: Found preferred device (" << it->Get_Parent_Platform()->Name() << ", " << it->Get_Name() << ", id = " << it->Get_ID() << "). Trying to set an context on it...\n");
+                if (it->Set_Context() == CL_SUCCESS)
+                {
+                    OpenCL_Log_Info(" Success!\n");
+                    preferred_device = &(*it);
+
+                    break;
+                }
+            }
+        }
+    }
+
+    if (preferred_device == NULL and Nb_Usable_Devices() == 0)
+    {
+        OpenCL_Log_Error("ERROR: No available device on platform '" << platform->Name() << "' meets the requirements!\nExiting");
+        abort();
+    }
+    if (preferred_device == NULL)
+    {
+        OpenCL_Log_Error("ERROR: Cannot set an OpenCL context on any of the available devices!\nExiting");
+        abort();
+    }
+}
+
+// *****************************************************************************
+int OpenCL_devices_list::Nb_Usable_Devices() const
+{
+    int nb_usable = 0;
+    for (std::list<OpenCL_device>::const_iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+    {
+        if (it->Meets_Requirements() and not it->Is_Partitioned() and not it->Is_In_Use())
+            nb_usable++;
+    }
+    return nb_usable;
+}
+
+// *****************************************************************************
+void OpenCL_devices_list::Probe_Until_Free()
+/**
+ * Initialize() probes the devices only once. If all of them were in use, probe
+ * them again following the retry policy and choose a new preferred device once
+ * one is released. Aborts if none was.
+ */
+{
+    if (not are_all_devices_in_use)
+        return;
+
+    OpenCL_Retry retry(platform->Platform_List()->Retry_Policy());
+    double delay;
+    while (are_all_devices_in_use and retry.Prepare_Retry(delay))
+    {
+        char delay_string[64];
+        sprintf(delay_string, "%.4f", delay);
+        OpenCL_Log_Warning(
+               "OpenCL: WARNING: All devices on platform '" << platform->Name() << "' are in use.\n"
+            << "                 Waiting " << delay_string << " seconds before probing them again (" << retry.Attempt() << "/" << retry.Max_Attempts() << ")...\n");
+        retry.Sleep(delay);
+
+        for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+        {
+            it->Refresh_In_Use();
+            if (not it->Is_In_Use())
+                are_all_devices_in_use = false;
+        }
+    }
+
+    if (are_all_devices_in_use)
+    {
+        OpenCL_Log_Error("All devices on platform '" << platform->Name() << "' are in use!\n");
+        abort();
+    }
+
+    // The preferred device was chosen among devices in use.
+    if (preferred_device != NULL)
+        preferred_device->Release_Context();
+    Set_Preferred_OpenCL();
+}
+
+// *****************************************************************************
+void OpenCL_devices_list::Wait_for_Free_Device()
+/**
+ * Wait in line with the other processes of the machine until a device meeting
+ * the requirements is free, then select and lock it. Processes are served in
+ * the order they started waiting. Aborts after the platform list's timeout.
+ */
+{
+    const OpenCL_platforms_list *list = platform->Platform_List();
+    const double poll_interval = 0.5;   // Seconds
+    const std::string directory = Device_Queue_Directory(platform->Name());
+
+    int ticket;
+    const int ticket_file = Device_Queue_Enter(directory, ticket);
+
+    const double start = Now();
+    bool printed = false;
+    while (true)
+    {
+        if (Device_Queue_Is_First(directory, ticket))
+        {
+            for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+                it->Refresh_In_Use();
+
+            if (Nb_Usable_Devices() > 0)
+                break;
+        }
+
+        if (list->Wait_Timeout() > 0.0 and Now() - start >= list->Wait_Timeout())
+        {
+            Device_Queue_Leave(directory, ticket, ticket_file);
+            OpenCL_Log_Error("All devices on platform '" << platform->Name() << "' are in use! Gave up after "
+                      << Now() - start << " seconds.\n");
+            abort();
+        }
+
+        if (not printed)
+        {
+            OpenCL_Log_Info("OpenCL: All devices on platform '" << platform->Name() << "' are in use. Waiting in line (ticket " << ticket << ")...\n");
+            printed = true;
+        }
+        Wait(poll_interval);
+    }
+
+    // Lock the device before leaving the line, so that the next one can't take it.
+    Set_Preferred_OpenCL();
+    if (preferred_device->Is_Lockable())
+        preferred_device->Lock();
+    Device_Queue_Leave(directory, ticket, ticket_file);
+
+    if (printed)
+        OpenCL_Log_Info("OpenCL: Device " << preferred_device->Get_Name() << " granted after " << Now() - start << " seconds.\n");
+
+    if (list->Device_Granted_Callback() != NULL)
+        list->Device_Granted_Callback()(*preferred_device, list->Device_Granted_Data());
+}
+
+// *****************************************************************************
+void OpenCL_devices_list::Rank_By_Benchmark(const OpenCL_Benchmark_Ranking &ranking)
+/**
+ * Benchmark (or load cached results of) every device and sort the list by score.
+ * Devices in use by another process are not benchmarked (their results
+ * would be meaningless) unless results are already cached.
+ */
+{
+    for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+    {
+        if (it->Run_Benchmark(ranking.cache_directory))
+            it->Set_Ranking_Score(ranking.Score(it->Get_Benchmark()));
+        else
+            it->Set_Ranking_Score(0.0);
+    }
+
+    // If the preferred device is set, it does not move in memory (std::list).
+    device_list.sort();
+}
+
+// *****************************************************************************
+void OpenCL_devices_list::Rank_By_Load(const OpenCL_Placement_Policy &policy)
+/**
+ * Read every device's load from the registry and sort the list, least loaded first.
+ */
+{
+    for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+        it->Update_Load(policy);
+
+    device_list.sort();
+}
+
+// *****************************************************************************
+bool OpenCL_devices_list::Lock_Best_Devices(const int nb_devices, OpenCL_Device_Set &set)
+/**
+ * Lock the best "nb_devices" free devices, all or none. Devices are locked in
+ * the order of their lock files' names, the same in every process, without
+ * waiting: if one is taken, those already locked are released and the whole
+ * set is tried again following the retry policy. Two jobs can't end up each
+ * holding part of what the other needs.
+ * @return      false if the devices could not be acquired ("set" is then empty)
+ */
+{
+    assert(nb_devices >= 1);
+    set.Release();
+
+    const OpenCL_platforms_list *list = platform->Platform_List();
+    std::vector<OpenCL_device *> chosen;
+    std::vector<OpenCL_device *> newly_locked;
+    OpenCL_Retry retry(list->Retry_Policy());
+    double delay;
+    while (true)
+    {
+        // Choose the best free devices, ranked as for the preferred device.
+        for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+            it->Refresh_In_Use();
+        if (list->Is_Using_Least_Loaded_Placement())
+            Rank_By_Load(list->Placement_Policy());
+        else
+            device_list.sort();
+
+        chosen.clear();
+        for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() and int(chosen.size()) < nb_devices ; ++it)
+        {
+            if (not it->Is_Partitioned() and it->Meets_Requirements() and not it->Is_In_Use())
+                chosen.push_back(&(*it));
+        }
 
-        for (unsigned int i = 0 ; i < nb_cpu ; ++i, ++it)
+        // Processes waiting in line for a device are served first.
+        if (int(chosen.size()) == nb_devices and Device_Queue_Is_Empty(Device_Queue_Directory(platform->Name())))
         {
-            it->Set_Information(i, tmp_devices[i], _platform.Id_Offset(), platform->Name().c_str(), false, &_platform); // device_is_gpu == false
+            std::vector<OpenCL_device *> ordered(chosen);
+            std::sort(ordered.begin(), ordered.end(), Compare_Lock_Filenames);
 
-            // When one device is not in use... One device is not in use!
-            if (!it->Is_In_Use())
-                are_all_devices_in_use = false;
+            newly_locked.clear();
+            bool all_locked = true;
+            for (size_t i = 0 ; i < ordered.size() and all_locked ; i++)
+            {
+                if (ordered[i]->Is_Locked() or not ordered[i]->Is_Lockable())
+                    continue;
+                if (ordered[i]->Try_Lock())
+                    newly_locked.push_back(ordered[i]);
+                else
+                    all_locked = false;
+            }
+            if (all_locked)
+                break;
 
+            for (size_t i = 0 ; i < newly_locked.size() ; i++)
+                newly_locked[i]->Unlock();
         }
-        delete[] tmp_devices;
-    }
 
-    // Add GPUs to list
-    if (nb_gpu >= 1)
-    {
-        tmp_devices = new cl_device_id[nb_gpu];
-        err = clGetDeviceIDs(platform->Id(), CL_DEVICE_TYPE_GPU, nb_gpu, tmp_devices, NULL);
-        OpenCL_Test_Success(err, "clGetDeviceIDs()");
-        for (unsigned int i = 0 ; i < nb_gpu ; ++i, ++it)
+        if (not retry.Prepare_Retry(delay))
         {
-            it->Set_Information(nb_cpu+i, tmp_devices[i], _platform.Id_Offset(), platform->Name().c_str(), true, &_platform); // device_is_gpu == true
-
-            // When one device is not in use... One device is not in use!
-            if (!it->Is_In_Use())
-                are_all_devices_in_use = false;
+            OpenCL_Log_Warning("OpenCL: Could not acquire " << nb_devices << " devices on platform '" << platform->Name() << "'.\n");
+            return false;
         }
-        delete[] tmp_devices;
-    }
 
-    assert(it == device_list.end());
+        char delay_string[64];
+        sprintf(delay_string, "%.4f", delay);
+        OpenCL_Log_Warning(
+               "OpenCL: WARNING: Less than " << nb_devices << " devices are free on platform '" << platform->Name() << "'.\n"
+            << "                 Waiting " << delay_string << " seconds before retrying (" << retry.Attempt() << "/" << retry.Max_Attempts() << ")...\n");
+        retry.Sleep(delay);
+    }
 
-    // When all devices are in use we abort the program
-    if (are_all_devices_in_use == true)
+    for (size_t i = 0 ; i < chosen.size() ; i++)
     {
-        std_cout << "All devices on platform '" << _platform.Name() << "' are in use!\n" << std::flush;
-        abort();
+        const bool locked_here = (std::find(newly_locked.begin(), newly_locked.end(), chosen[i]) != newly_locked.end());
+        if (chosen[i]->Get_Context() == NULL and chosen[i]->Set_Context() != CL_SUCCESS)
+        {
+            OpenCL_Log_Info("OpenCL: Failed to set a context on " << chosen[i]->Get_Name() << ".\n");
+            set.Release();
+            for (size_t j = i ; j < chosen.size() ; j++)
+            {
+                if (std::find(newly_locked.begin(), newly_locked.end(), chosen[j]) != newly_locked.end())
+                    chosen[j]->Unlock();
+            }
+            return false;
+        }
+        set.Add(*chosen[i], locked_here);
     }
 
-    preferred_device = NULL;    // The preferred device is unknown for now.
-
-    is_initialized = true;
+    return true;
 }
 
+#ifdef CL_VERSION_1_2
 // *****************************************************************************
-void OpenCL_devices_list::Set_Preferred_OpenCL(const int _preferred_device)
+int OpenCL_devices_list::Partition_CPU_Devices(const OpenCL_Partition_Type type, const int nb_compute_units)
+/**
+ * Split every CPU device of the platform into sub-devices, either one per NUMA
+ * node or into sub-devices of "nb_compute_units" compute units each. Every
+ * sub-device is appended to the list as a lockable device with its own
+ * context, so that many processes can share a node, each one on its own
+ * cache-local set of cores. The partitioned devices are not used directly
+ * anymore; if the preferred device was one of them, a new one is chosen (and
+ * locked if the previous one was).
+ * @return      Number of sub-devices created
+ */
 {
-    std::list<OpenCL_device>::iterator it = device_list.begin();
-    if (_preferred_device == -1)
+    cl_device_partition_property properties[3];
+    std::string description;
+    if (type == OPENCL_PARTITION_BY_NUMA)
     {
-        // Sort the list. The order is defined by "OpenCL_device::operator<"
-        device_list.sort();
-
-        // Initialize context on a device
-        for (it = device_list.begin() ; it != device_list.end() ; ++it)
-        {
-            std_cout << "OpenCL: Trying to set a context on " << it->Get_Name() << " (id = " << it->Get_ID() << ")...";
-            if (it->Set_Context() == CL_SUCCESS)
-            {
-                std_cout << " Success!\n";
-                preferred_device = &(*it);
-
-                break;
-            }
-            else
-            {
-                std_cout << " Failed. Maybe next one will work?\n";
-            }
-        }
+        properties[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+        properties[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+        description   = "NUMA node";
     }
     else
     {
-        if (_preferred_device >= int(device_list.size()))
+        if (nb_compute_units < 1)
         {
-            std_cout << "OpenCL: ERROR: the device requested is out of range. Exiting.\n";
+            OpenCL_Log_Error("OpenCL: ERROR: Partitioning equally requires a positive number of compute units (" << nb_compute_units << " given). Exiting.\n");
             abort();
         }
+        char tmp_string[64];
+        sprintf(tmp_string, "%d compute units, part", nb_compute_units);
+        properties[0] = CL_DEVICE_PARTITION_EQUALLY;
+        properties[1] = nb_compute_units;
+        description   = tmp_string;
+    }
+    properties[2] = 0;
 
-        // Release any allocated context
-        for (it = device_list.begin() ; it != device_list.end() ; ++it)
+    // Sub-devices are appended to the list, so first gather the CPUs to partition.
+    std::vector<OpenCL_device *> cpus;
+    for (std::list<OpenCL_device>::iterator it = device_list.begin() ; it != device_list.end() ; ++it)
+    {
+        if (not it->Is_GPU() and not it->Is_Sub_Device() and not it->Is_Partitioned())
+            cpus.push_back(&(*it));
+    }
+
+    // Release the preferred device if it is about to be partitioned: its lock
+    // would make its own sub-devices look in use.
+    bool preferred_was_released = false;
+    bool preferred_was_locked   = false;
+    if (preferred_device != NULL and std::find(cpus.begin(), cpus.end(), preferred_device) != cpus.end())
+    {
+        preferred_was_released = true;
+        preferred_was_locked   = preferred_device->Is_Locked();
+        preferred_device->Destructor(); // Release its context and lock
+        preferred_device = NULL;
+    }
+
+    int nb_sub_devices_created = 0;
+    for (unsigned int i = 0 ; i < cpus.size() ; i++)
+    {
+        OpenCL_device *cpu = cpus[i];
+
+        cl_uint nb_sub_devices = 0;
+        err = clCreateSubDevices(cpu->Get_Device(), properties, 0, NULL, &nb_sub_devices);
+        if (err != CL_SUCCESS or nb_sub_devices < 2)
         {
-            it->Destructor();
+            OpenCL_Log_Warning("OpenCL: WARNING: Cannot partition \"" << cpu->Get_Name() << "\" by " << description << " ("
+                      << (err != CL_SUCCESS ? OpenCL_Error_to_String(err) : std::string("single sub-device")) << ").\n");
+            err = CL_SUCCESS;
+            continue;
         }
 
-        for (it = device_list.begin() ; it != device_list.end() ; ++it)
-        {
-            if (_preferred_device == it->Get_ID())
-            {
-                std_cout << "OpenCL: Found preferred device (" << it->Get_Parent_Platform()->Name() << ", " << it->Get_Name() << ", id = " << it->Get_ID() << "). Trying to set an context on it...\n";
-                if (it->Set_Context() == CL_SUCCESS)
-                {
-                    std_cout << " Success!\n";
-                    preferred_device = &(*it);
+        std::vector<cl_device_id> sub_devices(nb_sub_devices);
+        err = clCreateSubDevices(cpu->Get_Device(), properties, nb_sub_devices, &sub_devices[0], NULL);
+        OpenCL_Test_Success(err, "clCreateSubDevices()");
 
-                    break;
-                }
-            }
+        for (cl_uint j = 0 ; j < nb_sub_devices ; j++)
+        {
+            char partition_name[128];
+            sprintf(partition_name, " [%s %u/%u]", description.c_str(), j+1, nb_sub_devices);
+
+            // The id is the position in the list, like the other devices.
+            device_list.push_back(OpenCL_device());
+            OpenCL_device &sub_device = device_list.back();
+            sub_device.Set_Parent_Device(cpu, partition_name);
+            sub_device.Set_Information(int(device_list.size()) - 1, sub_devices[j], platform->Name(), false, platform);
+            if (type == OPENCL_PARTITION_BY_NUMA)
+                sub_device.Set_NUMA_Node(Sub_Device_NUMA_Node(sub_devices[j], j, nb_sub_devices));
+            OpenCL_Log_Info(sub_device.Init_Log());
         }
+
+        cpu->Set_Partitioned();
+        nb_sub_devices_created += nb_sub_devices;
     }
 
-    if (preferred_device == NULL)
+    if (preferred_was_released)
     {
-        std_cout << "ERROR: Cannot set an OpenCL context on any of the available devices!\nExiting" << std::flush;
-        abort();
+        OpenCL_Log_Info("OpenCL: Preferred device was partitioned. Choosing a new one.\n");
+        Set_Preferred_OpenCL();
+        if (preferred_was_locked and preferred_device->Is_Lockable())
+            preferred_device->Lock();
     }
+
+    return nb_sub_devices_created;
 }
+#endif // #ifdef CL_VERSION_1_2
 
 // *****************************************************************************
 OpenCL_Kernel::OpenCL_Kernel()
@@ -1147,6 +3378,9 @@ OpenCL_Kernel::OpenCL_Kernel()
     kernel          = NULL;
     global_work_size= NULL;
     local_work_size = NULL;
+    local_work_size_automatic = false;
+    vector_width    = 0;
+    work_size_requested = false;
     err             = 0;
     event           = NULL;
 }
@@ -1168,6 +3402,14 @@ void OpenCL_Kernel::Initialize(std::string _filename, const cl_context &_context
     kernel          = NULL;
     program         = NULL;
     compiler_options= "";
+    local_work_size_automatic = false;
+    vector_width    = 0;
+    work_size_requested = false;
+
+    // Start with the options of the device's tuning profile.
+    tuning = OpenCL_Get_Tuning_Profile(device_id);
+    if (tuning.compiler_options != "")
+        Append_Compiler_Option(tuning.compiler_options);
 
     dimension = 2; // Always use two dimensions.
 
@@ -1211,20 +3453,195 @@ void OpenCL_Kernel::Build(std::string _kernel_name)
     //OpenCL_Test_Success(err, "clGetKernelWorkGroupInfo");
 }
 
+// *****************************************************************************
+void OpenCL_Kernel::Build_Program(std::string _program_name)
+{
+    kernel_name      = _program_name;
+
+    Load_Program_From_File();
+}
+
+// *****************************************************************************
+void OpenCL_Kernel::Build_Shared(const OpenCL_Kernel &built, std::string _kernel_name)
+/**
+ * Create the kernel "_kernel_name" from the program of "built" (see
+ * Build_Program()), on the same context and device. The program is retained,
+ * not built again.
+ */
+{
+    assert(built.program != NULL);
+
+    Initialize(built.filename, built.context, built.device_id);
+    compiler_options = built.compiler_options;
+    kernel_name      = _kernel_name;
+
+    program = built.program;
+    err = clRetainProgram(program);
+    OpenCL_Test_Success(err, "clRetainProgram");
+
+    kernel = clCreateKernel(program, kernel_name.c_str(), &err);
+    OpenCL_Test_Success(err, "clCreateKernel");
+}
+
+// *****************************************************************************
+void OpenCL_Kernel::Build_Variant(const int width)
+{
+    if (kernel)  clReleaseKernel(kernel);
+    if (program) clReleaseProgram(program);
+    kernel  = NULL;
+    program = NULL;
+
+    // Keep the current options (some could have been appended since the
+    // previous variant), without the previous width.
+    char option[32];
+    if (vector_width > 0)
+    {
+        sprintf(option, "-DVECW=%d ", vector_width);
+        const size_t position = compiler_options.find(option);
+        if (position != std::string::npos)
+            compiler_options.erase(position, strlen(option));
+    }
+    sprintf(option, "-DVECW=%d", width);
+    Append_Compiler_Option(option);
+    vector_width = width;
+
+    Build(kernel_name);
+
+    if (work_size_requested)
+        Compute_Work_Size(requested_work_size[0], requested_work_size[1], requested_work_size[2], requested_work_size[3]);
+}
+
+// *****************************************************************************
+void OpenCL_Kernel::Build_Vectorized(std::string _kernel_name, const cl_device_info preferred_width)
+{
+    kernel_name = _kernel_name;
+
+    // Largest supported width not above the preferred one (0, when the type
+    // is not supported, gives 1: the build will tell).
+    cl_uint preferred = 1;
+    err = clGetDeviceInfo(device_id, preferred_width, sizeof(cl_uint), &preferred, NULL);
+    OpenCL_Test_Success(err, "clGetDeviceInfo");
+    int width = 1;
+    while (width * 2 <= int(preferred) and width < 16)
+        width *= 2;
+
+    OpenCL_Log_Debug("OpenCL: Kernel " << kernel_name << ": vector width " << width << " (preferred: " << preferred << ").\n");
+    Build_Variant(width);
+}
+
+// *****************************************************************************
+int OpenCL_Kernel::Benchmark_Vector_Widths(const cl_command_queue &queue, OpenCL_Kernel_Arguments_Setter set_arguments,
+                                           void *scratch_data, void *data, const int max_width)
+{
+    assert(vector_width > 0);           // Build_Vectorized() first
+    assert(work_size_requested);        // Compute_Work_Size() too
+    if (set_arguments != NULL and (scratch_data == NULL or scratch_data == data))
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: Benchmarking kernel " << kernel_name << " needs scratch arguments, distinct from the real ones. Exiting.\n");
+        abort();
+    }
+
+    const double min_duration = 0.02;   // seconds
+    int best_width = vector_width;
+    double best_time = -1.0;
+    cl_program best_program = NULL;
+    cl_kernel  best_kernel  = NULL;
+    std::string best_options;
+    for (int width = 1 ; width <= std::min(max_width, 16) ; width *= 2)
+    {
+        Build_Variant(width);
+        if (set_arguments != NULL)
+            set_arguments(kernel, scratch_data);
+
+        int repetitions;
+        const double t = Time_Kernel(queue, kernel, cl_uint(dimension), global_work_size,
+                                     (local_work_size_automatic ? NULL : local_work_size),
+                                     min_duration, repetitions);
+        OpenCL_Log_Debug("OpenCL: Kernel " << kernel_name << ": vector width " << width << ": "
+                         << t * 1.0e6 << " us (" << repetitions << " repetitions).\n");
+        if (t > 0.0 and (best_time < 0.0 or t < best_time))
+        {
+            // Hold on to the fastest build: the next variants release theirs.
+            if (best_kernel)  clReleaseKernel(best_kernel);
+            if (best_program) clReleaseProgram(best_program);
+            err = clRetainKernel(kernel);
+            OpenCL_Test_Success(err, "clRetainKernel");
+            err = clRetainProgram(program);
+            OpenCL_Test_Success(err, "clRetainProgram");
+            best_kernel  = kernel;
+            best_program = program;
+            best_options = compiler_options;
+            best_time    = t;
+            best_width   = width;
+        }
+    }
+
+    if (best_kernel == NULL)
+    {
+        OpenCL_Log_Warning("OpenCL: WARNING: Could not time the vector widths of kernel " << kernel_name << ".\n");
+        if (best_width != vector_width)
+            Build_Variant(best_width);
+    }
+    else
+    {
+        // Switch to the fastest variant without building it again.
+        clReleaseKernel(kernel);
+        clReleaseProgram(program);
+        kernel           = best_kernel;
+        program          = best_program;
+        compiler_options = best_options;
+        vector_width     = best_width;
+        Compute_Work_Size(requested_work_size[0], requested_work_size[1], requested_work_size[2], requested_work_size[3]);
+    }
+
+    // Back to the caller's arguments.
+    if (set_arguments != NULL)
+        set_arguments(kernel, data);
+    OpenCL_Log_Info("OpenCL: Kernel " << kernel_name << ": using vector width " << best_width << ".\n");
+
+    return best_width;
+}
+
 // *****************************************************************************
 void OpenCL_Kernel::Compute_Work_Size(size_t _global_x, size_t _global_y, size_t _local_x, size_t _local_y)
 /**
- * @param _global_x: The global work size in dimension x.
+ * @param _global_x: The global work size in dimension x (in elements for a vectorized kernel).
  * @param _global_y: The global work size in dimension y.
  * @param _local_x : The local  work size in dimension x.
  * @param _local_y : The local  work size in dimension y.
  */
 {
-    assert(_global_x >= _local_x);
-    assert(_global_y >= _local_y);
+    requested_work_size[0] = _global_x;
+    requested_work_size[1] = _global_y;
+    requested_work_size[2] = _local_x;
+    requested_work_size[3] = _local_y;
+    work_size_requested    = true;
+
+    // Vectorized: one work-item per VECW elements, rounded up to a multiple
+    // of an explicit local size.
+    if (vector_width > 0)
+    {
+        _global_x = (_global_x + vector_width - 1) / vector_width;
+        if (_local_x != 0 and _global_x % _local_x != 0)
+            _global_x += _local_x - _global_x % _local_x;
+    }
 
-    assert(_global_x % _local_x == 0);
-    assert(_global_y % _local_y == 0);
+    if (_local_x == 0)
+        _local_x = Automatic_Local_Size(_global_x);
+    if (_local_y == 0)
+        _local_y = 1;
+
+    // The profile could not find a local size: the runtime will choose one.
+    local_work_size_automatic = (_local_x == 0);
+
+    if (not local_work_size_automatic)
+    {
+        assert(_global_x >= _local_x);
+        assert(_global_y >= _local_y);
+
+        assert(_global_x % _local_x == 0);
+        assert(_global_y % _local_y == 0);
+    }
 
     global_work_size[0] = _global_x;
     global_work_size[1] = _global_y;
@@ -1234,6 +3651,35 @@ void OpenCL_Kernel::Compute_Work_Size(size_t _global_x, size_t _global_y, size_t
 
 }
 
+// *****************************************************************************
+size_t OpenCL_Kernel::Automatic_Local_Size(const size_t global_size)
+/**
+ * Largest multiple of the tuning profile's "local_size_multiple" (the SIMD
+ * width on CPUs) dividing the global size, within the kernel's work group size.
+ * @return 0 if there is none, letting the runtime decide.
+ */
+{
+    if (tuning.local_size_multiple <= 0)
+        return 0;
+
+    const size_t multiple = size_t(tuning.local_size_multiple);
+
+    size_t max_size = multiple;
+    if (kernel != NULL)
+    {
+        err = clGetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_size, NULL);
+        OpenCL_Test_Success(err, "clGetKernelWorkGroupInfo");
+    }
+
+    for (size_t local_size = (max_size / multiple) * multiple ; local_size >= multiple ; local_size -= multiple)
+    {
+        if (global_size % local_size == 0)
+            return local_size;
+    }
+
+    return 0;
+}
+
 // *****************************************************************************
 cl_kernel OpenCL_Kernel::Get_Kernel() const
 {
@@ -1266,13 +3712,113 @@ void OpenCL_Kernel::Append_Compiler_Option(const std::string option)
         compiler_options += " ";
 }
 
+#ifdef CL_VERSION_1_1
+// *****************************************************************************
+struct Kernel_Timing
+{
+    cl_device_id                device;
+    double                      enqueued;
+};
+
+// *****************************************************************************
+void CL_CALLBACK Kernel_Completed(cl_event event, cl_int status, void *data)
+/**
+ * Adds the kernel's execution time to its device's busy time. Without
+ * profiling on the queue, the registry deduces it from the completions.
+ */
+{
+    Kernel_Timing *timing = (Kernel_Timing *) data;
+
+    double duration = -1.0;
+    cl_ulong start, end;
+    if (status == CL_COMPLETE and
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) == CL_SUCCESS and
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,   sizeof(cl_ulong), &end,   NULL) == CL_SUCCESS and
+        end >= start)
+    {
+        duration = double(end - start) * 1.0e-9;
+    }
+
+    OpenCL_Registry::Add_Busy_Time(timing->device, duration, Now() - timing->enqueued);
+
+    delete timing;
+    clReleaseEvent(event);
+}
+#endif // #ifdef CL_VERSION_1_1
+
 // *****************************************************************************
 void OpenCL_Kernel::Launch(const cl_command_queue &command_queue)
 {
+    Launch(command_queue, 0, NULL, NULL);
+}
+
+// *****************************************************************************
+void OpenCL_Kernel::Launch(const cl_command_queue &command_queue,
+                           const cl_uint nb_events_in_wait_list, const cl_event *event_wait_list,
+                           cl_event *completion)
+/**
+ * @param completion    If not NULL, set to the kernel's event. Release it with clReleaseEvent().
+ */
+{
+    OpenCL_Metrics::Instance().kernel_launches->Add();
+
+    // An event is only needed to trace the kernel, or to measure how long it
+    // keeps busy a device held through the registry (or if the caller wants it).
+    // It is local: many threads can launch the same kernel object.
+    // The queue tells which device runs the kernel: with a context shared by
+    // many devices, it is not necessarily the one the program was built for.
+    cl_device_id queue_device = device_id;
+    clGetCommandQueueInfo(command_queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &queue_device, NULL);
+    const bool tracked = OpenCL_Registry::Is_Tracked(queue_device);
+    const bool traced  = OpenCL_Trace::Instance().Is_Enabled();
+    cl_event kernel_event = NULL;
     err = clEnqueueNDRangeKernel(command_queue, Get_Kernel(), Get_Dimension(), NULL,
-                                 Get_Global_Work_Size(), Get_Local_Work_Size(),
-                                 0, NULL, NULL);
+                                 Get_Global_Work_Size(),
+                                 (local_work_size_automatic ? NULL : Get_Local_Work_Size()),
+                                 nb_events_in_wait_list, event_wait_list,
+                                 ((tracked or traced or completion != NULL) ? &kernel_event : NULL));
     OpenCL_Test_Success(err, "clEnqueueNDRangeKernel");
+    if (completion != NULL)
+    {
+        clRetainEvent(kernel_event);
+        *completion = kernel_event;
+    }
+    if (not tracked and not traced)
+    {
+        if (completion != NULL)
+            clReleaseEvent(kernel_event);
+        return;
+    }
+
+    if (traced)
+        OpenCL_Trace::Instance().Add_Event(kernel_event, command_queue, kernel_name, "kernel");
+
+#ifdef CL_VERSION_1_1
+    if (tracked)
+    {
+        Kernel_Timing *timing = new Kernel_Timing;
+        timing->device      = queue_device;
+        timing->enqueued    = Now();
+        err = clSetEventCallback(kernel_event, CL_COMPLETE, Kernel_Completed, timing);
+        if (err != CL_SUCCESS)
+        {
+            delete timing;
+            clReleaseEvent(kernel_event);
+        }
+        return;     // Released by Kernel_Completed()
+    }
+#endif // #ifdef CL_VERSION_1_1
+
+    clReleaseEvent(kernel_event);
+}
+
+// *****************************************************************************
+OpenCL_Future OpenCL_Kernel::Launch_Async(const cl_command_queue &command_queue,
+                                          const cl_uint nb_events_in_wait_list, const cl_event *event_wait_list)
+{
+    cl_event completion = NULL;
+    Launch(command_queue, nb_events_in_wait_list, event_wait_list, &completion);
+    return OpenCL_Future(completion);
 }
 
 // *****************************************************************************
@@ -1304,11 +3850,13 @@ void OpenCL_Kernel::Load_Program_From_File()
     size_t program_length;
     char* cSourceCL;
 
+    const double load_start = Now();
+
     // Test of file exists
     std::ifstream input_file(filename.c_str());
     if (input_file.is_open())
     {
-        std_cout << "Loading OpenCL program from \"" << filename << "\"...\n";
+        OpenCL_Log_Debug("Loading OpenCL program from \"" << filename << "\"...\n");
 
         // Loads the contents of the file at the given path
         cSourceCL = read_opencl_kernel(filename, &pl);
@@ -1326,6 +3874,10 @@ void OpenCL_Kernel::Load_Program_From_File()
     program = clCreateProgramWithSource(context, 1, (const char **) &cSourceCL, &program_length, &err);
     OpenCL_Test_Success(err, "clCreateProgramWithSource");
 
+    std::string platform_name, device_name;
+    Device_Names(device_id, platform_name, device_name);
+    OpenCL_Startup_Profile::Instance().Record(OPENCL_STARTUP_PROGRAM_LOAD, platform_name, device_name, load_start, Now());
+
     Build_Executable(true);
 }
 
@@ -1337,11 +3889,23 @@ void OpenCL_Kernel::Build_Executable(const bool verbose)
 {
     if (verbose)
     {
-        std_cout << "Building the program..." << std::flush;
-        std_cout << "\nOpenCL Compiler Options: " << compiler_options << "\n" << std::flush;
+        OpenCL_Log_Debug("Building the program...");
+        OpenCL_Log_Debug("\nOpenCL Compiler Options: " << compiler_options << "\n");
     }
 
-    err = clBuildProgram(program, 0, NULL, compiler_options.c_str(), NULL, NULL);
+    OpenCL_Metrics &metrics = OpenCL_Metrics::Instance();
+    const double build_start = Now();
+    const double trace_start = OpenCL_Trace::Host_Time();
+    const cl_int build_err = clBuildProgram(program, 0, NULL, compiler_options.c_str(), NULL, NULL);
+    OpenCL_Trace::Instance().Add_Host_Span("clBuildProgram " + kernel_name, "build", trace_start, OpenCL_Trace::Host_Time());
+    const double build_end = Now();
+    metrics.program_build_seconds->Observe(build_end - build_start);
+    std::string platform_name, device_name;
+    Device_Names(device_id, platform_name, device_name);
+    OpenCL_Startup_Profile::Instance().Record(OPENCL_STARTUP_BUILD, platform_name, device_name, build_start, build_end);
+    metrics.program_builds->Add();
+    if (build_err != CL_SUCCESS)
+        metrics.program_build_failures->Add();
 
     char *build_log;
     size_t ret_val_size;
@@ -1351,10 +3915,28 @@ void OpenCL_Kernel::Build_Executable(const bool verbose)
     build_log[ret_val_size] = '\0';
     OpenCL_Test_Success(err, "1. clGetProgramBuildInfo");
     if (verbose)
-        std_cout << "OpenCL kernels file compilation log: \n" << build_log << "\n";
+        OpenCL_Log_Debug("OpenCL kernels file compilation log: \n" << build_log << "\n");
 
-    if (err != CL_SUCCESS)
+    if (build_err != CL_SUCCESS)
     {
+        // With a context shared by many devices, the build could have failed on any of them.
+        cl_uint nb_program_devices = 0;
+        if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &nb_program_devices, NULL) == CL_SUCCESS and nb_program_devices > 1)
+        {
+            std::vector<cl_device_id> program_devices(nb_program_devices);
+            clGetProgramInfo(program, CL_PROGRAM_DEVICES, nb_program_devices*sizeof(cl_device_id), &program_devices[0], NULL);
+            for (cl_uint i = 0 ; i < nb_program_devices ; i++)
+            {
+                if (program_devices[i] == device_id)
+                    continue;
+                size_t log_size = 0;
+                clGetProgramBuildInfo(program, program_devices[i], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+                std::vector<char> device_log(log_size+1, '\0');
+                clGetProgramBuildInfo(program, program_devices[i], CL_PROGRAM_BUILD_LOG, log_size, &device_log[0], NULL);
+                OpenCL_Log_Error("Build log (device " << i << "): \n" << &device_log[0] << "\n");
+            }
+        }
+
         cl_build_status build_status;
         err = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_STATUS, sizeof(cl_build_status), &build_status, NULL);
         OpenCL_Test_Success(err, "0. clGetProgramBuildInfo");
@@ -1368,17 +3950,16 @@ void OpenCL_Kernel::Build_Executable(const bool verbose)
         build_log[ret_val_size] = '\0';
 
         OpenCL_Test_Success(err, "2. clGetProgramBuildInfo");
-        std_cout << "Build log: \n" << build_log << "\n";
-        std_cout << "Kernel did not built correctly. Exiting.\n";
+        OpenCL_Log_Error("Build log: \n" << build_log << "\n");
+        OpenCL_Log_Error("Kernel did not built correctly. Exiting.\n");
 
-        std_cout << std::flush;
         abort();
     }
 
     delete[] build_log;
 
     if (verbose)
-        std_cout << "done.\n";
+        OpenCL_Log_Debug("done.\n");
 }
 
 // *****************************************************************************
@@ -1474,6 +4055,7 @@ OpenCL_Array<T>::OpenCL_Array()
     device_array                = NULL;
     context                     = NULL;
     command_queue               = NULL;
+    zero_copy                   = false;
 }
 
 // *****************************************************************************
@@ -1544,6 +4126,10 @@ void OpenCL_Array<T>::Initialize(int _N, const size_t _sizeof_element,
         {
             kernel_checksum.Append_Compiler_Option("-DOPENCL_APPLE");
         }
+        else if (platform == OPENCL_PLATFORMS_POCL)
+        {
+            kernel_checksum.Append_Compiler_Option("-DOPENCL_POCL");
+        }
 
         kernel_checksum.Build("SHA512_Checksum");
         kernel_checksum.Compute_Work_Size(1, 1, 1, 1);
@@ -1564,11 +4150,30 @@ void OpenCL_Array<T>::Initialize(int _N, const size_t _sizeof_element,
     else
 #endif // #ifdef OpenCLSHA512Checksum
     {
+        // When the device's memory is the host's (CPU devices), use the host
+        // array directly instead of copying it. The runtime needs the array
+        // to be aligned as its own allocations are.
+        cl_uint base_addr_align_bits;
+        err = clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &base_addr_align_bits, NULL);
+        OpenCL_Test_Success(err, "clGetDeviceInfo()");
+        const size_t base_addr_align = std::max(size_t(base_addr_align_bits / CHAR_BIT), size_t(1));
+
+        zero_copy = OpenCL_Get_Tuning_Profile(device).zero_copy
+                    and (size_t(host_array) % base_addr_align == 0)
+                    and not (flags & (CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR));
+
         // Allocate memory on the device
-        device_array = clCreateBuffer(context, flags, new_array_size_bytes, NULL, &err);
+        if (zero_copy)
+            device_array = clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, new_array_size_bytes, host_array, &err);
+        else
+            device_array = clCreateBuffer(context, flags, new_array_size_bytes, NULL, &err);
         OpenCL_Test_Success(err, "clCreateBuffer()");
     }
 
+    // Tell the registry about the memory taken on the device (see OpenCL_Placement_Policy).
+    if (not zero_copy)
+        OpenCL_Registry::Add_Memory(device, (long long) new_array_size_bytes);
+
     // Transfer data from host to device (cpu to gpu)
     Host_to_Device();
 
@@ -1592,7 +4197,12 @@ template <class T>
 void OpenCL_Array<T>::Release_Memory()
 {
     if (device_array)
+    {
         clReleaseMemObject(device_array);
+        device_array = NULL;
+        if (not zero_copy)
+            OpenCL_Registry::Add_Memory(device, -(long long) new_array_size_bytes);
+    }
 }
 
 // *****************************************************************************
@@ -1645,10 +4255,10 @@ void OpenCL_Array<T>::Validate_Data()
 
     if (Host_Checksum() != Device_Checksum())
     {
-        std_cout << "ERROR: Checksums don't match!\n";
-        std_cout << "Host_Checksum()   = " << Host_Checksum() << "\n";
-        std_cout << "Device_Checksum() = " << Device_Checksum() << "\n";
-        std_cout << "Array in hexa:\n"   << OpenCL_SHA512::String_Hexadecimal(host_array, new_array_size_bytes*CHAR_BIT) << "\n";
+        OpenCL_Log_Error("ERROR: Checksums don't match!\n");
+        OpenCL_Log_Error("Host_Checksum()   = " << Host_Checksum() << "\n");
+        OpenCL_Log_Error("Device_Checksum() = " << Device_Checksum() << "\n");
+        OpenCL_Log_Debug("Array in hexa:\n"   << OpenCL_SHA512::String_Hexadecimal(host_array, new_array_size_bytes*CHAR_BIT) << "\n");
     }
 //     else
 //     {
@@ -1664,36 +4274,164 @@ void OpenCL_Array<T>::Validate_Data()
 
 // *****************************************************************************
 template <class T>
-void OpenCL_Array<T>::Host_to_Device()
+void OpenCL_Array<T>::Enqueue_Host_to_Device(const cl_bool blocking, cl_event *completion)
+/**
+ * @param completion    If not NULL, set to the transfer's event. Release it with clReleaseEvent().
+ */
 {
+    if (zero_copy)
+    {
+        // Mapping synchronizes the buffer with the host memory without a copy.
+        // The whole buffer is overwritten by the host: don't read it back.
+#ifdef CL_VERSION_1_2
+        const cl_map_flags map_flags = CL_MAP_WRITE_INVALIDATE_REGION;
+#else
+        const cl_map_flags map_flags = CL_MAP_WRITE;
+#endif
+        void *mapped = clEnqueueMapBuffer(command_queue, device_array, CL_TRUE, map_flags, 0, new_array_size_bytes, 0, NULL, NULL, &err);
+        OpenCL_Test_Success(err, "clEnqueueMapBuffer()");
+        // Fallback for non-conforming runtimes only: a buffer created with
+        // CL_MEM_USE_HOST_PTR must be mapped at host_array.
+        if (mapped != (void *) host_array)
+            memcpy(mapped, host_array, new_array_size_bytes);
+        err = clEnqueueUnmapMemObject(command_queue, device_array, mapped, 0, NULL, completion);
+        OpenCL_Test_Success(err, "clEnqueueUnmapMemObject()");
+        return;
+    }
+
+    const bool traced = OpenCL_Trace::Instance().Is_Enabled();
+    cl_event transfer_event = NULL;
     err = clEnqueueWriteBuffer(command_queue,       // Command queue
                                device_array,        // Memory buffer to write to
-                               CL_TRUE,             // Non-Blocking read
+                               blocking,            // Blocking write?
                                0,                   // Offset in the buffer object to read from
                                new_array_size_bytes,// Size in bytes of data being read
                                host_array,          // Pointer to buffer on device to store write data
                                0,                   // Number of event in the event list
                                NULL,                // List of events that needs to complete before this executes
-                               NULL);               // Event object to return on completion
+                               ((traced or completion != NULL) ? &transfer_event : NULL)); // Event object to return on completion
     OpenCL_Test_Success(err, "clEnqueueWriteBuffer()");
+    if (traced)
+    {
+        char span_name[64];
+        sprintf(span_name, "Host_to_Device (%llu bytes)", (unsigned long long) new_array_size_bytes);
+        OpenCL_Trace::Instance().Add_Event(transfer_event, command_queue, span_name, "transfer");
+    }
+    if (completion != NULL)
+        *completion = transfer_event;
+    else if (transfer_event != NULL)
+        clReleaseEvent(transfer_event);
+
+    OpenCL_Metrics::Instance().host_to_device_bytes->Add(new_array_size_bytes);
+    OpenCL_Metrics::Instance().host_to_device_transfers->Add();
 }
 
 // *****************************************************************************
 template <class T>
-void OpenCL_Array<T>::Device_to_Host()
+void OpenCL_Array<T>::Enqueue_Device_to_Host(const cl_bool blocking, cl_event *completion)
+/**
+ * @param completion    If not NULL, set to the transfer's event. Release it with clReleaseEvent().
+ */
 {
     assert(device_array != NULL);
+    if (zero_copy)
+    {
+        void *mapped = clEnqueueMapBuffer(command_queue, device_array, CL_TRUE, CL_MAP_READ, 0, new_array_size_bytes, 0, NULL, NULL, &err);
+        OpenCL_Test_Success(err, "clEnqueueMapBuffer()");
+        if (mapped != (void *) host_array)
+            memcpy(host_array, mapped, new_array_size_bytes);
+        err = clEnqueueUnmapMemObject(command_queue, device_array, mapped, 0, NULL, completion);
+        OpenCL_Test_Success(err, "clEnqueueUnmapMemObject()");
+        return;
+    }
+
+    const bool traced = OpenCL_Trace::Instance().Is_Enabled();
+    cl_event transfer_event = NULL;
     err = clEnqueueReadBuffer(command_queue,        // Command queue
                               device_array,         // Memory buffer to read from
-                              CL_FALSE,             // Non-Blocking read
+                              blocking,             // Blocking read?
                               0,                    // Offset in the buffer object to read from
                               new_array_size_bytes, // Size in bytes of data being read
                               host_array,           // Pointer to buffer in RAM to store read data
                               0,                    // Number of event in the event list
                               NULL,                 // List of events that needs to complete before this executes
-                              NULL);                // Event object to return on completion
+                              ((traced or completion != NULL) ? &transfer_event : NULL)); // Event object to return on completion
     OpenCL_Test_Success(err, "clEnqueueReadBuffer()");
+    if (traced)
+    {
+        char span_name[64];
+        sprintf(span_name, "Device_to_Host (%llu bytes)", (unsigned long long) new_array_size_bytes);
+        OpenCL_Trace::Instance().Add_Event(transfer_event, command_queue, span_name, "transfer");
+    }
+    if (completion != NULL)
+        *completion = transfer_event;
+    else if (transfer_event != NULL)
+        clReleaseEvent(transfer_event);
+
+    OpenCL_Metrics::Instance().device_to_host_bytes->Add(new_array_size_bytes);
+    OpenCL_Metrics::Instance().device_to_host_transfers->Add();
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Array<T>::Host_to_Device()
+{
+    Enqueue_Host_to_Device(CL_TRUE, NULL);
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Array<T>::Device_to_Host()
+{
+    Enqueue_Device_to_Host(CL_FALSE, NULL);
+}
+
+// *****************************************************************************
+template <class T>
+OpenCL_Future OpenCL_Array<T>::Host_to_Device_Async()
+/**
+ * The host array must not be modified before the future is ready.
+ */
+{
+    cl_event transfer_event = NULL;
+    Enqueue_Host_to_Device(CL_FALSE, &transfer_event);
+    return OpenCL_Future(transfer_event);
+}
+
+// *****************************************************************************
+template <class T>
+OpenCL_Future OpenCL_Array<T>::Device_to_Host_Async()
+/**
+ * The host array holds the device's data once the future is ready.
+ */
+{
+    cl_event transfer_event = NULL;
+    Enqueue_Device_to_Host(CL_FALSE, &transfer_event);
+    return OpenCL_Future(transfer_event);
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Array<T>::Set_Command_Queue(cl_command_queue &_command_queue, cl_device_id &_device)
+{
+    command_queue = _command_queue;
+    device        = _device;
+}
+
+#ifdef CL_VERSION_1_2
+// *****************************************************************************
+template <class T>
+void OpenCL_Array<T>::Migrate(const cl_command_queue &queue, const cl_mem_migration_flags flags)
+/**
+ * @param flags     CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED skips the copy when the
+ *                  content will be overwritten; CL_MIGRATE_MEM_OBJECT_HOST moves it to the host.
+ */
+{
+    assert(device_array != NULL);
+    err = clEnqueueMigrateMemObjects(queue, 1, &device_array, flags, 0, NULL, NULL);
+    OpenCL_Test_Success(err, "clEnqueueMigrateMemObjects()");
 }
+#endif // #ifdef CL_VERSION_1_2
 
 // *****************************************************************************
 namespace OpenCL_SHA512
@@ -1758,7 +4496,7 @@ namespace OpenCL_SHA512
             ((uint64_t *)new_array)[N] = 0x8000000000000000; // 64 bits (double)
         else
         {
-            std_cout << "ERROR: sizeof(array) == " << sizeof_element << " unsupported! Aborting.\n" << std::flush;
+            OpenCL_Log_Error("ERROR: sizeof(array) == " << sizeof_element << " unsupported! Aborting.\n");
             abort();
         }
 
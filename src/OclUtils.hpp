@@ -22,10 +22,19 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 #include <climits>
+#include <pthread.h>
 
 #include <CL/cl.h>
 
+#include "OclUtils_Registry.hpp"
+#include "OclUtils_Metrics.hpp"
+#include "OclUtils_Trace.hpp"
+#include "OclUtils_Startup.hpp"
+#include "OclUtils_Log.hpp"
+#include "OclUtils_Future.hpp"
+
 #ifndef std_cout
 #define std_cout std::cout
 #include <iostream>
@@ -37,15 +46,16 @@ const std::string OPENCL_PLATFORMS_NVIDIA("nvidia");
 const std::string OPENCL_PLATFORMS_AMD("amd");
 const std::string OPENCL_PLATFORMS_INTEL("intel");
 const std::string OPENCL_PLATFORMS_APPLE("apple");
+const std::string OPENCL_PLATFORMS_POCL("pocl");
 
 // *****************************************************************************
 #define OpenCL_Test_Success(err, fct_name)                          \
 if ((err) != CL_SUCCESS)                                            \
 {                                                                   \
-    std_cout                                                        \
-        << "ERROR calling " << fct_name << "() ("                   \
+    OpenCL_Log_Error(                                               \
+           "ERROR calling " << fct_name << "() ("                   \
         << __FILE__ << " line " << __LINE__ << "): "                \
-        << OpenCL_Error_to_String(err) << "\n" << std::flush;               \
+        << OpenCL_Error_to_String(err) << "\n");                    \
     abort();                                                        \
 }
 
@@ -89,6 +99,7 @@ class OpenCL_platforms_list;
 class OpenCL_device;
 class OpenCL_devices_list;
 class OpenCL_Kernel;
+class OpenCL_Device_Set;
 
 // *****************************************************************************
 // Nvidia extensions. On non-nvidia, needs to define those.
@@ -113,13 +124,127 @@ class OpenCL_Kernel;
 #ifndef CL_DEVICE_INTEGRATED_MEMORY_NV
 #define CL_DEVICE_INTEGRATED_MEMORY_NV              0x4006
 #endif
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+#define CL_DEVICE_PCI_BUS_ID_NV                     0x4008
+#endif
+#ifndef CL_DEVICE_PCI_SLOT_ID_NV
+#define CL_DEVICE_PCI_SLOT_ID_NV                    0x4009
+#endif
+#ifndef CL_DEVICE_PCI_DOMAIN_ID_NV
+#define CL_DEVICE_PCI_DOMAIN_ID_NV                  0x400A
+#endif
+
+// AMD (cl_amd_device_attribute_query) and Khronos (cl_khr_pci_bus_info)
+// extensions, used to find the PCI location of a device.
+#ifndef CL_DEVICE_TOPOLOGY_AMD
+#define CL_DEVICE_TOPOLOGY_AMD                      0x4037
+#endif
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+#define CL_DEVICE_PCI_BUS_INFO_KHR                  0x410F
+#endif
 
 // *****************************************************************************
 std::string OpenCL_Error_to_String(cl_int error);
 
+// *****************************************************************************
+// Policy used to retry operations failing because of contention (acquiring a
+// lock file, setting a context on a device). The delay between two attempts
+// grows exponentially, is randomized by "jitter" and capped by "max_delay".
+// No new attempt is made once "deadline" seconds were spent waiting.
+class OpenCL_Retry_Policy
+{
+    public:
+        int                             max_attempts;   // Total number of attempts (at least 1)
+        double                          initial_delay;  // Delay after the first failure (seconds)
+        double                          max_delay;      // Maximum delay between two attempts (seconds)
+        double                          backoff_factor; // Delay multiplier after each failure
+        double                          jitter;         // Fraction of the delay randomized, in [0,1]
+        double                          deadline;       // Maximum total waiting time (seconds), <= 0 for none
+
+        OpenCL_Retry_Policy();
+};
+
+// *****************************************************************************
+// Keep track of the attempts made following an OpenCL_Retry_Policy:
+//      OpenCL_Retry retry(policy);
+//      double delay;
+//      while (!Try_Something() and retry.Prepare_Retry(delay))
+//          retry.Sleep(delay);
+class OpenCL_Retry
+{
+    private:
+        OpenCL_Retry_Policy             policy;
+        int                             attempt;
+        double                          time_waited;
+        unsigned int                    seed;
+
+    public:
+        OpenCL_Retry(const OpenCL_Retry_Policy &_policy);
+
+        bool                            Prepare_Retry(double &delay);
+        void                            Sleep(const double delay);
+        int                             Attempt() const                 { return attempt; }
+        int                             Max_Attempts() const            { return policy.max_attempts; }
+        double                          Time_Waited() const             { return time_waited; }
+};
+
+// *****************************************************************************
+// Key under which a platform is registered in OpenCL_platforms_list, from its
+// vendor string. Known vendors get one of the OPENCL_PLATFORMS_* keys. Other
+// vendors get a key derived from their name ("Foo Bar, Inc." -> "foo_bar_inc").
+// When several platforms share a key, OpenCL_platforms_list registers the
+// second one as "<key>_2", the third one as "<key>_3", etc.
+std::string OpenCL_Platform_Key(const std::string &vendor);
+
+// *****************************************************************************
+// Per-platform (and per device type) tuning applied by OpenCL_Kernel and
+// OpenCL_Array. Profiles registered for the platform key "*" apply to every
+// platform without a more specific one. Device types are matched on their
+// CPU/GPU/accelerator bits only. By default, CPU devices only get local sizes
+// matching their SIMD width; compiler options and zero-copy buffers are left
+// to the application.
+class OpenCL_Tuning_Profile
+{
+    public:
+        std::string                     compiler_options;       // Prepended to the kernels' compiler options
+        int                             local_size_multiple;    // Automatic local sizes are a multiple of this.
+                                                                // -1: SIMD width (preferred float vector width), 0: let the runtime choose
+        bool                            zero_copy;              // Buffers use the host memory directly (CL_MEM_USE_HOST_PTR)
+
+        OpenCL_Tuning_Profile();
+};
+
+void                    OpenCL_Set_Tuning_Profile(const std::string &platform_key, const cl_device_type device_type,
+                                                  const OpenCL_Tuning_Profile &profile);
+OpenCL_Tuning_Profile   OpenCL_Get_Tuning_Profile(const std::string &platform_key, const cl_device_type device_type);
+OpenCL_Tuning_Profile   OpenCL_Get_Tuning_Profile(cl_device_id device);
+
+// *****************************************************************************
+// NUMA-aware host memory. The pages are bound to (preferably) the given node
+// and touched right away, so they stay there whichever thread uses them first.
+// Use the device's node (OpenCL_device::Get_NUMA_Node()) to keep transfers, or
+// a CPU device's accesses, on the local socket. A node of -1 falls back to a
+// plain page-aligned allocation. Free with OpenCL_NUMA_Free() and the same size.
+void *  OpenCL_NUMA_Allocate(const size_t size, const int numa_node);
+void *  OpenCL_NUMA_Allocate(const size_t size, const OpenCL_device &device);
+void    OpenCL_NUMA_Free(void *p, const size_t size);
+int     OpenCL_NUMA_Node_of(const void *p);     // Node holding the page at "p", -1 if unknown
+
+// *****************************************************************************
+// How OpenCL_devices_list::Partition_CPU_Devices() splits a CPU device.
+// Processes sharing a node should all use the same partitioning: sub-devices
+// from different partitionings of a device overlap but don't lock each other.
+enum OpenCL_Partition_Type
+{
+    OPENCL_PARTITION_BY_NUMA,           // One sub-device per NUMA node
+    OPENCL_PARTITION_EQUALLY            // Sub-devices of a given number of compute units
+};
+
 // *****************************************************************************
 bool Verify_if_Device_is_Used(const int device_id, const int platform_id_offset,
-                              const std::string &platform_name, const std::string &device_name);
+                              const std::string &platform_name, const std::string &device_name,
+                              const bool quiet = false,
+                              const OpenCL_Retry_Policy &policy = OpenCL_Retry_Policy());
 
 // *****************************************************************************
 char *read_opencl_kernel(const std::string filename, int *length);
@@ -191,6 +316,86 @@ void free_me(Pointer &p)
     p = NULL;
 }
 
+// **************************************************************
+// Call "fct" once for each of the "nb_tasks" elements of "args", using at
+// most "max_threads" threads (the calling thread included). The limit holds
+// across nested calls: a call made from a task only gets the threads left.
+// Returns when all the tasks are done.
+typedef void (*Task_Function)(void *);
+void Run_Concurrently(Task_Function fct, void **args, const int nb_tasks, const int max_threads);
+
+};
+
+// *****************************************************************************
+// Results of the microbenchmarks run by OpenCL_device::Run_Benchmark().
+class OpenCL_Device_Benchmark
+{
+    public:
+        bool                            valid;
+        double                          bandwidth;          // Global memory bandwidth (GB/s)
+        double                          sp_gflops;          // Single precision (GFLOP/s)
+        double                          dp_gflops;          // Double precision (GFLOP/s), 0 without cl_khr_fp64
+        double                          launch_latency;     // Enqueue to completion of an empty kernel (microseconds)
+
+        OpenCL_Device_Benchmark();
+};
+
+// *****************************************************************************
+// Ranking of devices by benchmark instead of by number of compute units. The
+// score is the product of each metric raised to its weight (the latency being
+// inverted), so only the relative weights matter: a memory-bound workload
+// would put most of the weight on "bandwidth".
+class OpenCL_Benchmark_Ranking
+{
+    public:
+        double                          bandwidth_weight;
+        double                          sp_flops_weight;
+        double                          dp_flops_weight;
+        double                          latency_weight;
+        std::string                     cache_directory;    // Where results are kept, per device and driver version
+
+        OpenCL_Benchmark_Ranking();
+        double                          Score(const OpenCL_Device_Benchmark &benchmark) const;
+};
+
+// *****************************************************************************
+// Placement on the least loaded device, as seen in the registry (OpenCL_Registry):
+// memory declared by its holders (as a fraction of its global memory), their
+// measured utilization and their number (as a fraction of the device's slots).
+// Only useful when devices are shared (see OpenCL_platforms_list::Set_Device_Slots()).
+// Free devices still come before devices in use, the load only orders them.
+class OpenCL_Placement_Policy
+{
+    public:
+        double                          memory_weight;
+        double                          utilization_weight;
+        double                          holders_weight;
+
+        OpenCL_Placement_Policy();
+        double                          Load(const OpenCL_Registry_Device &usage, const cl_ulong global_mem_size,
+                                             const int nb_slots) const;
+};
+
+// *****************************************************************************
+// Called once a device was granted to a process waiting for one
+// (see OpenCL_platforms_list::Wait_for_Free_Device()).
+typedef void (*OpenCL_Device_Granted_Callback)(OpenCL_device &device, void *data);
+
+// *****************************************************************************
+// What a device must provide to be selected. Devices not meeting the
+// requirements are never chosen (nor locked). The default accepts any device.
+class OpenCL_Device_Requirements
+{
+    public:
+        cl_device_type                  device_type;            // CL_DEVICE_TYPE_ALL, _GPU, _CPU, ... (can be or'ed)
+        cl_ulong                        min_global_mem_size;    // Bytes
+        cl_ulong                        min_max_mem_alloc_size; // Bytes, largest single buffer
+        cl_ulong                        min_local_mem_size;     // Bytes
+        std::string                     extensions;             // Space separated, all required (ex: "cl_khr_fp64")
+        std::string                     vendor;                 // Case insensitive part of the vendor's name, "" for any
+
+        OpenCL_Device_Requirements();
+        bool                            Is_Satisfied_By(const OpenCL_device &device, std::string &reason) const;
 };
 
 // *****************************************************************************
@@ -280,6 +485,65 @@ class OpenCL_device
         bool                            is_lockable;
         bool                            file_locked;
         int                             lock_file;
+        // Locked only for a shared context: unlocked when the context is released.
+        bool                            unlock_with_context;
+
+        // Time (seconds) spent waiting before retrying to lock the device or to set its context.
+        double                          lock_time_waited;
+        double                          context_time_waited;
+
+        // Sub-devices created by OpenCL_devices_list::Partition_CPU_Devices().
+        // A sub-device holds an exclusive lock on its own file and a shared
+        // lock on its parent's, so the parent can't be used as a whole while
+        // any of its sub-devices is, and vice versa.
+        const OpenCL_device            *parent_device;
+        std::string                     partition_name;     // Appended to the parent's name
+        bool                            is_partitioned;     // A partitioned device is not used directly anymore
+        int                             parent_lock_file;
+
+        // Multi-slot sharing (see OpenCL_platforms_list::Set_Device_Slots()).
+        // Every process sharing the device holds a shared lock on its file
+        // plus an exclusive lock on one of its slot files. Like any flock(),
+        // slots are freed when the process dies.
+        int                             slot;               // Slot held, -1 if none
+        int                             slot_lock_file;
+
+        std::string                     Slot_Lock_Filename(const int _slot) const;
+        int                             Lock_Free_Slot(const OpenCL_Retry_Policy &policy, double &time_waited);
+        bool                            Acquire_Lock(const OpenCL_Retry_Policy &policy, std::string &error);
+        bool                            Has_Free_Slot() const;
+        bool                            Probe_In_Use(const OpenCL_Retry_Policy &policy) const;
+
+        // Does the device meet the platform list's OpenCL_Device_Requirements?
+        bool                            meets_requirements;
+
+        // NUMA node closest to the device: the node of its PCI slot for GPUs, of
+        // its cores for CPU sub-devices. -1 when unknown or spanning many nodes.
+        int                             numa_node;
+
+        // Benchmark driven ranking. A score of 0 means "not ranked": compute units are compared instead.
+        OpenCL_Device_Benchmark         benchmark;
+        double                          ranking_score;
+
+        // Placement driven ranking. Lower is better, 0 when not ranked.
+        double                          load;
+
+        // Command queues owned by the device, created on demand on its context
+        // and released with it (see Get_Command_Queue() and Get_Stream_Queue()).
+        struct Command_Queue_Entry
+        {
+            cl_command_queue            queue;
+            cl_command_queue_properties properties;
+            pthread_t                   thread;     // Owner of a per thread queue
+            int                         stream;     // -1 for a per thread queue
+        };
+        std::vector<Command_Queue_Entry> command_queues;
+        pthread_mutex_t                 command_queues_mutex;
+        cl_command_queue                Find_Command_Queue(const int stream, cl_command_queue_properties properties);
+
+        // Messages generated by Set_Information(). Since devices are initialized
+        // concurrently, they are kept here and printed in order by the list.
+        std::string                     init_log;
 
     public:
 
@@ -295,21 +559,106 @@ class OpenCL_device
         int                             Get_ID() const              { return device_id;         }
         cl_device_id &                  Get_Device()                { return device;            }
         cl_context &                    Get_Context()               { return context;           }
-        bool                            Is_In_Use()                 { return device_is_in_use;  }
+        bool                            Is_In_Use() const           { return device_is_in_use;  }
         bool                            Is_Lockable()               { return is_lockable;       }
+        bool                            Is_Locked() const           { return file_locked;       }
+        bool                            Is_GPU() const              { return device_is_gpu;     }
+        bool                            Is_Sub_Device() const       { return parent_device != NULL; }
+        bool                            Is_Partitioned() const      { return is_partitioned;    }
+        const OpenCL_device *           Get_Parent_Device() const   { return parent_device;     }
+        int                             Get_NUMA_Node() const       { return numa_node;         }
+        cl_device_type                  Get_Type() const            { return type;              }
+        cl_ulong                        Get_Global_Mem_Size() const { return global_mem_size;   }
+        cl_ulong                        Get_Max_Mem_Alloc_Size() const { return max_mem_alloc_size; }
+        cl_ulong                        Get_Local_Mem_Size() const  { return local_mem_size;    }
+        size_t                          Get_Max_Work_Group_Size() const { return max_work_group_size; }
+        cl_uint                         Get_Preferred_Vector_Width_Char() const   { return preferred_vector_width_char;   }
+        cl_uint                         Get_Preferred_Vector_Width_Short() const  { return preferred_vector_width_short;  }
+        cl_uint                         Get_Preferred_Vector_Width_Int() const    { return preferred_vector_width_int;    }
+        cl_uint                         Get_Preferred_Vector_Width_Long() const   { return preferred_vector_width_long;   }
+        cl_uint                         Get_Preferred_Vector_Width_Float() const  { return preferred_vector_width_float;  }
+        cl_uint                         Get_Preferred_Vector_Width_Double() const { return preferred_vector_width_double; }
+        const std::string &             Get_Extensions() const      { return extensions;        }
+        const std::string &             Get_Vendor() const          { return vendor;            }
+        bool                            Meets_Requirements() const  { return meets_requirements; }
+        int                             Nb_Slots() const;
+        int                             Get_Slot() const            { return slot;              }
+        std::string                     Lock_Filename() const;      // Identifies the device between processes
+        void                            Set_NUMA_Node(const int _numa_node) { numa_node = _numa_node; }
+        void                            Set_Partitioned()           { is_partitioned = true;    }
+        // Must be called before Set_Information() on a sub-device.
+        void                            Set_Parent_Device(const OpenCL_device *_parent_device, const std::string &_partition_name)
+                                                                    { parent_device = _parent_device; partition_name = _partition_name; }
+        const std::string &             Init_Log() const            { return init_log;          }
+        double                          Lock_Time_Waited() const    { return lock_time_waited;    }
+        double                          Context_Time_Waited() const { return context_time_waited; }
+        const OpenCL_Device_Benchmark & Get_Benchmark() const       { return benchmark;           }
+        double                          Get_Ranking_Score() const   { return ranking_score;       }
+        void                            Set_Ranking_Score(const double score) { ranking_score = score; }
+        double                          Get_Load() const            { return load;                }
+        void                            Update_Load(const OpenCL_Placement_Policy &policy);
+        bool                            Run_Benchmark(const std::string &cache_directory);
         void                            Set_Lockable(const bool _is_lockable) { is_lockable = _is_lockable; }
+        // Tell other processes (through the registry) how much memory this one uses on the device.
+        void                            Declare_Memory(const cl_ulong bytes);
 
-        void                            Set_Information(const int _id, cl_device_id _device, const int platform_id_offset,
+        void                            Set_Information(const int _id, cl_device_id _device,
                                                         const std::string &platform_name, const bool _device_is_gpu,
                                                         const OpenCL_platform * const _parent_platform);
 
+        void                            Refresh_In_Use();
         cl_int                          Set_Context();
+        void                            Set_Shared_Context(cl_context &_context, const bool _unlock_with_context = false);
+        void                            Release_Context();
+        // Queues of the pool owned by the device. Properties the device does not
+        // support (CL_DEVICE_QUEUE_PROPERTIES) are dropped with a warning. Queues
+        // stay valid until the context is released; don't release them yourself.
+        // One queue per host thread and set of properties (released when the
+        // thread exits):
+        cl_command_queue                Get_Command_Queue(const cl_command_queue_properties properties = 0);
+        // One queue per stream and set of properties, whichever thread asks for it:
+        cl_command_queue                Get_Stream_Queue(const int stream, const cl_command_queue_properties properties = 0);
+        int                             Nb_Command_Queues() const   { return int(command_queues.size()); }
+        void                            Release_Command_Queues();
+        // Called when a thread exits: its own queues are released.
+        void                            Release_Thread_Command_Queues(const pthread_t thread);
         void                            Print() const;
         void                            Lock();
+        bool                            Try_Lock();
         void                            Unlock();
         bool                            operator<(const OpenCL_device &b);
 };
 
+// *****************************************************************************
+// Devices locked together for a multi-device job (see
+// OpenCL_devices_list::Lock_Best_Devices()), best first. Each one has its own
+// context and command queue, to be given to the kernels and arrays running on
+// it. The devices it locked are unlocked when the set is released or destroyed.
+class OpenCL_Device_Set
+{
+    private:
+        std::vector<OpenCL_device *>    devices;
+        std::vector<cl_command_queue>   queues;
+        std::vector<bool>               owns_lock;      // Locked by the set, to unlock on release
+
+        // Not copyable: the set owns the queues and the locks.
+        OpenCL_Device_Set(const OpenCL_Device_Set &);
+        OpenCL_Device_Set &             operator=(const OpenCL_Device_Set &);
+
+    public:
+        OpenCL_Device_Set();
+        ~OpenCL_Device_Set();
+
+        void                            Add(OpenCL_device &device, const bool unlock_on_release);
+        void                            Release();
+        int                             Size() const                    { return int(devices.size()); }
+        OpenCL_device &                 operator[](const int i)         { return *devices[i]; }
+        cl_device_id &                  Device(const int i)             { return devices[i]->Get_Device(); }
+        cl_context &                    Context(const int i)            { return devices[i]->Get_Context(); }
+        cl_command_queue &              Queue(const int i)              { return queues[i]; }
+        void                            Print() const;
+};
+
 // *****************************************************************************
 class OpenCL_devices_list
 {
@@ -321,6 +670,10 @@ class OpenCL_devices_list
         cl_uint                         nb_gpu;
         int                             err;
         bool                            are_all_devices_in_use;
+        std::string                     init_log;
+
+        // Devices sharing a single context (see Set_Shared_Context())
+        std::vector<OpenCL_device *>    shared_context_devices;
 
     public:
 
@@ -330,10 +683,26 @@ class OpenCL_devices_list
         ~OpenCL_devices_list();
 
         void                            Set_Preferred_OpenCL(const int _preferred_device = -1);
+        void                            Rank_By_Benchmark(const OpenCL_Benchmark_Ranking &ranking);
+        void                            Rank_By_Load(const OpenCL_Placement_Policy &policy);
+        bool                            Lock_Best_Devices(const int nb_devices, OpenCL_Device_Set &set);
+        int                             Nb_Usable_Devices() const;  // Not in use, meeting the requirements
+        void                            Wait_for_Free_Device();
+        void                            Probe_Until_Free();
+#ifdef CL_VERSION_1_2
+        int                             Partition_CPU_Devices(const OpenCL_Partition_Type type, const int nb_compute_units = 0);
+#endif // #ifdef CL_VERSION_1_2
         OpenCL_device &                 Preferred_OpenCL();
+        OpenCL_device &                 Get_Device_by_ID(const int id);
+        // One context spanning the given devices (ids as printed by Print()).
+        // Programs built on it are built for all of them and buffers can be
+        // used from any of their queues. The first device becomes the preferred one.
+        void                            Set_Shared_Context(const std::vector<int> &device_ids);
+        const std::vector<OpenCL_device *> & Shared_Context_Devices() const { return shared_context_devices; }
         cl_device_id &                  Preferred_OpenCL_Device()         { return Preferred_OpenCL().Get_Device(); }
         cl_context &                    Preferred_OpenCL_Device_Context() { return Preferred_OpenCL().Get_Context(); }
         int                             nb_devices()                     { return nb_cpu + nb_gpu; }
+        const std::string &             Init_Log() const                 { return init_log; }
         void                            Print() const;
         void                            Initialize(const OpenCL_platform &_platform,
                                                    const std::string &preferred_platform);
@@ -368,7 +737,17 @@ class OpenCL_platform
         std::string   const             Name() const                        { return name; }
         cl_platform_id                  Id() const                          { return id; }
         int                             Id_Offset() const                   { return id_offset; }
+        // Lock the preferred device, behind the processes waiting in line for one.
+        // Only lists set to wait for a device (Wait_for_Free_Device()) join the
+        // line; the others abort if it is still not empty after the retry policy.
         void                            Lock_Best_Device();
+        bool                            Lock_Best_Devices(const int nb_devices, OpenCL_Device_Set &set)
+                                                                            { return devices_list.Lock_Best_Devices(nb_devices, set); }
+        void                            Set_Shared_Context(const std::vector<int> &device_ids) { devices_list.Set_Shared_Context(device_ids); }
+#ifdef CL_VERSION_1_2
+        int                             Partition_CPU_Devices(const OpenCL_Partition_Type type, const int nb_compute_units = 0)
+                                                                            { return devices_list.Partition_CPU_Devices(type, nb_compute_units); }
+#endif // #ifdef CL_VERSION_1_2
         void                            Print() const;
 };
 
@@ -379,17 +758,80 @@ class OpenCL_platforms_list
         std::map<std::string,OpenCL_platform>   platforms;
         std::string                     preferred_platform;
         bool                            use_locking;
+        int                             max_init_threads;
+        OpenCL_Retry_Policy             retry_policy;
+        bool                            use_benchmark_ranking;
+        OpenCL_Benchmark_Ranking        benchmark_ranking;
+        OpenCL_Device_Requirements      device_requirements;
+        int                             device_slots;
+        cl_ulong                        memory_per_slot;
+        bool                            use_registry;
+        bool                            use_least_loaded;
+        OpenCL_Placement_Policy         placement_policy;
+        bool                            wait_for_device;
+        double                          wait_timeout;
+        OpenCL_Device_Granted_Callback  device_granted_callback;
+        void                           *device_granted_data;
     public:
+        OpenCL_platforms_list();
         void                            Initialize(const std::string &_preferred_platform, const bool _use_locking = true);
         void                            Print() const;
         void                            Print_Preferred() const;
         std::string                     Get_Running_Platform()              { return preferred_platform; }
         bool                            Use_Locking() const                 { return use_locking; }
+        int                             Max_Init_Threads() const            { return max_init_threads; }
+        void                            Set_Max_Init_Threads(const int n)   { max_init_threads = (n < 1 ? 1 : n); }
+        const OpenCL_Retry_Policy &     Retry_Policy() const                { return retry_policy; }
+        void                            Set_Retry_Policy(const OpenCL_Retry_Policy &_policy) { retry_policy = _policy; }
+        // Must be called before Initialize() to affect the choice of the preferred device.
+        void                            Use_Benchmark_Ranking(const OpenCL_Benchmark_Ranking &_ranking = OpenCL_Benchmark_Ranking())
+                                                                            { use_benchmark_ranking = true; benchmark_ranking = _ranking; }
+        bool                            Is_Using_Benchmark_Ranking() const  { return use_benchmark_ranking; }
+        const OpenCL_Benchmark_Ranking &Benchmark_Ranking() const           { return benchmark_ranking; }
+        // Must be called before Initialize(). With the platform "-1", the first
+        // platform having a free device meeting the requirements is chosen.
+        void                            Set_Device_Requirements(const OpenCL_Device_Requirements &_requirements)
+                                                                            { device_requirements = _requirements; }
+        const OpenCL_Device_Requirements &Device_Requirements() const       { return device_requirements; }
+        // Let many processes share each device: every device gets "nb_slots" slots, or
+        // as many slots of "bytes" as its global memory holds. A device is in use once
+        // all its slots are taken. Must be called before Initialize(), with the same
+        // values in every process sharing the devices.
+        void                            Set_Device_Slots(const int nb_slots) { device_slots = (nb_slots < 1 ? 1 : nb_slots); memory_per_slot = 0; }
+        void                            Set_Memory_per_Slot(const cl_ulong bytes) { memory_per_slot = bytes; }
+        int                             Device_Slots() const                { return device_slots; }
+        // Record device holders in the shared memory registry (OpenCL_Registry). On by default.
+        void                            Use_Registry(const bool _use_registry) { use_registry = _use_registry; }
+        bool                            Is_Using_Registry() const           { return use_registry and use_locking; }
+        // Choose the least loaded device instead of the first free one. Needs the
+        // registry. Must be called before Initialize().
+        void                            Use_Least_Loaded_Placement(const OpenCL_Placement_Policy &_policy = OpenCL_Placement_Policy())
+                                                                            { use_least_loaded = true; placement_policy = _policy; }
+        bool                            Is_Using_Least_Loaded_Placement() const { return use_least_loaded and Is_Using_Registry(); }
+        const OpenCL_Placement_Policy & Placement_Policy() const            { return placement_policy; }
+        // Instead of aborting when all devices are in use, wait in line (first come,
+        // first served between processes of the machine) for one to be freed. The
+        // granted device is locked right away. "timeout" in seconds, <= 0 to wait
+        // forever. Must be called before Initialize().
+        void                            Wait_for_Free_Device(const double timeout = -1.0,
+                                                             OpenCL_Device_Granted_Callback callback = NULL,
+                                                             void *callback_data = NULL)
+                                                                            { wait_for_device = true; wait_timeout = timeout;
+                                                                              device_granted_callback = callback; device_granted_data = callback_data; }
+        bool                            Is_Waiting_for_Device() const       { return wait_for_device; }
+        double                          Wait_Timeout() const                { return wait_timeout; }
+        OpenCL_Device_Granted_Callback  Device_Granted_Callback() const     { return device_granted_callback; }
+        void *                          Device_Granted_Data() const         { return device_granted_data; }
+        cl_ulong                        Memory_per_Slot() const             { return memory_per_slot; }
 
         OpenCL_platform & operator[](const std::string key);
         void                            Set_Preferred_OpenCL(const int _preferred_device = -1);
 };
 
+// **************************************************************
+// Sets the arguments of a kernel (see OpenCL_Kernel::Benchmark_Vector_Widths()).
+typedef void (*OpenCL_Kernel_Arguments_Setter)(cl_kernel kernel, void *data);
+
 // **************************************************************
 class OpenCL_Kernel
 {
@@ -403,8 +845,31 @@ class OpenCL_Kernel
                         const cl_device_id &_device_id);
 
         void Build(std::string _kernel_name);
+        // For sources holding many kernels: build the program only ("_program_name"
+        // names it in the logs and traces), then give each kernel its own
+        // OpenCL_Kernel with Build_Shared(), which reuses the program built.
+        void Build_Program(std::string _program_name);
+        void Build_Shared(const OpenCL_Kernel &built, std::string _kernel_name);
+
+        // Vector width variants. The source processes VECW (1, 2, 4, 8 or 16)
+        // consecutive elements per work-item in dimension x; the global size
+        // given to Compute_Work_Size() stays in elements and is divided by
+        // VECW (rounded up: the kernel must handle the end of the data).
+        // Build the variant of the device's preferred width ("preferred_width"
+        // is the CL_DEVICE_PREFERRED_VECTOR_WIDTH_* of the element type).
+        void Build_Vectorized(std::string _kernel_name,
+                              const cl_device_info preferred_width = CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT);
+        // Time every width up to "max_width" on "queue" (after Build_Vectorized()
+        // and Compute_Work_Size()) and keep the fastest. The timed variants get
+        // their arguments from set_arguments(kernel, scratch_data): give it
+        // scratch buffers, the kernels run many times. The variant kept gets
+        // set_arguments(kernel, data). Returns the width kept.
+        int Benchmark_Vector_Widths(const cl_command_queue &queue, OpenCL_Kernel_Arguments_Setter set_arguments,
+                                    void *scratch_data, void *data, const int max_width = 16);
+        int Get_Vector_Width() const { return (vector_width > 0 ? vector_width : 1); }
 
         // By default global_y is one, local_x is MAX_WORK_SIZE and local_y is one.
+        // A local size of 0 lets the device's tuning profile choose it.
         void Compute_Work_Size(size_t _global_x, size_t _global_y, size_t _local_x, size_t _local_y);
 
         cl_kernel Get_Kernel() const;
@@ -413,9 +878,18 @@ class OpenCL_Kernel
         size_t *Get_Local_Work_Size() const;
 
         int Get_Dimension() const;
+        const std::string & Get_Name() const { return kernel_name; }
         void Append_Compiler_Option(const std::string option);
 
         void Launch(const cl_command_queue &command_queue);
+        // Launch after the events of the wait list complete. If "completion" is
+        // not NULL, it receives the kernel's event (to be released by the caller).
+        void Launch(const cl_command_queue &command_queue,
+                    const cl_uint nb_events_in_wait_list, const cl_event *event_wait_list,
+                    cl_event *completion);
+        // Return right away; the future completes with the kernel.
+        OpenCL_Future Launch_Async(const cl_command_queue &command_queue,
+                                   const cl_uint nb_events_in_wait_list = 0, const cl_event *event_wait_list = NULL);
 
         static int Get_Multiple(int n, int base);
 
@@ -437,6 +911,17 @@ class OpenCL_Kernel
         cl_kernel kernel;
         size_t *global_work_size;
         size_t *local_work_size;
+        bool local_work_size_automatic;     // Let the runtime choose the local work size
+
+        OpenCL_Tuning_Profile tuning;
+
+        size_t Automatic_Local_Size(const size_t global_size);
+
+        // Vector width variants
+        int vector_width;                   // VECW of the built variant, 0 if not vectorized
+        bool work_size_requested;
+        size_t requested_work_size[4];      // Compute_Work_Size()'s arguments, in elements
+        void Build_Variant(const int width);
 
         // Debugging variables
         cl_int err;
@@ -450,6 +935,8 @@ class OpenCL_Kernel
 };
 
 
+template <class E> class OpenCL_Expression;   // See OclUtils_Expression.hpp
+
 // *****************************************************************************
 template <class T>
 class OpenCL_Array
@@ -477,6 +964,10 @@ private:
     cl_mem device_array;                // Memory of device
     cl_mem cl_array_size_bit;
     cl_mem cl_sha512sum;
+    bool zero_copy;                     // device_array uses host_array's memory (CL_MEM_USE_HOST_PTR)
+
+    void Enqueue_Host_to_Device(const cl_bool blocking, cl_event *completion);
+    void Enqueue_Device_to_Host(const cl_bool blocking, cl_event *completion);
 
 public:
     OpenCL_Array();
@@ -490,12 +981,29 @@ public:
     void Release_Memory();
     void Host_to_Device();
     void Device_to_Host();
+    // Non-blocking transfers, completed with the returned future.
+    OpenCL_Future Host_to_Device_Async();
+    OpenCL_Future Device_to_Host_Async();
+    // With a context shared by many devices: use another device's queue from now on.
+    void Set_Command_Queue(cl_command_queue &_command_queue, cl_device_id &_device);
+#ifdef CL_VERSION_1_2
+    // Move the buffer (asynchronously) to the device of "queue", before it is needed there.
+    void Migrate(const cl_command_queue &queue, const cl_mem_migration_flags flags = 0);
+#endif // #ifdef CL_VERSION_1_2
     std::string Host_Checksum();
     std::string Device_Checksum();
     void Validate_Data();
 
     inline cl_mem * Get_Device_Array() { return &device_array; }
     inline T *      Get_Host_Pointer() { return  host_array;   }
+    inline int      Get_Size() const   { return  N;            }
+    inline cl_command_queue Get_Command_Queue() { return command_queue; }
+    inline cl_context       Get_Context()       { return context;       }
+    inline cl_device_id     Get_Device()        { return device;        }
+    // Evaluate an elementwise expression of arrays (see OclUtils_Expression.hpp)
+    // with a single fused kernel.
+    template <class E>
+    OpenCL_Array<T> & operator=(const OpenCL_Expression<E> &expression);
     void Set_as_Kernel_Argument(cl_kernel &kernel, const int order);
 };
 
@@ -539,6 +1047,11 @@ namespace OpenCL_SHA512
     void Validation();
 }
 
+// Needs the classes above.
+#include "OclUtils_Pipeline.hpp"
+#include "OclUtils_Primitives.hpp"
+#include "OclUtils_Expression.hpp"
+
 #endif // INC_OCLUTILS_hpp
 
 // ********** End of file ***************************************
@@ -0,0 +1,281 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <cstdio>
+#include <map>
+#include <pthread.h>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Expression.hpp"
+
+// *****************************************************************************
+// Fused kernels built so far, by context, device and source. Their
+// arguments are set and the kernel enqueued with the mutex held. When
+// the cache is full, the kernel used least recently is released.
+// A kernel is built without the mutex: its entry is a placeholder (NULL
+// kernel) meanwhile, and other threads needing it wait for the build.
+typedef std::pair<std::pair<cl_context,cl_device_id>,std::string> Fused_Kernel_Key;
+
+struct Fused_Kernel
+{
+    OpenCL_Kernel                      *kernel;
+    unsigned long long                  last_use;
+};
+
+static std::map<Fused_Kernel_Key,Fused_Kernel> fused_kernels;
+static unsigned long long fused_kernels_uses = 0;
+static pthread_mutex_t fused_kernels_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  fused_kernels_built = PTHREAD_COND_INITIALIZER;
+
+// *****************************************************************************
+bool Is_Floating_Point_Type(const std::string &type)
+{
+    return (type == "float" or type == "double");
+}
+
+// *****************************************************************************
+OpenCL_Expression_Builder::OpenCL_Expression_Builder(const std::string &_output_type)
+{
+    output_type         = _output_type;
+    uses_fp64           = (output_type == "double");
+    uses_floating_point = Is_Floating_Point_Type(output_type);
+}
+
+// *****************************************************************************
+std::string OpenCL_Expression_Builder::Array(cl_mem buffer, const std::string &type)
+{
+    char name[32];
+    for (size_t i = 0 ; i < buffers.size() ; i++)
+    {
+        if (buffers[i] == buffer)
+        {
+            sprintf(name, "x%d", int(i));
+            return name;
+        }
+    }
+
+    const int i = int(buffers.size());
+    buffers.push_back(buffer);
+    if (type == "double")
+        uses_fp64 = true;
+    if (Is_Floating_Point_Type(type))
+        uses_floating_point = true;
+
+    char declaration[128];
+    sprintf(declaration, "__global const %s *a%d", type.c_str(), i);
+    parameters.push_back(declaration);
+    char load[128];
+    sprintf(load, "    const %s x%d = a%d[i];\n", type.c_str(), i, i);
+    loads.push_back(load);
+
+    sprintf(name, "x%d", i);
+    return name;
+}
+
+// *****************************************************************************
+std::string OpenCL_Expression_Builder::Scalar(const double value)
+{
+    const int i = int(scalars.size());
+    scalars.push_back(value);
+    parameters.push_back("");   // Declared by Source(), once the arrays' types are known
+
+    char name[32];
+    sprintf(name, "s%d", i);
+    return name;
+}
+
+// *****************************************************************************
+std::string OpenCL_Expression_Builder::Scalar_Type(const double value) const
+/**
+ * The widest type of the operands: "float * 0.5" stays a float product even
+ * if the result is stored in an int array.
+ */
+{
+    if (uses_fp64)
+        return "double";
+    const bool fits_int = (value >= -2147483648.0 and value <= 2147483647.0 and value == double(cl_int(value)));
+    if (uses_floating_point or not fits_int)
+        return "float";
+    return "int";
+}
+
+// *****************************************************************************
+std::string OpenCL_Expression_Builder::Source(const std::string &expression) const
+/**
+ * __kernel void Fused(__global float *out, const uint n, <arrays and scalars, in order of appearance>)
+ */
+{
+    std::string source;
+    if (uses_fp64)
+        source += "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n";
+    source += "__kernel void Fused(__global " + output_type + " *out, const uint n";
+    size_t next_scalar = 0;
+    for (size_t i = 0 ; i < parameters.size() ; i++)
+    {
+        if (parameters[i] != "")
+        {
+            source += ", " + parameters[i];
+            continue;
+        }
+        char declaration[128];
+        sprintf(declaration, ", const %s s%d", Scalar_Type(scalars[next_scalar]).c_str(), int(next_scalar));
+        source += declaration;
+        next_scalar++;
+    }
+    source += ")\n{\n";
+    source += "    const uint i = get_global_id(0);\n";
+    source += "    if (i >= n)\n";
+    source += "        return;\n";
+    for (size_t i = 0 ; i < loads.size() ; i++)
+        source += loads[i];
+    source += "    out[i] = (" + output_type + ") " + expression + ";\n";
+    source += "}\n";
+    return source;
+}
+
+// *****************************************************************************
+void OpenCL_Expression_Builder::Set_Arguments(cl_kernel kernel, cl_mem output, const cl_uint n) const
+/**
+ * Same order as the parameters: arrays and scalars interleaved.
+ */
+{
+    cl_int err;
+    err  = clSetKernelArg(kernel, 0, sizeof(cl_mem),  &output);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_uint), &n);
+
+    size_t next_buffer = 0;
+    size_t next_scalar = 0;
+    for (size_t i = 0 ; i < parameters.size() ; i++)
+    {
+        const cl_uint index = cl_uint(i + 2);
+        if (parameters[i] != "")        // __global: an array
+        {
+            err |= clSetKernelArg(kernel, index, sizeof(cl_mem), &buffers[next_buffer++]);
+            continue;
+        }
+
+        const double value = scalars[next_scalar++];
+        const std::string type = Scalar_Type(value);
+        if (type == "double")
+        {
+            const cl_double x = cl_double(value);
+            err |= clSetKernelArg(kernel, index, sizeof(x), &x);
+        }
+        else if (type == "float")
+        {
+            const cl_float x = cl_float(value);
+            err |= clSetKernelArg(kernel, index, sizeof(x), &x);
+        }
+        else
+        {
+            const cl_int x = cl_int(value);
+            err |= clSetKernelArg(kernel, index, sizeof(x), &x);
+        }
+    }
+    OpenCL_Test_Success(err, "clSetKernelArg");
+}
+
+// *****************************************************************************
+void OpenCL_Expression_Evaluate(const OpenCL_Expression_Builder &builder, const std::string &expression,
+                                cl_context context, cl_device_id device, cl_command_queue queue,
+                                cl_mem output, const int n)
+{
+    if (n <= 0)
+        return;
+
+    const std::string source = builder.Source(expression);
+    const Fused_Kernel_Key key(std::make_pair(context, device), source);
+
+    pthread_mutex_lock(&fused_kernels_mutex);
+    std::map<Fused_Kernel_Key,Fused_Kernel>::iterator it = fused_kernels.find(key);
+    while (it != fused_kernels.end() and it->second.kernel == NULL)
+    {
+        // Another thread is building it.
+        pthread_cond_wait(&fused_kernels_built, &fused_kernels_mutex);
+        it = fused_kernels.find(key);
+    }
+    if (it == fused_kernels.end())
+    {
+        if (int(fused_kernels.size()) >= OPENCL_EXPRESSION_CACHE_SIZE)
+        {
+            std::map<Fused_Kernel_Key,Fused_Kernel>::iterator oldest = fused_kernels.end();
+            for (std::map<Fused_Kernel_Key,Fused_Kernel>::iterator other = fused_kernels.begin() ; other != fused_kernels.end() ; ++other)
+            {
+                if (other->second.kernel != NULL and (oldest == fused_kernels.end() or other->second.last_use < oldest->second.last_use))
+                    oldest = other;
+            }
+            if (oldest != fused_kernels.end())
+            {
+                delete oldest->second.kernel;
+                fused_kernels.erase(oldest);
+            }
+        }
+
+        Fused_Kernel placeholder;
+        placeholder.kernel   = NULL;
+        placeholder.last_use = 0;
+        it = fused_kernels.insert(std::make_pair(key, placeholder)).first;
+        pthread_mutex_unlock(&fused_kernels_mutex);
+
+        OpenCL_Log_Debug("OpenCL: Fused kernel:\n" << source);
+        OpenCL_Kernel *kernel = new OpenCL_Kernel(source, context, device);
+        kernel->Build("Fused");
+
+        // Placeholders are neither evicted nor cleared: 'it' is still valid.
+        pthread_mutex_lock(&fused_kernels_mutex);
+        it->second.kernel = kernel;
+        pthread_cond_broadcast(&fused_kernels_built);
+    }
+    it->second.last_use = ++fused_kernels_uses;
+    OpenCL_Kernel &kernel = *(it->second.kernel);
+
+    builder.Set_Arguments(kernel.Get_Kernel(), output, cl_uint(n));
+    kernel.Compute_Work_Size(size_t(n), 1, 0, 1);
+    kernel.Launch(queue);
+    pthread_mutex_unlock(&fused_kernels_mutex);
+}
+
+// *****************************************************************************
+int OpenCL_Expression_Cache_Size()
+{
+    pthread_mutex_lock(&fused_kernels_mutex);
+    const int size = int(fused_kernels.size());
+    pthread_mutex_unlock(&fused_kernels_mutex);
+    return size;
+}
+
+// *****************************************************************************
+void OpenCL_Expression_Clear_Cache()
+{
+    pthread_mutex_lock(&fused_kernels_mutex);
+    // Kernels being built stay: their builder will fill them in.
+    std::map<Fused_Kernel_Key,Fused_Kernel>::iterator it = fused_kernels.begin();
+    while (it != fused_kernels.end())
+    {
+        if (it->second.kernel == NULL)
+        {
+            ++it;
+            continue;
+        }
+        delete it->second.kernel;
+        fused_kernels.erase(it++);
+    }
+    pthread_mutex_unlock(&fused_kernels_mutex);
+}
+
+// ********** End of file ***************************************
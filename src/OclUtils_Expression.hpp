@@ -0,0 +1,326 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_EXPRESSION_hpp
+#define INC_OCLUTILS_EXPRESSION_hpp
+
+#include <cstdlib>      // abort()
+#include <string>
+#include <vector>
+
+#include <CL/cl.h>
+
+#include "OclUtils.hpp"
+
+// *****************************************************************************
+// Elementwise expressions over OpenCL_Arrays, evaluated by one fused kernel:
+//      c = a * b + d;
+//      e = sqrt(c) * 0.5f;
+// Operators and functions only build an expression tree; assigning it to
+// an array generates the kernel's source (each input read once, the
+// output written once), builds it with OpenCL_Kernel the first time this
+// source is seen on the device, and launches it on the assigned array's
+// queue. The arrays must have the same size, and live in the assigned
+// array's context. Scalars have the widest floating point type of the
+// operands (double if any array, or the assigned one, is double; int if
+// they are all integers and so is the scalar), only the result is
+// converted to the assigned array's type. The cache keeps the
+// OPENCL_EXPRESSION_CACHE_SIZE kernels used last.
+// The functions (sqrt, exp, log, sin, cos, fabs, pow, fmin, fmax) are
+// OpenCL's: use them on floating point arrays.
+
+// *****************************************************************************
+template <class T> struct OpenCL_Type_Name;
+template <> struct OpenCL_Type_Name<float>  { static const char * Name() { return "float";  } };
+template <> struct OpenCL_Type_Name<double> { static const char * Name() { return "double"; } };
+template <> struct OpenCL_Type_Name<int>    { static const char * Name() { return "int";    } };
+template <> struct OpenCL_Type_Name<char>   { static const char * Name() { return "char";   } };
+
+// *****************************************************************************
+// Collects the kernel's parameters while the expression's code is generated.
+class OpenCL_Expression_Builder
+{
+    private:
+        std::string                     output_type;
+        std::vector<std::string>        parameters;     // Declarations, after the output and the size (empty for scalars)
+        std::vector<std::string>        loads;          // Reads of the input arrays
+        std::vector<cl_mem>             buffers;        // Input arrays
+        std::vector<double>             scalars;
+        bool                            uses_fp64;
+        bool                            uses_floating_point;    // Any array (or the output) is float or double
+
+        // Known once every array was seen.
+        std::string                     Scalar_Type(const double value) const;
+
+    public:
+        OpenCL_Expression_Builder(const std::string &_output_type);
+
+        // Name of the array's element in the kernel (an array used twice is read once).
+        std::string                     Array(cl_mem buffer, const std::string &type);
+        // Name of a kernel parameter holding the value.
+        std::string                     Scalar(const double value);
+
+        std::string                     Source(const std::string &expression) const;
+        void                            Set_Arguments(cl_kernel kernel, cl_mem output, const cl_uint n) const;
+};
+
+// Build (or get from the cache) the kernel of "builder" and "expression" and launch it.
+void    OpenCL_Expression_Evaluate(const OpenCL_Expression_Builder &builder, const std::string &expression,
+                                   cl_context context, cl_device_id device, cl_command_queue queue,
+                                   cl_mem output, const int n);
+const int OPENCL_EXPRESSION_CACHE_SIZE      = 64;
+int     OpenCL_Expression_Cache_Size();
+// Release the cached kernels (before releasing their contexts).
+void    OpenCL_Expression_Clear_Cache();
+
+// Size() of the nodes not made of arrays, and of nodes mixing arrays of different sizes.
+const int OPENCL_EXPRESSION_SCALAR_SIZE     = -1;
+const int OPENCL_EXPRESSION_SIZE_MISMATCH   = -2;
+
+// *****************************************************************************
+// Base of the expression nodes (curiously recurring template pattern).
+template <class E>
+class OpenCL_Expression
+{
+    public:
+        const E &                       Derived() const     { return static_cast<const E &>(*this); }
+};
+
+// *****************************************************************************
+template <class T>
+class OpenCL_Array_Terminal : public OpenCL_Expression<OpenCL_Array_Terminal<T> >
+{
+    private:
+        cl_mem                          buffer;
+        int                             size;
+
+    public:
+        OpenCL_Array_Terminal(cl_mem _buffer, const int _size) : buffer(_buffer), size(_size) {}
+
+        std::string                     Emit(OpenCL_Expression_Builder &builder) const  { return builder.Array(buffer, OpenCL_Type_Name<T>::Name()); }
+        int                             Size() const                                    { return size; }
+};
+
+// *****************************************************************************
+class OpenCL_Scalar_Terminal : public OpenCL_Expression<OpenCL_Scalar_Terminal>
+{
+    private:
+        double                          value;
+
+    public:
+        OpenCL_Scalar_Terminal(const double _value) : value(_value) {}
+
+        std::string                     Emit(OpenCL_Expression_Builder &builder) const  { return builder.Scalar(value); }
+        int                             Size() const                                    { return OPENCL_EXPRESSION_SCALAR_SIZE; }
+};
+
+// *****************************************************************************
+template <class Op, class A>
+class OpenCL_Unary_Expression : public OpenCL_Expression<OpenCL_Unary_Expression<Op,A> >
+{
+    private:
+        A                               a;
+
+    public:
+        OpenCL_Unary_Expression(const A &_a) : a(_a) {}
+
+        std::string                     Emit(OpenCL_Expression_Builder &builder) const  { return Op::Apply(a.Emit(builder)); }
+        int                             Size() const                                    { return a.Size(); }
+};
+
+// *****************************************************************************
+template <class Op, class A, class B>
+class OpenCL_Binary_Expression : public OpenCL_Expression<OpenCL_Binary_Expression<Op,A,B> >
+{
+    private:
+        A                               a;
+        B                               b;
+
+    public:
+        OpenCL_Binary_Expression(const A &_a, const B &_b) : a(_a), b(_b) {}
+
+        std::string                     Emit(OpenCL_Expression_Builder &builder) const
+        {
+            const std::string code_a = a.Emit(builder);     // Parameters in order
+            return Op::Apply(code_a, b.Emit(builder));
+        }
+        int                             Size() const
+        {
+            const int size_a = a.Size();
+            const int size_b = b.Size();
+            if (size_a == OPENCL_EXPRESSION_SIZE_MISMATCH or size_b == OPENCL_EXPRESSION_SIZE_MISMATCH or
+                (size_a >= 0 and size_b >= 0 and size_a != size_b))
+                return OPENCL_EXPRESSION_SIZE_MISMATCH;
+            return (size_a >= 0 ? size_a : size_b);
+        }
+};
+
+// *****************************************************************************
+// What can appear in an expression: arrays and nodes ("is_node"), and
+// scalars along with at least one of them. Other types have no "Type", so
+// the operators below don't apply to them.
+template <class X> struct OpenCL_Operand { static const bool is_node = false; };
+
+template <class T> struct OpenCL_Operand<OpenCL_Array<T> >
+{
+    static const bool is_node = true;
+    typedef OpenCL_Array_Terminal<T> Type;
+    // The array's getters are not const.
+    static Type Make(const OpenCL_Array<T> &x)
+    {
+        OpenCL_Array<T> &array = const_cast<OpenCL_Array<T> &>(x);
+        return Type(*array.Get_Device_Array(), array.Get_Size());
+    }
+};
+
+template <class T> struct OpenCL_Operand<OpenCL_Array_Terminal<T> >
+{
+    static const bool is_node = true;
+    typedef OpenCL_Array_Terminal<T> Type;
+    static const Type & Make(const Type &x) { return x; }
+};
+
+template <class Op, class A> struct OpenCL_Operand<OpenCL_Unary_Expression<Op,A> >
+{
+    static const bool is_node = true;
+    typedef OpenCL_Unary_Expression<Op,A> Type;
+    static const Type & Make(const Type &x) { return x; }
+};
+
+template <class Op, class A, class B> struct OpenCL_Operand<OpenCL_Binary_Expression<Op,A,B> >
+{
+    static const bool is_node = true;
+    typedef OpenCL_Binary_Expression<Op,A,B> Type;
+    static const Type & Make(const Type &x) { return x; }
+};
+
+#define OPENCL_EXPRESSION_SCALAR(S)                                                 \
+template <> struct OpenCL_Operand<S>                                                \
+{                                                                                   \
+    static const bool is_node = false;                                              \
+    typedef OpenCL_Scalar_Terminal Type;                                            \
+    static Type Make(const S x) { return Type(double(x)); }                         \
+};
+OPENCL_EXPRESSION_SCALAR(float)
+OPENCL_EXPRESSION_SCALAR(double)
+OPENCL_EXPRESSION_SCALAR(int)
+OPENCL_EXPRESSION_SCALAR(char)
+#undef OPENCL_EXPRESSION_SCALAR
+
+// Result types, only defined when "enabled" (SFINAE on the operators' return type).
+template <bool enabled, class Op, class A>          struct OpenCL_Unary_Result  {};
+template <class Op, class A>                        struct OpenCL_Unary_Result<true,Op,A>
+{
+    typedef OpenCL_Unary_Expression<Op, typename OpenCL_Operand<A>::Type> Type;
+};
+template <bool enabled, class Op, class A, class B> struct OpenCL_Binary_Result {};
+template <class Op, class A, class B>               struct OpenCL_Binary_Result<true,Op,A,B>
+{
+    typedef OpenCL_Binary_Expression<Op, typename OpenCL_Operand<A>::Type, typename OpenCL_Operand<B>::Type> Type;
+};
+
+// *****************************************************************************
+// Operators, as C operators and OpenCL built-in functions.
+#define OPENCL_EXPRESSION_OPERATOR(OP_NAME, OPERATOR, SYMBOL)                       \
+struct OP_NAME                                                                      \
+{                                                                                   \
+    static std::string Apply(const std::string &a, const std::string &b)            \
+                                    { return "(" + a + " " SYMBOL " " + b + ")"; }  \
+};                                                                                  \
+template <class A, class B>                                                         \
+typename OpenCL_Binary_Result<OpenCL_Operand<A>::is_node or OpenCL_Operand<B>::is_node, OP_NAME, A, B>::Type \
+OPERATOR(const A &a, const B &b)                                                    \
+{                                                                                   \
+    return typename OpenCL_Binary_Result<true, OP_NAME, A, B>::Type(OpenCL_Operand<A>::Make(a), OpenCL_Operand<B>::Make(b)); \
+}
+OPENCL_EXPRESSION_OPERATOR(OpenCL_Op_Add,       operator+,  "+")
+OPENCL_EXPRESSION_OPERATOR(OpenCL_Op_Subtract,  operator-,  "-")
+OPENCL_EXPRESSION_OPERATOR(OpenCL_Op_Multiply,  operator*,  "*")
+OPENCL_EXPRESSION_OPERATOR(OpenCL_Op_Divide,    operator/,  "/")
+#undef OPENCL_EXPRESSION_OPERATOR
+
+#define OPENCL_EXPRESSION_FUNCTION_1(OP_NAME, FUNCTION)                             \
+struct OP_NAME                                                                      \
+{                                                                                   \
+    static std::string Apply(const std::string &a) { return #FUNCTION "(" + a + ")"; } \
+};                                                                                  \
+template <class A>                                                                  \
+typename OpenCL_Unary_Result<OpenCL_Operand<A>::is_node, OP_NAME, A>::Type          \
+FUNCTION(const A &a)                                                                \
+{                                                                                   \
+    return typename OpenCL_Unary_Result<true, OP_NAME, A>::Type(OpenCL_Operand<A>::Make(a)); \
+}
+OPENCL_EXPRESSION_FUNCTION_1(OpenCL_Op_Sqrt,    sqrt)
+OPENCL_EXPRESSION_FUNCTION_1(OpenCL_Op_Exp,     exp)
+OPENCL_EXPRESSION_FUNCTION_1(OpenCL_Op_Log,     log)
+OPENCL_EXPRESSION_FUNCTION_1(OpenCL_Op_Sin,     sin)
+OPENCL_EXPRESSION_FUNCTION_1(OpenCL_Op_Cos,     cos)
+OPENCL_EXPRESSION_FUNCTION_1(OpenCL_Op_Fabs,    fabs)
+#undef OPENCL_EXPRESSION_FUNCTION_1
+
+#define OPENCL_EXPRESSION_FUNCTION_2(OP_NAME, FUNCTION)                             \
+struct OP_NAME                                                                      \
+{                                                                                   \
+    static std::string Apply(const std::string &a, const std::string &b)            \
+                                    { return #FUNCTION "(" + a + ", " + b + ")"; }  \
+};                                                                                  \
+template <class A, class B>                                                         \
+typename OpenCL_Binary_Result<OpenCL_Operand<A>::is_node or OpenCL_Operand<B>::is_node, OP_NAME, A, B>::Type \
+FUNCTION(const A &a, const B &b)                                                    \
+{                                                                                   \
+    return typename OpenCL_Binary_Result<true, OP_NAME, A, B>::Type(OpenCL_Operand<A>::Make(a), OpenCL_Operand<B>::Make(b)); \
+}
+OPENCL_EXPRESSION_FUNCTION_2(OpenCL_Op_Pow,     pow)
+OPENCL_EXPRESSION_FUNCTION_2(OpenCL_Op_Fmin,    fmin)
+OPENCL_EXPRESSION_FUNCTION_2(OpenCL_Op_Fmax,    fmax)
+#undef OPENCL_EXPRESSION_FUNCTION_2
+
+// Negation
+struct OpenCL_Op_Negate
+{
+    static std::string Apply(const std::string &a) { return "(-" + a + ")"; }
+};
+template <class A>
+typename OpenCL_Unary_Result<OpenCL_Operand<A>::is_node, OpenCL_Op_Negate, A>::Type
+operator-(const A &a)
+{
+    return typename OpenCL_Unary_Result<true, OpenCL_Op_Negate, A>::Type(OpenCL_Operand<A>::Make(a));
+}
+
+// *****************************************************************************
+template <class T>
+template <class E>
+OpenCL_Array<T> & OpenCL_Array<T>::operator=(const OpenCL_Expression<E> &expression)
+{
+    const int size = expression.Derived().Size();
+    if (size == OPENCL_EXPRESSION_SIZE_MISMATCH or (size >= 0 and size != N))
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: Assigning an expression to an array of another size (" << N << " elements). Exiting.\n");
+        abort();
+    }
+
+    OpenCL_Expression_Builder builder(OpenCL_Type_Name<T>::Name());
+    const std::string code = expression.Derived().Emit(builder);
+    OpenCL_Expression_Evaluate(builder, code, context, device, command_queue, device_array, N);
+
+    return *this;
+}
+
+#endif // INC_OCLUTILS_EXPRESSION_hpp
+
+// ********** End of file ***************************************
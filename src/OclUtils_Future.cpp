@@ -0,0 +1,311 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <time.h>       // clock_gettime()
+#include <errno.h>
+
+#include <vector>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Future.hpp"
+
+OpenCL_Executor *OpenCL_Executor::instance = NULL;
+
+// *****************************************************************************
+// Shared by the copies of a future and by the event's callback.
+struct OpenCL_Future_State
+{
+    cl_event                            event;
+    volatile int                        references;
+    pthread_mutex_t                     mutex;
+    pthread_cond_t                      completed;
+    bool                                done;
+    cl_int                              status;
+    std::vector<std::pair<OpenCL_Continuation,void *> > continuations;
+};
+
+// *****************************************************************************
+void Future_State_Release(OpenCL_Future_State *state)
+{
+    if (__sync_sub_and_fetch(&state->references, 1) != 0)
+        return;
+
+    clReleaseEvent(state->event);
+    pthread_mutex_destroy(&state->mutex);
+    pthread_cond_destroy(&state->completed);
+    delete state;
+}
+
+// *****************************************************************************
+void Future_State_Complete(OpenCL_Future_State *state, const cl_int status)
+/**
+ * Mark the command done and hand its continuations to the executor.
+ */
+{
+    pthread_mutex_lock(&state->mutex);
+    state->done     = true;
+    state->status   = status;
+    std::vector<std::pair<OpenCL_Continuation,void *> > continuations;
+    continuations.swap(state->continuations);
+    pthread_cond_broadcast(&state->completed);
+    pthread_mutex_unlock(&state->mutex);
+
+    for (size_t i = 0 ; i < continuations.size() ; i++)
+        OpenCL_Executor::Instance().Post(continuations[i].first, status, continuations[i].second);
+}
+
+#ifdef CL_VERSION_1_1
+// *****************************************************************************
+void CL_CALLBACK Future_Completed(cl_event, cl_int status, void *data)
+{
+    OpenCL_Future_State *state = (OpenCL_Future_State *) data;
+    Future_State_Complete(state, status);
+    Future_State_Release(state);    // The callback's reference
+}
+#endif // #ifdef CL_VERSION_1_1
+
+// *****************************************************************************
+OpenCL_Future::OpenCL_Future()
+{
+    state = NULL;
+}
+
+// *****************************************************************************
+OpenCL_Future::OpenCL_Future(cl_event event)
+{
+    state = NULL;
+    if (event == NULL)
+        return;
+
+    state = new OpenCL_Future_State;
+    state->event        = event;
+    state->references   = 1;
+    state->done         = false;
+    state->status       = CL_QUEUED;
+    pthread_mutex_init(&state->mutex, NULL);
+    pthread_cond_init(&state->completed, NULL);
+
+#ifdef CL_VERSION_1_1
+    __sync_fetch_and_add(&state->references, 1);    // Released by Future_Completed()
+    if (clSetEventCallback(event, CL_COMPLETE, Future_Completed, state) == CL_SUCCESS)
+        return;
+    __sync_fetch_and_sub(&state->references, 1);
+#endif // #ifdef CL_VERSION_1_1
+
+    // No callback: wait now.
+    cl_int status = CL_COMPLETE;
+    if (clWaitForEvents(1, &event) != CL_SUCCESS)
+        clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+    Future_State_Complete(state, status);
+}
+
+// *****************************************************************************
+OpenCL_Future::OpenCL_Future(const OpenCL_Future &other)
+{
+    state = other.state;
+    if (state != NULL)
+        __sync_fetch_and_add(&state->references, 1);
+}
+
+// *****************************************************************************
+OpenCL_Future & OpenCL_Future::operator=(const OpenCL_Future &other)
+{
+    if (other.state != NULL)
+        __sync_fetch_and_add(&other.state->references, 1);
+    Release();
+    state = other.state;
+    return *this;
+}
+
+// *****************************************************************************
+OpenCL_Future::~OpenCL_Future()
+{
+    Release();
+}
+
+// *****************************************************************************
+void OpenCL_Future::Release()
+{
+    if (state != NULL)
+        Future_State_Release(state);
+    state = NULL;
+}
+
+// *****************************************************************************
+bool OpenCL_Future::Is_Ready() const
+{
+    if (state == NULL)
+        return true;
+
+    pthread_mutex_lock(&state->mutex);
+    const bool done = state->done;
+    pthread_mutex_unlock(&state->mutex);
+    return done;
+}
+
+// *****************************************************************************
+bool OpenCL_Future::Wait(const double timeout) const
+{
+    if (state == NULL)
+        return true;
+
+    // Make sure the command gets submitted.
+    cl_command_queue queue = NULL;
+    if (clGetEventInfo(state->event, CL_EVENT_COMMAND_QUEUE, sizeof(cl_command_queue), &queue, NULL) == CL_SUCCESS and queue != NULL)
+        clFlush(queue);
+
+    struct timespec deadline;
+    if (timeout >= 0.0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);   // pthread_cond_timedwait()'s clock
+        const long long nanoseconds = (long long) deadline.tv_nsec + (long long) (timeout * 1.0e9);
+        deadline.tv_sec  += time_t(nanoseconds / 1000000000LL);
+        deadline.tv_nsec  = long(nanoseconds % 1000000000LL);
+    }
+
+    pthread_mutex_lock(&state->mutex);
+    while (not state->done)
+    {
+        if (timeout < 0.0)
+            pthread_cond_wait(&state->completed, &state->mutex);
+        else if (pthread_cond_timedwait(&state->completed, &state->mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    const bool done = state->done;
+    pthread_mutex_unlock(&state->mutex);
+    return done;
+}
+
+// *****************************************************************************
+cl_int OpenCL_Future::Status() const
+{
+    if (state == NULL)
+        return CL_COMPLETE;
+
+    pthread_mutex_lock(&state->mutex);
+    const bool done     = state->done;
+    cl_int status       = state->status;
+    pthread_mutex_unlock(&state->mutex);
+    if (not done)
+        clGetEventInfo(state->event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+    return status;
+}
+
+// *****************************************************************************
+void OpenCL_Future::Then(OpenCL_Continuation continuation, void *data) const
+{
+    if (state == NULL)
+    {
+        OpenCL_Executor::Instance().Post(continuation, CL_COMPLETE, data);
+        return;
+    }
+
+    pthread_mutex_lock(&state->mutex);
+    const bool done = state->done;
+    if (not done)
+        state->continuations.push_back(std::make_pair(continuation, data));
+    pthread_mutex_unlock(&state->mutex);
+
+    if (done)
+        OpenCL_Executor::Instance().Post(continuation, state->status, data);
+}
+
+// *****************************************************************************
+cl_event OpenCL_Future::Event() const
+{
+    return (state == NULL ? NULL : state->event);
+}
+
+// *****************************************************************************
+void OpenCL_Executor::Create_Instance()
+{
+    instance = new OpenCL_Executor();
+}
+
+// *****************************************************************************
+OpenCL_Executor & OpenCL_Executor::Instance()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, Create_Instance);
+    return *instance;
+}
+
+// *****************************************************************************
+OpenCL_Executor::OpenCL_Executor()
+{
+    nb_running = 0;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&task_added, NULL);
+    pthread_cond_init(&task_done, NULL);
+    if (pthread_create(&thread, NULL, Worker_Loop, this) != 0)
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: Could not start the executor thread. Exiting.\n");
+        abort();
+    }
+    pthread_detach(thread);
+}
+
+// *****************************************************************************
+void * OpenCL_Executor::Worker_Loop(void *_executor)
+{
+    OpenCL_Executor *executor = (OpenCL_Executor *) _executor;
+
+    pthread_mutex_lock(&executor->mutex);
+    while (true)
+    {
+        while (executor->tasks.empty())
+            pthread_cond_wait(&executor->task_added, &executor->mutex);
+
+        const Task task = executor->tasks.front();
+        executor->tasks.pop_front();
+        executor->nb_running++;
+        pthread_mutex_unlock(&executor->mutex);
+
+        task.continuation(task.status, task.data);
+
+        pthread_mutex_lock(&executor->mutex);
+        executor->nb_running--;
+        pthread_cond_broadcast(&executor->task_done);
+    }
+    return NULL;
+}
+
+// *****************************************************************************
+void OpenCL_Executor::Post(OpenCL_Continuation continuation, const cl_int status, void *data)
+{
+    Task task;
+    task.continuation   = continuation;
+    task.status         = status;
+    task.data           = data;
+
+    pthread_mutex_lock(&mutex);
+    tasks.push_back(task);
+    pthread_cond_signal(&task_added);
+    pthread_mutex_unlock(&mutex);
+}
+
+// *****************************************************************************
+void OpenCL_Executor::Wait_Idle()
+{
+    pthread_mutex_lock(&mutex);
+    while (not tasks.empty() or nb_running > 0)
+        pthread_cond_wait(&task_done, &mutex);
+    pthread_mutex_unlock(&mutex);
+}
+
+// ********** End of file ***************************************
@@ -0,0 +1,106 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_FUTURE_hpp
+#define INC_OCLUTILS_FUTURE_hpp
+
+#include <deque>
+#include <pthread.h>
+
+#include <CL/cl.h>
+
+// *****************************************************************************
+// Completion of an enqueued command (kernel launch, transfer), without
+// parking a host thread in clFinish():
+//      OpenCL_Future done = kernel.Launch_Async(queue);
+//      done.Then(Process_Results, &results);   // Or done.Is_Ready(), done.Wait(0.5)...
+// Continuations run on the library's executor thread (OpenCL_Executor), never
+// on the OpenCL runtime's callback thread: they may call OpenCL functions,
+// but a continuation blocking for long delays the ones after it.
+// Copies of a future share its state. Without OpenCL 1.1 (no event
+// callbacks), the command is waited for when the future is created.
+
+// status: CL_COMPLETE, or the (negative) error that terminated the command.
+typedef void (*OpenCL_Continuation)(cl_int status, void *data);
+
+struct OpenCL_Future_State;
+
+// *****************************************************************************
+class OpenCL_Future
+{
+    private:
+        OpenCL_Future_State            *state;      // NULL: nothing to wait for
+
+        void                            Release();
+
+    public:
+        OpenCL_Future();
+        // Takes over the caller's reference to "event".
+        explicit OpenCL_Future(cl_event event);
+        OpenCL_Future(const OpenCL_Future &other);
+        OpenCL_Future &                 operator=(const OpenCL_Future &other);
+        ~OpenCL_Future();
+
+        bool                            Is_Ready() const;
+        // Wait at most "timeout" seconds (forever if negative). Returns Is_Ready().
+        bool                            Wait(const double timeout = -1.0) const;
+        // CL_COMPLETE, a negative error code, or the command's current
+        // execution status (CL_QUEUED, CL_SUBMITTED, CL_RUNNING) if not ready.
+        cl_int                          Status() const;
+        // Run "continuation" on the executor once the command is done (right
+        // away if it already is).
+        void                            Then(OpenCL_Continuation continuation, void *data) const;
+        // To be used in an event wait list. NULL if there is nothing to wait for.
+        cl_event                        Event() const;
+};
+
+// *****************************************************************************
+// Thread running the futures' continuations, in the order they become ready.
+class OpenCL_Executor
+{
+    private:
+        struct Task
+        {
+            OpenCL_Continuation         continuation;
+            cl_int                      status;
+            void                       *data;
+        };
+
+        pthread_t                       thread;
+        pthread_mutex_t                 mutex;
+        pthread_cond_t                  task_added;
+        pthread_cond_t                  task_done;
+        std::deque<Task>                tasks;
+        int                             nb_running;
+
+        OpenCL_Executor();
+        static void                     Create_Instance();
+        static void *                   Worker_Loop(void *_executor);
+        static OpenCL_Executor         *instance;
+
+    public:
+        static OpenCL_Executor &        Instance();
+
+        void                            Post(OpenCL_Continuation continuation, const cl_int status, void *data);
+        // Wait until every continuation posted so far has run.
+        void                            Wait_Idle();
+};
+
+#endif // INC_OCLUTILS_FUTURE_hpp
+
+// ********** End of file ***************************************
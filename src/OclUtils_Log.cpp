@@ -0,0 +1,295 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <time.h>       // nanosleep()
+
+#include <cstdlib>      // getenv()
+#include <cstring>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Log.hpp"
+
+OpenCL_Logger *OpenCL_Logger::instance = NULL;
+
+// *****************************************************************************
+void Log_Sleep(const long nanoseconds)
+{
+    struct timespec duration;
+    duration.tv_sec  = 0;
+    duration.tv_nsec = nanoseconds;
+    nanosleep(&duration, NULL);
+}
+
+// *****************************************************************************
+OpenCL_Log_Stream_Sink::OpenCL_Log_Stream_Sink()
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+// *****************************************************************************
+void OpenCL_Log_Stream_Sink::Write(const OpenCL_Log_Level level, const std::string &message)
+{
+    pthread_mutex_lock(&mutex);
+    std_cout << message;
+    if (level >= OPENCL_LOG_WARNING)
+        std_cout << std::flush;
+    pthread_mutex_unlock(&mutex);
+}
+
+// *****************************************************************************
+void OpenCL_Log_Stream_Sink::Flush()
+{
+    pthread_mutex_lock(&mutex);
+    std_cout << std::flush;
+    pthread_mutex_unlock(&mutex);
+}
+
+// *****************************************************************************
+OpenCL_Log_Async_Sink::OpenCL_Log_Async_Sink(OpenCL_Log_Sink *_target, const int capacity)
+{
+    target = _target;
+
+    uint64_t size = 2;
+    while (size < uint64_t(capacity))
+        size *= 2;
+    mask  = size - 1;
+    slots = new Slot[size];
+    for (uint64_t i = 0 ; i < size ; i++)
+    {
+        slots[i].sequence   = i;
+        slots[i].message    = NULL;
+    }
+    enqueue_position = 0;
+    dequeue_position = 0;
+    dropped          = 0;
+    flush_requests   = 0;
+    flushes_done     = 0;
+
+    stop    = false;
+    running = (pthread_create(&thread, NULL, Writer_Loop, this) == 0);
+    if (not running)
+        std_cout << "OpenCL: WARNING: Could not start the log writer thread. Messages will be written synchronously.\n" << std::flush;
+}
+
+// *****************************************************************************
+OpenCL_Log_Async_Sink::~OpenCL_Log_Async_Sink()
+{
+    if (running)
+    {
+        stop = true;
+        pthread_join(thread, NULL);
+    }
+    delete[] slots;
+}
+
+// *****************************************************************************
+void OpenCL_Log_Async_Sink::Write(const OpenCL_Log_Level level, const std::string &message)
+/**
+ * Bounded multi-producer queue: a slot is free for position "p" when its
+ * sequence is "p", and holds a message for the consumer once it is "p+1".
+ */
+{
+    if (not running)
+    {
+        target->Write(level, message);
+        return;
+    }
+
+    uint64_t position = enqueue_position;
+    Slot *slot;
+    while (true)
+    {
+        slot = &slots[position & mask];
+        const uint64_t sequence = slot->sequence;
+        __sync_synchronize();
+        if (sequence == position)
+        {
+            // Claim the slot
+            if (__sync_bool_compare_and_swap(&enqueue_position, position, position + 1))
+                break;
+            position = enqueue_position;
+        }
+        else if (sequence < position)
+        {
+            // Full: the consumer did not free the slot yet. Errors (usually
+            // followed by abort()) wait for it; other messages are dropped.
+            if (level < OPENCL_LOG_ERROR)
+            {
+                __sync_fetch_and_add(&dropped, 1);
+                return;
+            }
+            Log_Sleep(100000);      // 0.1 ms
+            position = enqueue_position;
+        }
+        else
+        {
+            // Another thread claimed it.
+            position = enqueue_position;
+        }
+    }
+
+    slot->level     = level;
+    slot->message   = new std::string(message);
+    __sync_synchronize();
+    slot->sequence  = position + 1;
+}
+
+// *****************************************************************************
+bool OpenCL_Log_Async_Sink::Pop(OpenCL_Log_Level &level, std::string *&message)
+/**
+ * Called by the writer thread only.
+ */
+{
+    Slot *slot = &slots[dequeue_position & mask];
+    if (slot->sequence != dequeue_position + 1)
+        return false;
+    __sync_synchronize();
+
+    level           = slot->level;
+    message         = slot->message;
+    slot->message   = NULL;
+    __sync_synchronize();
+    slot->sequence  = dequeue_position + mask + 1;
+    dequeue_position++;
+    return true;
+}
+
+// *****************************************************************************
+void * OpenCL_Log_Async_Sink::Writer_Loop(void *_sink)
+{
+    OpenCL_Log_Async_Sink *sink = (OpenCL_Log_Async_Sink *) _sink;
+
+    OpenCL_Log_Level level;
+    std::string *message;
+    uint64_t dropped_reported = 0;
+    while (true)
+    {
+        // Read "stop" and the flush requests first: what was logged before
+        // them gets written.
+        const bool stopping = sink->stop;
+        const uint64_t flush_requests = sink->flush_requests;
+        __sync_synchronize();
+
+        bool written = false;
+        while (sink->Pop(level, message))
+        {
+            sink->target->Write(level, *message);
+            delete message;
+            written = true;
+        }
+
+        const uint64_t dropped = sink->dropped;
+        if (dropped != dropped_reported)
+        {
+            std::ostringstream warning;
+            warning << "OpenCL: WARNING: " << dropped - dropped_reported << " log message(s) dropped (log buffer full).\n";
+            sink->target->Write(OPENCL_LOG_WARNING, warning.str());
+            dropped_reported = dropped;
+        }
+
+        if (written or flush_requests != sink->flushes_done)
+        {
+            sink->target->Flush();
+            __sync_synchronize();
+            sink->flushes_done = flush_requests;
+        }
+
+        if (stopping)
+            break;
+        if (not written)
+            Log_Sleep(1000000);     // 1 ms
+    }
+
+    return NULL;
+}
+
+// *****************************************************************************
+void OpenCL_Log_Async_Sink::Flush()
+/**
+ * Wait until the messages logged so far are written (and the target flushed).
+ */
+{
+    if (not running)
+    {
+        target->Flush();
+        return;
+    }
+
+    const uint64_t request = __sync_add_and_fetch(&flush_requests, 1);
+    while (flushes_done < request)
+        Log_Sleep(100000);          // 0.1 ms
+}
+
+// *****************************************************************************
+void OpenCL_Logger::Create_Instance()
+{
+    instance = new OpenCL_Logger();
+}
+
+// *****************************************************************************
+OpenCL_Logger & OpenCL_Logger::Instance()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, Create_Instance);
+    return *instance;
+}
+
+// *****************************************************************************
+OpenCL_Logger::OpenCL_Logger()
+{
+    level   = OPENCL_LOG_INFO;
+    sink    = &stream_sink;
+
+    const char *env = getenv("OCLUTILS_LOG_LEVEL");
+    if (env != NULL)
+    {
+        if      (strcmp(env, "debug")   == 0) level = OPENCL_LOG_DEBUG;
+        else if (strcmp(env, "info")    == 0) level = OPENCL_LOG_INFO;
+        else if (strcmp(env, "warning") == 0) level = OPENCL_LOG_WARNING;
+        else if (strcmp(env, "error")   == 0) level = OPENCL_LOG_ERROR;
+        else if (strcmp(env, "none")    == 0) level = OPENCL_LOG_NONE;
+        else
+            std_cout << "OpenCL: WARNING: Unknown log level \"" << env << "\" in OCLUTILS_LOG_LEVEL.\n" << std::flush;
+    }
+}
+
+// *****************************************************************************
+void OpenCL_Logger::Set_Sink(OpenCL_Log_Sink *_sink)
+{
+    sink->Flush();
+    sink = (_sink == NULL ? &stream_sink : _sink);
+}
+
+// *****************************************************************************
+void OpenCL_Logger::Write(const OpenCL_Log_Level _level, const std::string &message)
+{
+    if (not Is_Enabled(_level))
+        return;
+
+    sink->Write(_level, message);
+    if (_level >= OPENCL_LOG_ERROR)
+        sink->Flush();
+}
+
+// *****************************************************************************
+void OpenCL_Logger::Flush()
+{
+    sink->Flush();
+}
+
+// ********** End of file ***************************************
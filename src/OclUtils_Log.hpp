@@ -0,0 +1,194 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_LOG_hpp
+#define INC_OCLUTILS_LOG_hpp
+
+#include <string>
+#include <sstream>
+#include <stdint.h>
+#include <pthread.h>
+
+// *****************************************************************************
+// Leveled logging of the library. Messages go to a sink: by default std_cout
+// (flushed only for warnings and errors), or any OpenCL_Log_Sink given to
+// OpenCL_Logger::Set_Sink(), like OpenCL_Log_Async_Sink which takes the
+// writing off the calling threads.
+// Messages below OPENCL_LOG_MIN_LEVEL are compiled out entirely: build with
+// -DOPENCL_LOG_MIN_LEVEL=2 to keep only warnings and errors, for example.
+// Messages are written as given: they end with "\n" when a line is complete.
+
+#define OPENCL_LOG_LEVEL_DEBUG      0
+#define OPENCL_LOG_LEVEL_INFO       1
+#define OPENCL_LOG_LEVEL_WARNING    2
+#define OPENCL_LOG_LEVEL_ERROR      3
+#define OPENCL_LOG_LEVEL_NONE       4
+
+#ifndef OPENCL_LOG_MIN_LEVEL
+#define OPENCL_LOG_MIN_LEVEL        OPENCL_LOG_LEVEL_DEBUG
+#endif
+
+enum OpenCL_Log_Level
+{
+    OPENCL_LOG_DEBUG    = OPENCL_LOG_LEVEL_DEBUG,
+    OPENCL_LOG_INFO     = OPENCL_LOG_LEVEL_INFO,
+    OPENCL_LOG_WARNING  = OPENCL_LOG_LEVEL_WARNING,
+    OPENCL_LOG_ERROR    = OPENCL_LOG_LEVEL_ERROR,
+    OPENCL_LOG_NONE     = OPENCL_LOG_LEVEL_NONE
+};
+
+// *****************************************************************************
+// "message" is anything that can be streamed: OpenCL_Log_Info("Got " << n << " devices.\n");
+#define OpenCL_Log(level, message)                                          \
+do                                                                          \
+{                                                                           \
+    if (OpenCL_Logger::Instance().Is_Enabled(level))                        \
+    {                                                                       \
+        std::ostringstream oclutils_log_stream;                             \
+        oclutils_log_stream << message;                                     \
+        OpenCL_Logger::Instance().Write(level, oclutils_log_stream.str());  \
+    }                                                                       \
+} while (0)
+
+#if OPENCL_LOG_MIN_LEVEL <= OPENCL_LOG_LEVEL_DEBUG
+#define OpenCL_Log_Debug(message)   OpenCL_Log(OPENCL_LOG_DEBUG, message)
+#else
+#define OpenCL_Log_Debug(message)   do {} while (0)
+#endif
+
+#if OPENCL_LOG_MIN_LEVEL <= OPENCL_LOG_LEVEL_INFO
+#define OpenCL_Log_Info(message)    OpenCL_Log(OPENCL_LOG_INFO, message)
+#else
+#define OpenCL_Log_Info(message)    do {} while (0)
+#endif
+
+#if OPENCL_LOG_MIN_LEVEL <= OPENCL_LOG_LEVEL_WARNING
+#define OpenCL_Log_Warning(message) OpenCL_Log(OPENCL_LOG_WARNING, message)
+#else
+#define OpenCL_Log_Warning(message) do {} while (0)
+#endif
+
+// Errors are always kept: they are followed by an abort().
+#define OpenCL_Log_Error(message)   OpenCL_Log(OPENCL_LOG_ERROR, message)
+
+// *****************************************************************************
+class OpenCL_Log_Sink
+{
+    public:
+        virtual ~OpenCL_Log_Sink() {}
+        // Called from any thread, concurrently: wrap a sink that is not
+        // thread-safe in an OpenCL_Log_Async_Sink.
+        virtual void                    Write(const OpenCL_Log_Level level, const std::string &message) = 0;
+        virtual void                    Flush() {}
+};
+
+// *****************************************************************************
+// Writes to std_cout; flushes after warnings and errors only.
+class OpenCL_Log_Stream_Sink : public OpenCL_Log_Sink
+{
+    private:
+        pthread_mutex_t                 mutex;
+
+    public:
+        OpenCL_Log_Stream_Sink();
+        void                            Write(const OpenCL_Log_Level level, const std::string &message);
+        void                            Flush();
+};
+
+// *****************************************************************************
+// Hands the messages to a background thread writing them to "target".
+// Logging threads only copy the message into a lock-free ring buffer; when
+// the buffer is full, the message is dropped (and counted) instead of
+// waiting, unless it is an error: errors wait for room and are never
+// dropped. Flush() waits until the buffer is empty. Only the background
+// thread calls the target.
+class OpenCL_Log_Async_Sink : public OpenCL_Log_Sink
+{
+    private:
+        struct Slot
+        {
+            volatile uint64_t           sequence;
+            OpenCL_Log_Level            level;
+            std::string                *message;
+        };
+
+        OpenCL_Log_Sink                *target;
+        Slot                           *slots;
+        uint64_t                        mask;
+        volatile uint64_t               enqueue_position;
+        volatile uint64_t               dequeue_position;
+        volatile uint64_t               dropped;
+        volatile uint64_t               flush_requests;
+        volatile uint64_t               flushes_done;
+
+        pthread_t                       thread;
+        bool                            running;    // Otherwise, messages are written synchronously
+        volatile bool                   stop;
+
+        bool                            Pop(OpenCL_Log_Level &level, std::string *&message);
+        static void *                   Writer_Loop(void *_sink);
+
+        // Not copyable
+        OpenCL_Log_Async_Sink(const OpenCL_Log_Async_Sink &);
+        OpenCL_Log_Async_Sink & operator=(const OpenCL_Log_Async_Sink &);
+
+    public:
+        // "capacity" is rounded up to a power of two. "target" is not owned.
+        OpenCL_Log_Async_Sink(OpenCL_Log_Sink *_target, const int capacity = 4096);
+        // Writes the remaining messages. Remove the sink from the logger first.
+        ~OpenCL_Log_Async_Sink();
+
+        void                            Write(const OpenCL_Log_Level level, const std::string &message);
+        void                            Flush();
+        uint64_t                        Dropped() const     { return dropped; }
+};
+
+// *****************************************************************************
+class OpenCL_Logger
+{
+    private:
+        OpenCL_Log_Level                level;
+        OpenCL_Log_Sink                *sink;
+        OpenCL_Log_Stream_Sink          stream_sink;
+
+        OpenCL_Logger();
+        static void                     Create_Instance();
+        static OpenCL_Logger           *instance;
+
+    public:
+        static OpenCL_Logger &          Instance();
+
+        // Runtime threshold, on top of OPENCL_LOG_MIN_LEVEL. Default: OPENCL_LOG_INFO,
+        // or the OCLUTILS_LOG_LEVEL environment variable (debug, info, warning, error or none).
+        void                            Set_Level(const OpenCL_Log_Level _level)    { level = _level; }
+        OpenCL_Log_Level                Level() const                               { return level; }
+        bool                            Is_Enabled(const OpenCL_Log_Level _level) const
+                                                    { return (_level >= level and _level != OPENCL_LOG_NONE); }
+
+        // The sink is not owned. NULL goes back to std_cout. Change it only
+        // while no other thread logs.
+        void                            Set_Sink(OpenCL_Log_Sink *_sink);
+
+        // Errors are flushed right away.
+        void                            Write(const OpenCL_Log_Level _level, const std::string &message);
+        void                            Flush();
+};
+
+#endif // INC_OCLUTILS_LOG_hpp
+
+// ********** End of file ***************************************
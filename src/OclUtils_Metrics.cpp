@@ -0,0 +1,292 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <unistd.h>     // getpid()
+#include <time.h>       // nanosleep()
+
+#include <cstdio>       // rename()
+#include <fstream>
+#include <sstream>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Metrics.hpp"
+
+OpenCL_Metrics *OpenCL_Metrics::instance = NULL;
+
+// *****************************************************************************
+OpenCL_Counter::OpenCL_Counter(const std::string &_name, const std::string &_help)
+{
+    name    = _name;
+    help    = _help;
+    value   = 0;
+}
+
+// *****************************************************************************
+OpenCL_Histogram::OpenCL_Histogram(const std::string &_name, const std::string &_help)
+{
+    name    = _name;
+    help    = _help;
+    for (int i = 0 ; i <= OPENCL_HISTOGRAM_NB_BUCKETS ; i++)
+        buckets[i] = 0;
+    count   = 0;
+    sum_ns  = 0;
+}
+
+// *****************************************************************************
+double OpenCL_Histogram::Bucket_Bound(const int i)
+/**
+ * Upper bound (seconds) of bucket "i": 1e-5, 1e-4, ..., 100.
+ */
+{
+    double bound = 1.0e-5;
+    for (int j = 0 ; j < i ; j++)
+        bound *= 10.0;
+    return bound;
+}
+
+// *****************************************************************************
+void OpenCL_Histogram::Observe(const double seconds)
+{
+    int i = 0;
+    while (i < OPENCL_HISTOGRAM_NB_BUCKETS and seconds > Bucket_Bound(i))
+        i++;
+
+    __sync_fetch_and_add(&buckets[i], 1);
+    __sync_fetch_and_add(&count, 1);
+    __sync_fetch_and_add(&sum_ns, uint64_t(seconds > 0.0 ? seconds * 1.0e9 : 0.0));
+}
+
+// *****************************************************************************
+void OpenCL_Metrics::Create_Instance()
+{
+    instance = new OpenCL_Metrics();
+}
+
+// *****************************************************************************
+OpenCL_Metrics & OpenCL_Metrics::Instance()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, Create_Instance);
+    return *instance;
+}
+
+// *****************************************************************************
+OpenCL_Metrics::OpenCL_Metrics()
+{
+    pthread_mutex_init(&mutex, NULL);
+    writer_running  = false;
+    writer_stop     = false;
+    writer_interval = 0.0;
+    writer_format   = OPENCL_METRICS_PROMETHEUS;
+
+    host_to_device_bytes        = &Counter("oclutils_host_to_device_bytes_total",       "Bytes written to devices by OpenCL_Array");
+    device_to_host_bytes        = &Counter("oclutils_device_to_host_bytes_total",       "Bytes read from devices by OpenCL_Array");
+    host_to_device_transfers    = &Counter("oclutils_host_to_device_transfers_total",   "Transfers to devices by OpenCL_Array");
+    device_to_host_transfers    = &Counter("oclutils_device_to_host_transfers_total",   "Transfers from devices by OpenCL_Array");
+    kernel_launches             = &Counter("oclutils_kernel_launches_total",            "Kernels enqueued by OpenCL_Kernel");
+    program_builds              = &Counter("oclutils_program_builds_total",             "Calls to clBuildProgram()");
+    program_build_failures      = &Counter("oclutils_program_build_failures_total",     "Calls to clBuildProgram() that failed");
+    program_build_seconds       = &Histogram("oclutils_program_build_seconds",          "Duration of clBuildProgram()");
+    lock_retries                = &Counter("oclutils_lock_retries_total",               "Retries to lock a device's file");
+    lock_wait_seconds           = &Histogram("oclutils_lock_wait_seconds",              "Time waited to lock a device");
+    context_retries             = &Counter("oclutils_context_retries_total",            "Retries to create a context");
+    context_wait_seconds        = &Histogram("oclutils_context_wait_seconds",           "Time waited to create a context");
+}
+
+// *****************************************************************************
+OpenCL_Counter & OpenCL_Metrics::Counter(const std::string &name, const std::string &help)
+{
+    pthread_mutex_lock(&mutex);
+    std::map<std::string,OpenCL_Counter *>::iterator it = counters.find(name);
+    if (it == counters.end())
+        it = counters.insert(std::make_pair(name, new OpenCL_Counter(name, help))).first;
+    pthread_mutex_unlock(&mutex);
+    return *(it->second);
+}
+
+// *****************************************************************************
+OpenCL_Histogram & OpenCL_Metrics::Histogram(const std::string &name, const std::string &help)
+{
+    pthread_mutex_lock(&mutex);
+    std::map<std::string,OpenCL_Histogram *>::iterator it = histograms.find(name);
+    if (it == histograms.end())
+        it = histograms.insert(std::make_pair(name, new OpenCL_Histogram(name, help))).first;
+    pthread_mutex_unlock(&mutex);
+    return *(it->second);
+}
+
+// *****************************************************************************
+std::string OpenCL_Metrics::Prometheus()
+/**
+ * Text exposition format, see https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+{
+    std::ostringstream out;
+    out.precision(9);
+
+    pthread_mutex_lock(&mutex);
+    for (std::map<std::string,OpenCL_Counter *>::const_iterator it = counters.begin() ; it != counters.end() ; ++it)
+    {
+        const OpenCL_Counter &c = *(it->second);
+        if (c.Help() != "")
+            out << "# HELP " << c.Name() << " " << c.Help() << "\n";
+        out << "# TYPE " << c.Name() << " counter\n";
+        out << c.Name() << " " << c.Value() << "\n";
+    }
+    for (std::map<std::string,OpenCL_Histogram *>::const_iterator it = histograms.begin() ; it != histograms.end() ; ++it)
+    {
+        const OpenCL_Histogram &h = *(it->second);
+        if (h.Help() != "")
+            out << "# HELP " << h.Name() << " " << h.Help() << "\n";
+        out << "# TYPE " << h.Name() << " histogram\n";
+        uint64_t cumulative = 0;
+        for (int i = 0 ; i < OPENCL_HISTOGRAM_NB_BUCKETS ; i++)
+        {
+            cumulative += h.Bucket_Count(i);
+            out << h.Name() << "_bucket{le=\"" << OpenCL_Histogram::Bucket_Bound(i) << "\"} " << cumulative << "\n";
+        }
+        cumulative += h.Bucket_Count(OPENCL_HISTOGRAM_NB_BUCKETS);
+        out << h.Name() << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+        out << h.Name() << "_sum " << h.Sum() << "\n";
+        out << h.Name() << "_count " << h.Count() << "\n";
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return out.str();
+}
+
+// *****************************************************************************
+std::string OpenCL_Metrics::JSON()
+/**
+ * {"counters": {name: value, ...}, "histograms": {name: {"count": n, "sum": s, "buckets": [[le, n], ...]}, ...}}
+ * Bucket counts are cumulative, as in the Prometheus format; the last bound is null (+Inf).
+ */
+{
+    std::ostringstream out;
+    out.precision(9);
+
+    pthread_mutex_lock(&mutex);
+    out << "{\n  \"counters\": {";
+    for (std::map<std::string,OpenCL_Counter *>::const_iterator it = counters.begin() ; it != counters.end() ; ++it)
+        out << (it == counters.begin() ? "\n" : ",\n") << "    \"" << it->first << "\": " << it->second->Value();
+    out << "\n  },\n  \"histograms\": {";
+    for (std::map<std::string,OpenCL_Histogram *>::const_iterator it = histograms.begin() ; it != histograms.end() ; ++it)
+    {
+        const OpenCL_Histogram &h = *(it->second);
+        out << (it == histograms.begin() ? "\n" : ",\n")
+            << "    \"" << it->first << "\": {\"count\": " << h.Count() << ", \"sum\": " << h.Sum() << ", \"buckets\": [";
+        uint64_t cumulative = 0;
+        for (int i = 0 ; i <= OPENCL_HISTOGRAM_NB_BUCKETS ; i++)
+        {
+            cumulative += h.Bucket_Count(i);
+            out << (i == 0 ? "" : ", ") << "[";
+            if (i < OPENCL_HISTOGRAM_NB_BUCKETS)
+                out << OpenCL_Histogram::Bucket_Bound(i);
+            else
+                out << "null";
+            out << ", " << cumulative << "]";
+        }
+        out << "]}";
+    }
+    out << "\n  }\n}\n";
+    pthread_mutex_unlock(&mutex);
+
+    return out.str();
+}
+
+// *****************************************************************************
+bool OpenCL_Metrics::Write(const std::string &path, const OpenCL_Metrics_Format format)
+{
+    char suffix[64];
+    sprintf(suffix, ".tmp.%d", int(getpid()));
+    const std::string tmp_path = path + suffix;
+
+    std::ofstream file(tmp_path.c_str());
+    if (not file.is_open())
+        return false;
+    file << (format == OPENCL_METRICS_JSON ? JSON() : Prometheus());
+    file.close();
+    if (file.fail())
+    {
+        remove(tmp_path.c_str());
+        return false;
+    }
+
+    return (rename(tmp_path.c_str(), path.c_str()) == 0);
+}
+
+// *****************************************************************************
+void * OpenCL_Metrics::Writer_Loop(void *_metrics)
+{
+    OpenCL_Metrics *metrics = (OpenCL_Metrics *) _metrics;
+
+    // Sleep by small steps to stop quickly.
+    const double step = 0.1;
+    double slept = metrics->writer_interval;
+    while (not metrics->writer_stop)
+    {
+        if (slept >= metrics->writer_interval)
+        {
+            if (not metrics->Write(metrics->writer_path, metrics->writer_format))
+                OpenCL_Log_Warning("OpenCL: WARNING: Could not write the metrics to " << metrics->writer_path << ".\n");
+            slept = 0.0;
+        }
+        struct timespec duration;
+        duration.tv_sec  = 0;
+        duration.tv_nsec = long(step * 1.0e9);
+        nanosleep(&duration, NULL);
+        slept += step;
+    }
+    metrics->Write(metrics->writer_path, metrics->writer_format);
+
+    return NULL;
+}
+
+// *****************************************************************************
+void OpenCL_Metrics::Write_Periodically(const std::string &path, const double interval,
+                                        const OpenCL_Metrics_Format format)
+{
+    Stop_Writing();
+
+    writer_path     = path;
+    writer_interval = interval;
+    writer_format   = format;
+    writer_stop     = false;
+    if (pthread_create(&writer_thread, NULL, Writer_Loop, this) != 0)
+    {
+        OpenCL_Log_Warning("OpenCL: WARNING: Could not start writing the metrics periodically.\n");
+        return;
+    }
+    writer_running  = true;
+}
+
+// *****************************************************************************
+void OpenCL_Metrics::Stop_Writing()
+/**
+ * Stop the periodic export (after a last write).
+ */
+{
+    if (not writer_running)
+        return;
+
+    writer_stop = true;
+    pthread_join(writer_thread, NULL);
+    writer_running = false;
+}
+
+// ********** End of file ***************************************
@@ -0,0 +1,138 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_METRICS_hpp
+#define INC_OCLUTILS_METRICS_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
+
+// *****************************************************************************
+// Process-wide metrics fed by the library (transfers, builds, lock and context
+// waits) and by the application if it wants to. Updates are lock-free atomic
+// additions; only registering a metric takes a lock. Metrics can be exported
+// in the Prometheus text format or as JSON, on demand or periodically to a
+// file (for a node exporter's textfile collector, for example).
+
+enum OpenCL_Metrics_Format
+{
+    OPENCL_METRICS_PROMETHEUS,
+    OPENCL_METRICS_JSON
+};
+
+// *****************************************************************************
+class OpenCL_Counter
+{
+    private:
+        std::string                     name;
+        std::string                     help;
+        volatile uint64_t               value;
+
+    public:
+        OpenCL_Counter(const std::string &_name, const std::string &_help);
+
+        void                            Add(const uint64_t n = 1)   { __sync_fetch_and_add(&value, n); }
+        uint64_t                        Value() const               { return value; }
+        const std::string &             Name() const                { return name; }
+        const std::string &             Help() const                { return help; }
+};
+
+// *****************************************************************************
+// Durations (seconds) counted in buckets growing tenfold from 10 us to 100 s.
+const int OPENCL_HISTOGRAM_NB_BUCKETS = 8;
+
+class OpenCL_Histogram
+{
+    private:
+        std::string                     name;
+        std::string                     help;
+        volatile uint64_t               buckets[OPENCL_HISTOGRAM_NB_BUCKETS+1];    // Last one is +Inf
+        volatile uint64_t               count;
+        volatile uint64_t               sum_ns;
+
+    public:
+        OpenCL_Histogram(const std::string &_name, const std::string &_help);
+
+        void                            Observe(const double seconds);
+        static double                   Bucket_Bound(const int i);
+        uint64_t                        Bucket_Count(const int i) const { return buckets[i]; }  // Not cumulative
+        uint64_t                        Count() const               { return count; }
+        double                          Sum() const                 { return double(sum_ns) * 1.0e-9; }
+        const std::string &             Name() const                { return name; }
+        const std::string &             Help() const                { return help; }
+};
+
+// *****************************************************************************
+class OpenCL_Metrics
+{
+    private:
+        pthread_mutex_t                 mutex;
+        std::map<std::string,OpenCL_Counter *>      counters;
+        std::map<std::string,OpenCL_Histogram *>    histograms;
+
+        // Periodic export
+        pthread_t                       writer_thread;
+        bool                            writer_running;
+        volatile bool                   writer_stop;
+        std::string                     writer_path;
+        OpenCL_Metrics_Format           writer_format;
+        double                          writer_interval;
+
+        OpenCL_Metrics();
+        static void                     Create_Instance();
+        static void *                   Writer_Loop(void *_metrics);
+        static OpenCL_Metrics          *instance;
+
+    public:
+        static OpenCL_Metrics &         Instance();
+
+        // Metrics of the library, registered at creation.
+        OpenCL_Counter                 *host_to_device_bytes;
+        OpenCL_Counter                 *device_to_host_bytes;
+        OpenCL_Counter                 *host_to_device_transfers;
+        OpenCL_Counter                 *device_to_host_transfers;
+        OpenCL_Counter                 *kernel_launches;
+        OpenCL_Counter                 *program_builds;
+        OpenCL_Counter                 *program_build_failures;
+        OpenCL_Histogram               *program_build_seconds;
+        OpenCL_Counter                 *lock_retries;
+        OpenCL_Histogram               *lock_wait_seconds;
+        OpenCL_Counter                 *context_retries;
+        OpenCL_Histogram               *context_wait_seconds;
+
+        // Get (registering it the first time) a metric. Keep the reference:
+        // updating it is cheap, looking it up is not.
+        OpenCL_Counter &                Counter(const std::string &name, const std::string &help = "");
+        OpenCL_Histogram &              Histogram(const std::string &name, const std::string &help = "");
+
+        std::string                     Prometheus();
+        std::string                     JSON();
+        // Written to a temporary file renamed over "path", so readers never see a partial file.
+        bool                            Write(const std::string &path, const OpenCL_Metrics_Format format = OPENCL_METRICS_PROMETHEUS);
+        // Write every "interval" seconds from a background thread, until Stop_Writing().
+        void                            Write_Periodically(const std::string &path, const double interval,
+                                                           const OpenCL_Metrics_Format format = OPENCL_METRICS_PROMETHEUS);
+        void                            Stop_Writing();
+};
+
+#endif // INC_OCLUTILS_METRICS_hpp
+
+// ********** End of file ***************************************
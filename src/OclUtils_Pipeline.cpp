@@ -0,0 +1,361 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <cstdio>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Pipeline.hpp"
+
+// *****************************************************************************
+std::vector<int> Pipeline_Arguments(const int a)
+{
+    std::vector<int> arguments;
+    arguments.push_back(a);
+    return arguments;
+}
+
+// *****************************************************************************
+std::vector<int> Pipeline_Arguments(const int a, const int b)
+{
+    std::vector<int> arguments = Pipeline_Arguments(a);
+    arguments.push_back(b);
+    return arguments;
+}
+
+// *****************************************************************************
+std::vector<int> Pipeline_Arguments(const int a, const int b, const int c)
+{
+    std::vector<int> arguments = Pipeline_Arguments(a, b);
+    arguments.push_back(c);
+    return arguments;
+}
+
+// *****************************************************************************
+OpenCL_Pipeline::OpenCL_Pipeline()
+{
+    device          = NULL;
+    depth           = 0;
+    upload_queue    = NULL;
+    compute_queue   = NULL;
+    download_queue  = NULL;
+    nb_batches      = 0;
+    first_start     = 0;
+    last_end        = 0;
+    profiled        = false;
+}
+
+// *****************************************************************************
+OpenCL_Pipeline::~OpenCL_Pipeline()
+{
+    Release();
+}
+
+// *****************************************************************************
+void OpenCL_Pipeline::Initialize(OpenCL_device &_device, const int _depth, const int first_stream)
+{
+    Release();
+
+    if (_depth < 1)
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: A pipeline needs a depth of at least 1 (" << _depth << " given). Exiting.\n");
+        abort();
+    }
+
+    device  = &_device;
+    depth   = _depth;
+
+    // Profiling gives the stages' occupancy.
+    upload_queue    = device->Get_Stream_Queue(first_stream,     CL_QUEUE_PROFILING_ENABLE);
+    compute_queue   = device->Get_Stream_Queue(first_stream + 1, CL_QUEUE_PROFILING_ENABLE);
+    download_queue  = device->Get_Stream_Queue(first_stream + 2, CL_QUEUE_PROFILING_ENABLE);
+}
+
+// *****************************************************************************
+int OpenCL_Pipeline::Declare_Buffer(const size_t bytes, const Buffer_Kind kind)
+{
+    if (not slots.empty())
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: The pipeline's stages must be declared before the first Push(). Exiting.\n");
+        abort();
+    }
+
+    Buffer buffer;
+    buffer.bytes    = bytes;
+    buffer.kind     = kind;
+    buffers.push_back(buffer);
+
+    const int index = int(buffers.size()) - 1;
+    if (kind == PIPELINE_INPUT)
+        inputs.push_back(index);
+    else if (kind == PIPELINE_OUTPUT)
+        outputs.push_back(index);
+    return index;
+}
+
+// *****************************************************************************
+void OpenCL_Pipeline::Add_Kernel(OpenCL_Kernel &kernel, const std::vector<int> &arguments)
+{
+    if (not slots.empty())
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: The pipeline's stages must be declared before the first Push(). Exiting.\n");
+        abort();
+    }
+    for (size_t i = 0 ; i < arguments.size() ; i++)
+    {
+        if (arguments[i] < 0 or arguments[i] >= int(buffers.size()))
+        {
+            OpenCL_Log_Error("OpenCL: ERROR: Kernel " << kernel.Get_Name() << " uses the pipeline's buffer " << arguments[i]
+                             << ", but only " << buffers.size() << " were declared. Exiting.\n");
+            abort();
+        }
+    }
+
+    Kernel_Stage stage;
+    stage.kernel    = &kernel;
+    stage.arguments = arguments;
+    kernels.push_back(stage);
+}
+
+// *****************************************************************************
+void OpenCL_Pipeline::Allocate()
+/**
+ * One set of buffers per slot.
+ */
+{
+    if (device == NULL)
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: The pipeline was not initialized. Exiting.\n");
+        abort();
+    }
+
+    cl_int err;
+    long long bytes = 0;
+    slots.resize(depth);
+    for (int s = 0 ; s < depth ; s++)
+    {
+        for (size_t b = 0 ; b < buffers.size() ; b++)
+        {
+            cl_mem_flags flags = CL_MEM_READ_WRITE;
+            if (buffers[b].kind == PIPELINE_INPUT)
+                flags = CL_MEM_READ_ONLY;
+            else if (buffers[b].kind == PIPELINE_OUTPUT)
+                flags = CL_MEM_WRITE_ONLY;
+            cl_mem buffer = clCreateBuffer(device->Get_Context(), flags, buffers[b].bytes, NULL, &err);
+            OpenCL_Test_Success(err, "clCreateBuffer()");
+            slots[s].buffers.push_back(buffer);
+            bytes += (long long) buffers[b].bytes;
+        }
+    }
+    OpenCL_Registry::Add_Memory(device->Get_Device(), bytes);
+
+    stage_busy.assign(Nb_Stages(), 0.0);
+}
+
+// *****************************************************************************
+void OpenCL_Pipeline::Wait_for_Slot(Slot &slot)
+/**
+ * Wait for the slot's batch to be done, accounting for its stages' busy time.
+ */
+{
+    if (slot.events.empty())
+        return;
+
+    cl_int err = clWaitForEvents(cl_uint(slot.events.size()), &slot.events[0]);
+    OpenCL_Test_Success(err, "clWaitForEvents()");
+
+    for (size_t i = 0 ; i < slot.events.size() ; i++)
+    {
+        cl_ulong start, end;
+        if (clGetEventProfilingInfo(slot.events[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL) == CL_SUCCESS and
+            clGetEventProfilingInfo(slot.events[i], CL_PROFILING_COMMAND_END,   sizeof(cl_ulong), &end,   NULL) == CL_SUCCESS and
+            end >= start)
+        {
+            stage_busy[slot.stages[i]] += double(end - start) * 1.0e-9;
+            if (not profiled or start < first_start)
+                first_start = start;
+            if (not profiled or end > last_end)
+                last_end = end;
+            profiled = true;
+        }
+        clReleaseEvent(slot.events[i]);
+    }
+    slot.events.clear();
+    slot.stages.clear();
+}
+
+// *****************************************************************************
+long long OpenCL_Pipeline::Push(const void * const *host_inputs, void * const *host_outputs)
+{
+    if (slots.empty())
+        Allocate();
+
+    Slot &slot = slots[nb_batches % depth];
+    Wait_for_Slot(slot);
+
+    OpenCL_Metrics &metrics = OpenCL_Metrics::Instance();
+    OpenCL_Trace   &trace   = OpenCL_Trace::Instance();
+    cl_int err;
+    cl_event event;
+
+    // Upload
+    std::vector<cl_event> wait_list;
+    for (size_t i = 0 ; i < inputs.size() ; i++)
+    {
+        const size_t bytes = buffers[inputs[i]].bytes;
+        err = clEnqueueWriteBuffer(upload_queue, slot.buffers[inputs[i]], CL_FALSE, 0, bytes, host_inputs[i], 0, NULL, &event);
+        OpenCL_Test_Success(err, "clEnqueueWriteBuffer()");
+        metrics.host_to_device_bytes->Add(bytes);
+        metrics.host_to_device_transfers->Add();
+        trace.Add_Event(event, upload_queue, "Pipeline upload", "transfer");
+        slot.events.push_back(event);
+        slot.stages.push_back(0);
+        wait_list.push_back(event);
+    }
+    clFlush(upload_queue);
+
+    // Kernels, each one after the previous stage.
+    for (size_t k = 0 ; k < kernels.size() ; k++)
+    {
+        cl_kernel kernel = kernels[k].kernel->Get_Kernel();
+        for (size_t a = 0 ; a < kernels[k].arguments.size() ; a++)
+        {
+            err = clSetKernelArg(kernel, cl_uint(a), sizeof(cl_mem), &slot.buffers[kernels[k].arguments[a]]);
+            OpenCL_Test_Success(err, "clSetKernelArg()");
+        }
+        kernels[k].kernel->Launch(compute_queue, cl_uint(wait_list.size()), (wait_list.empty() ? NULL : &wait_list[0]), &event);
+        slot.events.push_back(event);
+        slot.stages.push_back(int(k) + 1);
+        wait_list.assign(1, event);
+    }
+    clFlush(compute_queue);
+
+    // Download
+    for (size_t i = 0 ; i < outputs.size() ; i++)
+    {
+        const size_t bytes = buffers[outputs[i]].bytes;
+        err = clEnqueueReadBuffer(download_queue, slot.buffers[outputs[i]], CL_FALSE, 0, bytes, host_outputs[i],
+                                  cl_uint(wait_list.size()), (wait_list.empty() ? NULL : &wait_list[0]), &event);
+        OpenCL_Test_Success(err, "clEnqueueReadBuffer()");
+        metrics.device_to_host_bytes->Add(bytes);
+        metrics.device_to_host_transfers->Add();
+        trace.Add_Event(event, download_queue, "Pipeline download", "transfer");
+        slot.events.push_back(event);
+        slot.stages.push_back(Nb_Stages() - 1);
+    }
+    clFlush(download_queue);
+
+    return nb_batches++;
+}
+
+// *****************************************************************************
+long long OpenCL_Pipeline::Push(const void *host_input, void *host_output)
+{
+    if (inputs.size() != 1 or outputs.size() != 1)
+    {
+        OpenCL_Log_Error("OpenCL: ERROR: Push(input, output) needs a pipeline with one input and one output ("
+                         << inputs.size() << " and " << outputs.size() << " declared). Exiting.\n");
+        abort();
+    }
+    return Push(&host_input, &host_output);
+}
+
+// *****************************************************************************
+void OpenCL_Pipeline::Finish()
+{
+    for (size_t s = 0 ; s < slots.size() ; s++)
+        Wait_for_Slot(slots[s]);
+}
+
+// *****************************************************************************
+void OpenCL_Pipeline::Release()
+{
+    Finish();
+
+    long long bytes = 0;
+    for (size_t s = 0 ; s < slots.size() ; s++)
+    {
+        for (size_t b = 0 ; b < slots[s].buffers.size() ; b++)
+        {
+            clReleaseMemObject(slots[s].buffers[b]);
+            bytes += (long long) buffers[b].bytes;
+        }
+    }
+    if (bytes > 0)
+        OpenCL_Registry::Add_Memory(device->Get_Device(), -bytes);
+
+    slots.clear();
+    buffers.clear();
+    inputs.clear();
+    outputs.clear();
+    kernels.clear();
+    stage_busy.clear();
+    nb_batches  = 0;
+    first_start = 0;
+    last_end    = 0;
+    profiled    = false;
+    device      = NULL;
+}
+
+// *****************************************************************************
+std::string OpenCL_Pipeline::Stage_Name(const int stage) const
+{
+    if (stage == 0)
+        return "upload";
+    if (stage == Nb_Stages() - 1)
+        return "download";
+
+    const std::string &name = kernels[stage-1].kernel->Get_Name();
+    if (name != "")
+        return name;
+    char generic[32];
+    sprintf(generic, "kernel %d", stage);
+    return generic;
+}
+
+// *****************************************************************************
+double OpenCL_Pipeline::Occupancy(const int stage) const
+{
+    if (not profiled or last_end <= first_start or stage < 0 or stage >= int(stage_busy.size()))
+        return 0.0;
+    return stage_busy[stage] / (double(last_end - first_start) * 1.0e-9);
+}
+
+// *****************************************************************************
+void OpenCL_Pipeline::Print_Occupancy() const
+{
+    std_cout << "OpenCL: Pipeline of depth " << depth << ", " << nb_batches << " batch(es)";
+    if (device != NULL)
+        std_cout << " on " << device->Get_Name();
+    std_cout << ":\n";
+    if (not profiled)
+    {
+        std_cout << "    No completed batch with profiling information.\n";
+        return;
+    }
+    char line[256];
+    sprintf(line, "    Elapsed (device):  %.3f ms\n", double(last_end - first_start) * 1.0e-6);
+    std_cout << line;
+    for (int stage = 0 ; stage < Nb_Stages() ; stage++)
+    {
+        sprintf(line, "    %-18.18s %6.1f %% busy (%.3f ms)\n", (Stage_Name(stage) + ":").c_str(),
+                100.0 * Occupancy(stage), stage_busy[stage] * 1.0e3);
+        std_cout << line;
+    }
+}
+
+// ********** End of file ***************************************
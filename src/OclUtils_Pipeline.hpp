@@ -0,0 +1,147 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_PIPELINE_hpp
+#define INC_OCLUTILS_PIPELINE_hpp
+
+#include <string>
+#include <vector>
+
+#include "OclUtils.hpp"
+
+// *****************************************************************************
+// Stream of batches going through the same stages on a device: upload of the
+// inputs, one or more kernels, download of the outputs. "depth" batches are
+// in flight, each in its own set of device buffers (a slot). Uploads,
+// kernels and downloads use three different queues, chained by events, so
+// the transfers of some batches overlap the computation of others.
+//
+//      OpenCL_Pipeline pipeline;
+//      pipeline.Initialize(device, 3);
+//      const int in  = pipeline.Add_Input(bytes);
+//      const int out = pipeline.Add_Output(bytes);
+//      pipeline.Add_Kernel(kernel, Pipeline_Arguments(in, out));   // Arguments 0 and 1
+//      for (...)
+//          pipeline.Push(input[i], output[i]);
+//      pipeline.Finish();
+//
+// Push() returns once the batch is enqueued. It waits first for the batch
+// that used the slot before ("depth" batches ago) to be downloaded: its
+// input is then free and its output written. The host memory of a batch
+// must not be touched until then (or Finish()). Pinned host memory is
+// needed for the transfers to really run asynchronously.
+// Kernel arguments past the pipeline's buffers are set once by the caller.
+class OpenCL_Pipeline
+{
+    private:
+        enum Buffer_Kind
+        {
+            PIPELINE_INPUT,
+            PIPELINE_OUTPUT,
+            PIPELINE_INTERNAL
+        };
+
+        struct Buffer
+        {
+            size_t                      bytes;
+            Buffer_Kind                 kind;
+        };
+
+        struct Kernel_Stage
+        {
+            OpenCL_Kernel              *kernel;
+            std::vector<int>            arguments;  // Buffers, as kernel arguments 0, 1, ...
+        };
+
+        struct Slot
+        {
+            std::vector<cl_mem>         buffers;
+            std::vector<cl_event>       events;     // Commands of the batch in flight
+            std::vector<int>            stages;     // Stage of each event
+        };
+
+        OpenCL_device                  *device;
+        int                             depth;
+        cl_command_queue                upload_queue;
+        cl_command_queue                compute_queue;
+        cl_command_queue                download_queue;
+
+        std::vector<Buffer>             buffers;
+        std::vector<int>                inputs;
+        std::vector<int>                outputs;
+        std::vector<Kernel_Stage>       kernels;
+        std::vector<Slot>               slots;
+        long long                       nb_batches;
+
+        // Occupancy: time each stage kept the device busy, between the
+        // first command's start and the last one's end (device clock).
+        std::vector<double>             stage_busy;
+        cl_ulong                        first_start;
+        cl_ulong                        last_end;
+        bool                            profiled;
+
+        int                             Declare_Buffer(const size_t bytes, const Buffer_Kind kind);
+        void                            Allocate();
+        void                            Wait_for_Slot(Slot &slot);
+
+        // Not copyable: the pipeline owns its buffers and events.
+        OpenCL_Pipeline(const OpenCL_Pipeline &);
+        OpenCL_Pipeline &               operator=(const OpenCL_Pipeline &);
+
+    public:
+        OpenCL_Pipeline();
+        ~OpenCL_Pipeline();
+
+        // The queues are the device's streams "first_stream" to "first_stream+2".
+        void                            Initialize(OpenCL_device &_device, const int _depth = 3,
+                                                   const int first_stream = 0);
+
+        // Stages, declared before the first Push(). Each returns the buffer's index.
+        int                             Add_Input(const size_t bytes)   { return Declare_Buffer(bytes, PIPELINE_INPUT);    }
+        int                             Add_Output(const size_t bytes)  { return Declare_Buffer(bytes, PIPELINE_OUTPUT);   }
+        int                             Add_Buffer(const size_t bytes)  { return Declare_Buffer(bytes, PIPELINE_INTERNAL); }
+        // Kernels run in the order they are added, with "arguments" (buffer
+        // indices) as their first arguments. The kernel is not owned.
+        void                            Add_Kernel(OpenCL_Kernel &kernel, const std::vector<int> &arguments);
+
+        // Enqueue a batch: one host pointer per input and per output, in the
+        // order they were added. Returns the batch's number (from 0).
+        long long                       Push(const void * const *host_inputs, void * const *host_outputs);
+        long long                       Push(const void *host_input, void *host_output);
+        // Wait for every batch in flight.
+        void                            Finish();
+        void                            Release();
+
+        // Stages: 0 is the upload, then the kernels, then the download.
+        int                             Nb_Stages() const   { return int(kernels.size()) + 2; }
+        std::string                     Stage_Name(const int stage) const;
+        // Fraction of the time (up to the last completed batch) a stage kept the device busy.
+        double                          Occupancy(const int stage) const;
+        long long                       Nb_Batches() const  { return nb_batches; }
+        void                            Print_Occupancy() const;
+};
+
+// *****************************************************************************
+// Building the arguments of Add_Kernel(), for the usual cases.
+std::vector<int> Pipeline_Arguments(const int a);
+std::vector<int> Pipeline_Arguments(const int a, const int b);
+std::vector<int> Pipeline_Arguments(const int a, const int b, const int c);
+
+#endif // INC_OCLUTILS_PIPELINE_hpp
+
+// ********** End of file ***************************************
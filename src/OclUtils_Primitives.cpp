@@ -0,0 +1,676 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <cassert>
+#include <cstring>      // memcpy()
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Primitives.hpp"
+
+// *****************************************************************************
+// Built with -DTYPE (the elements), -DKEY and -DKEY_BITS (their radix sort
+// key), -DFLOAT_KEY and -DAS_KEY for floating point types, -DUSE_FP64 for double.
+static const char *primitives_kernels_source =
+"#ifdef USE_FP64\n"
+"#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+"#endif\n"
+"\n"
+"#define OP_SUM(a, b)    ((a) + (b))\n"
+"#define OP_MIN(a, b)    ((b) < (a) ? (b) : (a))\n"
+"#define OP_MAX(a, b)    ((a) < (b) ? (b) : (a))\n"
+"\n"
+"/* Grid-stride partial reductions, one per work-group. The local size is a power of two. */\n"
+"#define REDUCE_KERNEL(NAME, OP)                                                 \\\n"
+"__kernel void NAME(__global const TYPE *in, __global TYPE *partials,            \\\n"
+"                   const uint n, const TYPE identity, __local TYPE *buffer)     \\\n"
+"{                                                                               \\\n"
+"    const uint lid = get_local_id(0);                                           \\\n"
+"    TYPE acc = identity;                                                        \\\n"
+"    for (uint i = get_global_id(0) ; i < n ; i += get_global_size(0))           \\\n"
+"        acc = OP(acc, in[i]);                                                   \\\n"
+"    buffer[lid] = acc;                                                          \\\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);                                               \\\n"
+"    for (uint s = get_local_size(0) / 2 ; s > 0 ; s >>= 1)                      \\\n"
+"    {                                                                           \\\n"
+"        if (lid < s)                                                            \\\n"
+"            buffer[lid] = OP(buffer[lid], buffer[lid + s]);                     \\\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);                                           \\\n"
+"    }                                                                           \\\n"
+"    if (lid == 0)                                                               \\\n"
+"        partials[get_group_id(0)] = buffer[0];                                  \\\n"
+"}\n"
+"REDUCE_KERNEL(Reduce_Sum, OP_SUM)\n"
+"REDUCE_KERNEL(Reduce_Min, OP_MIN)\n"
+"REDUCE_KERNEL(Reduce_Max, OP_MAX)\n"
+"\n"
+"/* Scan of blocks of local_size*items elements: each work-item sums its     */\n"
+"/* items, the work-group scans these sums, then each work-item scans its    */\n"
+"/* items again from its offset. The blocks' totals go to \"sums\", to be      */\n"
+"/* scanned in turn and added back by Add_Offsets.                           */\n"
+"#define SCAN_KERNELS(SUFFIX, S)                                                 \\\n"
+"S Local_Scan_##SUFFIX(__local S *buffer, const S value, S *total)              \\\n"
+"{                                                                               \\\n"
+"    const uint lid = get_local_id(0);                                           \\\n"
+"    const uint L   = get_local_size(0);                                         \\\n"
+"    buffer[lid] = value;                                                        \\\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);                                               \\\n"
+"    for (uint offset = 1 ; offset < L ; offset <<= 1)                           \\\n"
+"    {                                                                           \\\n"
+"        const S x = (lid >= offset ? buffer[lid - offset] : (S) 0);             \\\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);                                           \\\n"
+"        buffer[lid] += x;                                                       \\\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);                                           \\\n"
+"    }                                                                           \\\n"
+"    *total = buffer[L - 1];                                                     \\\n"
+"    const S exclusive = (lid > 0 ? buffer[lid - 1] : (S) 0);                    \\\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);                                               \\\n"
+"    return exclusive;                                                           \\\n"
+"}                                                                               \\\n"
+"__kernel void Scan_Blocks_##SUFFIX(__global const S *in, __global S *out,      \\\n"
+"                                   __global S *sums, const uint n,              \\\n"
+"                                   const uint items, const int inclusive,       \\\n"
+"                                   __local S *buffer)                           \\\n"
+"{                                                                               \\\n"
+"    const uint first = (get_group_id(0) * get_local_size(0) + get_local_id(0)) * items; \\\n"
+"    S sum = 0;                                                                  \\\n"
+"    for (uint k = 0 ; k < items && first + k < n ; k++)                         \\\n"
+"        sum += in[first + k];                                                   \\\n"
+"    S total;                                                                    \\\n"
+"    S running = Local_Scan_##SUFFIX(buffer, sum, &total);                       \\\n"
+"    for (uint k = 0 ; k < items && first + k < n ; k++)                         \\\n"
+"    {                                                                           \\\n"
+"        const S x = in[first + k];                                              \\\n"
+"        out[first + k] = (inclusive ? (S) (running + x) : running);             \\\n"
+"        running += x;                                                           \\\n"
+"    }                                                                           \\\n"
+"    if (get_local_id(0) == 0)                                                   \\\n"
+"        sums[get_group_id(0)] = total;                                          \\\n"
+"}                                                                               \\\n"
+"__kernel void Add_Offsets_##SUFFIX(__global S *out, __global const S *sums,     \\\n"
+"                                   const uint n, const uint items)              \\\n"
+"{                                                                               \\\n"
+"    const S offset = sums[get_group_id(0)];                                     \\\n"
+"    const uint first = (get_group_id(0) * get_local_size(0) + get_local_id(0)) * items; \\\n"
+"    for (uint k = 0 ; k < items && first + k < n ; k++)                         \\\n"
+"        out[first + k] += offset;                                               \\\n"
+"}\n"
+"SCAN_KERNELS(Elements, TYPE)\n"
+"SCAN_KERNELS(Indices, uint)\n"
+"\n"
+"__kernel void Compact_Flags(__global const int *flags, __global uint *positions, const uint n)\n"
+"{\n"
+"    const uint i = get_global_id(0);\n"
+"    if (i < n)\n"
+"        positions[i] = (flags[i] != 0 ? 1 : 0);\n"
+"}\n"
+"\n"
+"__kernel void Compact_Scatter(__global const TYPE *in, __global const int *flags,\n"
+"                              __global const uint *positions, __global TYPE *out, const uint n)\n"
+"{\n"
+"    const uint i = get_global_id(0);\n"
+"    if (i < n && flags[i] != 0)\n"
+"        out[positions[i]] = in[i];\n"
+"}\n"
+"\n"
+"/* Radix sort, 4 bits per pass. Keys order the values as unsigned integers: */\n"
+"/* the sign bit is flipped, and the other bits too for negative floats.     */\n"
+"#define RADIX_BITS  4\n"
+"#define RADIX       16\n"
+"\n"
+"KEY To_Key(const TYPE x)\n"
+"{\n"
+"#ifdef FLOAT_KEY\n"
+"    const KEY k = AS_KEY(x);\n"
+"    return k ^ ((k >> (KEY_BITS - 1)) ? (KEY) ~((KEY) 0) : (KEY) ((KEY) 1 << (KEY_BITS - 1)));\n"
+"#else\n"
+"    return (KEY) ((KEY) x ^ (KEY) ((KEY) 1 << (KEY_BITS - 1)));\n"
+"#endif\n"
+"}\n"
+"\n"
+"/* Digits count of each work-group's block, stored digit-major so that an  */\n"
+"/* exclusive scan gives every (digit, block) pair its output offset.       */\n"
+"__kernel void Radix_Histogram(__global const TYPE *in, __global uint *histograms,\n"
+"                              const uint n, const uint shift, const uint block,\n"
+"                              __local uint *counts)\n"
+"{\n"
+"    const uint lid   = get_local_id(0);\n"
+"    const uint L     = get_local_size(0);\n"
+"    const uint group = get_group_id(0);\n"
+"    for (uint d = lid ; d < RADIX ; d += L)\n"
+"        counts[d] = 0;\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"    const uint start = group * block;\n"
+"    const uint end   = min(start + block, n);\n"
+"    for (uint i = start + lid ; i < end ; i += L)\n"
+"        atomic_inc(&counts[(uint) (To_Key(in[i]) >> shift) & (RADIX - 1)]);\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"    for (uint d = lid ; d < RADIX ; d += L)\n"
+"        histograms[d * get_num_groups(0) + group] = counts[d];\n"
+"}\n"
+"\n"
+"/* The block is moved in chunks of local_size elements, in order. Each     */\n"
+"/* chunk is first sorted by digit in local memory (one stable split per    */\n"
+"/* bit), so that elements of a digit are written next to each other and    */\n"
+"/* keep their order.                                                        */\n"
+"__kernel void Radix_Scatter(__global const TYPE *in, __global TYPE *out,\n"
+"                            __global const uint *offsets,\n"
+"                            const uint n, const uint shift, const uint block,\n"
+"                            __local uint *scan, __local TYPE *values, __local uint *digits,\n"
+"                            __local uint *running, __local uint *digit_start)\n"
+"{\n"
+"    const uint lid   = get_local_id(0);\n"
+"    const uint L     = get_local_size(0);\n"
+"    const uint group = get_group_id(0);\n"
+"    for (uint d = lid ; d < RADIX ; d += L)\n"
+"        running[d] = offsets[d * get_num_groups(0) + group];\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"    const uint start = group * block;\n"
+"    const uint end   = min(start + block, n);\n"
+"    for (uint base = start ; base < end ; base += L)\n"
+"    {\n"
+"        /* Past the end: largest digit, so they stay after the valid elements. */\n"
+"        const uint nb_valid = min(L, end - base);\n"
+"        TYPE value = (lid < nb_valid ? in[base + lid] : (TYPE) 0);\n"
+"        uint digit = (lid < nb_valid ? (uint) (To_Key(value) >> shift) & (RADIX - 1) : RADIX - 1);\n"
+"\n"
+"        for (uint b = 0 ; b < RADIX_BITS ; b++)\n"
+"        {\n"
+"            const uint bit = (digit >> b) & 1;\n"
+"            uint nb_ones;\n"
+"            const uint ones_before = Local_Scan_Indices(scan, bit, &nb_ones);\n"
+"            const uint position = (bit ? L - nb_ones + ones_before : lid - ones_before);\n"
+"            values[position] = value;\n"
+"            digits[position] = digit;\n"
+"            barrier(CLK_LOCAL_MEM_FENCE);\n"
+"            value = values[lid];\n"
+"            digit = digits[lid];\n"
+"            barrier(CLK_LOCAL_MEM_FENCE);\n"
+"        }\n"
+"\n"
+"        if (lid < nb_valid && (lid == 0 || digits[lid - 1] != digit))\n"
+"            digit_start[digit] = lid;\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);\n"
+"        if (lid < nb_valid)\n"
+"            out[running[digit] + lid - digit_start[digit]] = value;\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);\n"
+"        if (lid < nb_valid && (lid == nb_valid - 1 || digits[lid + 1] != digit))\n"
+"            running[digit] += lid + 1 - digit_start[digit];\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);\n"
+"    }\n"
+"}\n";
+
+// *****************************************************************************
+// What differs between the element types.
+template <class T> struct Primitive_Type;
+
+template <class T, class Key>
+Key Floating_Point_Key(const T x)
+{
+    Key k;
+    memcpy(&k, &x, sizeof(Key));
+    const Key sign = Key(1) << (sizeof(Key)*8 - 1);
+    return k ^ ((k & sign) ? Key(~Key(0)) : sign);
+}
+
+template <> struct Primitive_Type<float>
+{
+    typedef uint32_t Key;
+    static const char * Build_Options()                     { return "-DTYPE=float -DKEY=uint -DKEY_BITS=32 -DFLOAT_KEY -DAS_KEY=as_uint"; }
+    static cl_uint      Vector_Width(const OpenCL_device &d){ return d.Get_Preferred_Vector_Width_Float(); }
+    static Key          To_Key(const float x)               { return Floating_Point_Key<float,Key>(x); }
+};
+
+template <> struct Primitive_Type<double>
+{
+    typedef uint64_t Key;
+    static const char * Build_Options()                     { return "-DTYPE=double -DKEY=ulong -DKEY_BITS=64 -DFLOAT_KEY -DAS_KEY=as_ulong -DUSE_FP64"; }
+    static cl_uint      Vector_Width(const OpenCL_device &d){ return d.Get_Preferred_Vector_Width_Double(); }
+    static Key          To_Key(const double x)              { return Floating_Point_Key<double,Key>(x); }
+};
+
+template <> struct Primitive_Type<int>
+{
+    typedef uint32_t Key;
+    static const char * Build_Options()                     { return "-DTYPE=int -DKEY=uint -DKEY_BITS=32"; }
+    static cl_uint      Vector_Width(const OpenCL_device &d){ return d.Get_Preferred_Vector_Width_Int(); }
+    static Key          To_Key(const int x)                 { return Key(x) ^ 0x80000000u; }
+};
+
+template <> struct Primitive_Type<char>
+{
+    typedef uint8_t Key;
+    static const char * Build_Options()                     { return "-DTYPE=char -DKEY=uchar -DKEY_BITS=8"; }
+    static cl_uint      Vector_Width(const OpenCL_device &d){ return d.Get_Preferred_Vector_Width_Char(); }
+    static Key          To_Key(const char x)                { return Key(Key((signed char) x) ^ 0x80u); }
+};
+
+// *****************************************************************************
+template <class T>
+struct Key_Less
+{
+    bool operator()(const T a, const T b) const
+    {
+        return Primitive_Type<T>::To_Key(a) < Primitive_Type<T>::To_Key(b);
+    }
+};
+
+// *****************************************************************************
+template <class T>
+T Reduce_Identity(const OpenCL_Reduce_Operation operation)
+{
+    if (operation == OPENCL_REDUCE_SUM)
+        return T(0);
+    const T largest = (std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max());
+    if (operation == OPENCL_REDUCE_MIN)
+        return largest;
+    return (std::numeric_limits<T>::has_infinity ? T(-largest) : std::numeric_limits<T>::min());
+}
+
+// *****************************************************************************
+template <class T>
+T Reduce_Operation(const T a, const T b, const OpenCL_Reduce_Operation operation)
+{
+    if (operation == OPENCL_REDUCE_MIN)
+        return (b < a ? b : a);
+    if (operation == OPENCL_REDUCE_MAX)
+        return (a < b ? b : a);
+    return T(a + b);
+}
+
+// *****************************************************************************
+template <class T>
+OpenCL_Primitives<T>::OpenCL_Primitives()
+{
+    context             = NULL;
+    device              = NULL;
+    program             = NULL;
+    for (int i = 0 ; i < 3 ; i++)
+        reduce[i]       = NULL;
+    for (int i = 0 ; i < NB_SCAN_KINDS ; i++)
+    {
+        scan_blocks[i]  = NULL;
+        add_offsets[i]  = NULL;
+        items[i]        = 1;
+    }
+    compact_flags       = NULL;
+    compact_scatter     = NULL;
+    radix_histogram     = NULL;
+    radix_scatter       = NULL;
+    local_size          = 1;
+    max_reduce_groups   = 1;
+}
+
+// *****************************************************************************
+template <class T>
+OpenCL_Primitives<T>::~OpenCL_Primitives()
+{
+    Release();
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Release()
+{
+    OpenCL_Kernel **kernels[] = {&reduce[0], &reduce[1], &reduce[2],
+                                 &scan_blocks[SCAN_ELEMENTS], &scan_blocks[SCAN_INDICES],
+                                 &add_offsets[SCAN_ELEMENTS], &add_offsets[SCAN_INDICES],
+                                 &compact_flags, &compact_scatter, &radix_histogram, &radix_scatter};
+    for (size_t i = 0 ; i < sizeof(kernels) / sizeof(kernels[0]) ; i++)
+    {
+        delete *kernels[i];
+        *kernels[i] = NULL;
+    }
+    delete program;
+    program = NULL;
+}
+
+// *****************************************************************************
+template <class T>
+OpenCL_Kernel * OpenCL_Primitives<T>::Create_Kernel(const char *name)
+{
+    OpenCL_Kernel *kernel = new OpenCL_Kernel();
+    kernel->Build_Shared(*program, name);
+
+    size_t kernel_work_group_size = 0;
+    const cl_int err = clGetKernelWorkGroupInfo(kernel->Get_Kernel(), device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_work_group_size, NULL);
+    OpenCL_Test_Success(err, "clGetKernelWorkGroupInfo");
+    local_size = std::min(local_size, kernel_work_group_size);
+
+    return kernel;
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Initialize(OpenCL_device &_device)
+{
+    Release();
+
+    context = _device.Get_Context();
+    device  = _device.Get_Device();
+
+    // Built like any other kernel: tuning profile options, metrics, traces
+    // and startup profile included.
+    program = new OpenCL_Kernel(primitives_kernels_source, context, device);
+    program->Append_Compiler_Option(Primitive_Type<T>::Build_Options());
+    program->Build_Program(std::string("primitives (") + Primitive_Type<T>::Build_Options() + ")");
+
+    // Work-group size: fits the device, the local memory of Radix_Scatter
+    // (the largest user) and every kernel; a power of two for the reductions.
+    // Larger groups don't make the local scans any faster.
+    size_t max_size = std::min(_device.Get_Max_Work_Group_Size(), size_t(256));
+    const cl_ulong local_mem_per_item = 2*sizeof(cl_uint) + sizeof(T);
+    const cl_ulong local_mem_fixed    = 2*16*sizeof(cl_uint);
+    if (_device.Get_Local_Mem_Size() > local_mem_fixed)
+        max_size = std::min(max_size, size_t((_device.Get_Local_Mem_Size() - local_mem_fixed) / local_mem_per_item));
+    local_size = std::max(max_size, size_t(1));
+
+    reduce[OPENCL_REDUCE_SUM]       = Create_Kernel("Reduce_Sum");
+    reduce[OPENCL_REDUCE_MIN]       = Create_Kernel("Reduce_Min");
+    reduce[OPENCL_REDUCE_MAX]       = Create_Kernel("Reduce_Max");
+    scan_blocks[SCAN_ELEMENTS]      = Create_Kernel("Scan_Blocks_Elements");
+    scan_blocks[SCAN_INDICES]       = Create_Kernel("Scan_Blocks_Indices");
+    add_offsets[SCAN_ELEMENTS]      = Create_Kernel("Add_Offsets_Elements");
+    add_offsets[SCAN_INDICES]       = Create_Kernel("Add_Offsets_Indices");
+    compact_flags                   = Create_Kernel("Compact_Flags");
+    compact_scatter                 = Create_Kernel("Compact_Scatter");
+    radix_histogram                 = Create_Kernel("Radix_Histogram");
+    radix_scatter                   = Create_Kernel("Radix_Scatter");
+
+    size_t power_of_two = 1;
+    while (power_of_two * 2 <= local_size)
+        power_of_two *= 2;
+    local_size = power_of_two;
+
+    items[SCAN_ELEMENTS]    = std::max(Primitive_Type<T>::Vector_Width(_device), cl_uint(1));
+    items[SCAN_INDICES]     = std::max(_device.Get_Preferred_Vector_Width_Int(), cl_uint(1));
+
+    // Enough work-groups to keep every compute unit busy.
+    max_reduce_groups = std::max(size_t(_device.Get_Compute_Units()) * 8, size_t(1));
+
+    OpenCL_Log_Debug("OpenCL: Primitives (" << Primitive_Type<T>::Build_Options() << ") on " << _device.Get_Name()
+                     << ": local size " << local_size << ", " << items[SCAN_ELEMENTS] << " element(s) per work-item.\n");
+}
+
+// *****************************************************************************
+template <class T>
+cl_mem OpenCL_Primitives<T>::Create_Buffer(const size_t bytes)
+{
+    cl_int err;
+    cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, std::max(bytes, size_t(1)), NULL, &err);
+    OpenCL_Test_Success(err, "clCreateBuffer");
+    return buffer;
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Enqueue(cl_command_queue queue, OpenCL_Kernel *kernel, const size_t nb_groups)
+/**
+ * Launched like any other kernel: counted in the metrics, traced, and
+ * accounted in the registry's busy time.
+ */
+{
+    kernel->Compute_Work_Size(nb_groups * local_size, 1, local_size, 1);
+    kernel->Launch(queue);
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Scan_Buffer(cl_command_queue queue, cl_mem input, cl_mem output,
+                                       const cl_uint n, const bool inclusive, const Scan_Kind kind)
+/**
+ * Scan the blocks, then (recursively) the blocks' totals, and add those back.
+ */
+{
+    const size_t element_size   = (kind == SCAN_ELEMENTS ? sizeof(T) : sizeof(cl_uint));
+    const size_t block          = local_size * items[kind];
+    const size_t nb_groups      = (size_t(n) + block - 1) / block;
+    const cl_int inclusive_flag = (inclusive ? 1 : 0);
+
+    cl_mem sums = Create_Buffer(nb_groups * element_size);
+    cl_int err;
+    err  = clSetKernelArg(scan_blocks[kind]->Get_Kernel(), 0, sizeof(cl_mem),  &input);
+    err |= clSetKernelArg(scan_blocks[kind]->Get_Kernel(), 1, sizeof(cl_mem),  &output);
+    err |= clSetKernelArg(scan_blocks[kind]->Get_Kernel(), 2, sizeof(cl_mem),  &sums);
+    err |= clSetKernelArg(scan_blocks[kind]->Get_Kernel(), 3, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(scan_blocks[kind]->Get_Kernel(), 4, sizeof(cl_uint), &items[kind]);
+    err |= clSetKernelArg(scan_blocks[kind]->Get_Kernel(), 5, sizeof(cl_int),  &inclusive_flag);
+    err |= clSetKernelArg(scan_blocks[kind]->Get_Kernel(), 6, local_size * element_size, NULL);
+    OpenCL_Test_Success(err, "clSetKernelArg");
+    Enqueue(queue, scan_blocks[kind], nb_groups);
+
+    if (nb_groups > 1)
+    {
+        Scan_Buffer(queue, sums, sums, cl_uint(nb_groups), false, kind);
+
+        err  = clSetKernelArg(add_offsets[kind]->Get_Kernel(), 0, sizeof(cl_mem),  &output);
+        err |= clSetKernelArg(add_offsets[kind]->Get_Kernel(), 1, sizeof(cl_mem),  &sums);
+        err |= clSetKernelArg(add_offsets[kind]->Get_Kernel(), 2, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(add_offsets[kind]->Get_Kernel(), 3, sizeof(cl_uint), &items[kind]);
+        OpenCL_Test_Success(err, "clSetKernelArg");
+        Enqueue(queue, add_offsets[kind], nb_groups);
+    }
+
+    // Freed by the runtime once the commands using it are done.
+    clReleaseMemObject(sums);
+}
+
+// *****************************************************************************
+template <class T>
+T OpenCL_Primitives<T>::Reduce(OpenCL_Array<T> &array, const OpenCL_Reduce_Operation operation)
+{
+    const T identity = Reduce_Identity<T>(operation);
+    const cl_uint n = cl_uint(array.Get_Size());
+    if (n == 0)
+        return identity;
+
+    cl_command_queue queue = array.Get_Command_Queue();
+    const size_t block     = local_size * items[SCAN_ELEMENTS];
+    const size_t nb_groups = std::min((size_t(n) + block - 1) / block, max_reduce_groups);
+
+    cl_mem partials = Create_Buffer(nb_groups * sizeof(T));
+    OpenCL_Kernel *kernel = reduce[operation];
+    cl_int err;
+    err  = clSetKernelArg(kernel->Get_Kernel(), 0, sizeof(cl_mem),  array.Get_Device_Array());
+    err |= clSetKernelArg(kernel->Get_Kernel(), 1, sizeof(cl_mem),  &partials);
+    err |= clSetKernelArg(kernel->Get_Kernel(), 2, sizeof(cl_uint), &n);
+    err |= clSetKernelArg(kernel->Get_Kernel(), 3, sizeof(T),       &identity);
+    err |= clSetKernelArg(kernel->Get_Kernel(), 4, local_size * sizeof(T), NULL);
+    OpenCL_Test_Success(err, "clSetKernelArg");
+    Enqueue(queue, kernel, nb_groups);
+
+    // Few partial results: finished on the host.
+    std::vector<T> host_partials(nb_groups);
+    err = clEnqueueReadBuffer(queue, partials, CL_TRUE, 0, nb_groups * sizeof(T), &host_partials[0], 0, NULL, NULL);
+    OpenCL_Test_Success(err, "clEnqueueReadBuffer");
+    clReleaseMemObject(partials);
+
+    return Reduce_Host(&host_partials[0], int(nb_groups), operation);
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Scan(OpenCL_Array<T> &input, OpenCL_Array<T> &output, const bool inclusive)
+{
+    assert(output.Get_Size() >= input.Get_Size());
+    if (input.Get_Size() == 0)
+        return;
+
+    Scan_Buffer(input.Get_Command_Queue(), *input.Get_Device_Array(), *output.Get_Device_Array(),
+                cl_uint(input.Get_Size()), inclusive, SCAN_ELEMENTS);
+}
+
+// *****************************************************************************
+template <class T>
+int OpenCL_Primitives<T>::Compact(OpenCL_Array<T> &input, OpenCL_Array<int> &flags, OpenCL_Array<T> &output)
+{
+    assert(flags.Get_Size() >= input.Get_Size());
+    assert(output.Get_Size() >= input.Get_Size());
+    const cl_uint n = cl_uint(input.Get_Size());
+    if (n == 0)
+        return 0;
+
+    cl_command_queue queue = input.Get_Command_Queue();
+    const size_t nb_groups = (size_t(n) + local_size - 1) / local_size;
+
+    // Output position of every kept element: exclusive scan of the (0 or 1) flags.
+    cl_mem positions = Create_Buffer(n * sizeof(cl_uint));
+    cl_int err;
+    err  = clSetKernelArg(compact_flags->Get_Kernel(), 0, sizeof(cl_mem),  flags.Get_Device_Array());
+    err |= clSetKernelArg(compact_flags->Get_Kernel(), 1, sizeof(cl_mem),  &positions);
+    err |= clSetKernelArg(compact_flags->Get_Kernel(), 2, sizeof(cl_uint), &n);
+    OpenCL_Test_Success(err, "clSetKernelArg");
+    Enqueue(queue, compact_flags, nb_groups);
+
+    Scan_Buffer(queue, positions, positions, n, false, SCAN_INDICES);
+
+    err  = clSetKernelArg(compact_scatter->Get_Kernel(), 0, sizeof(cl_mem),  input.Get_Device_Array());
+    err |= clSetKernelArg(compact_scatter->Get_Kernel(), 1, sizeof(cl_mem),  flags.Get_Device_Array());
+    err |= clSetKernelArg(compact_scatter->Get_Kernel(), 2, sizeof(cl_mem),  &positions);
+    err |= clSetKernelArg(compact_scatter->Get_Kernel(), 3, sizeof(cl_mem),  output.Get_Device_Array());
+    err |= clSetKernelArg(compact_scatter->Get_Kernel(), 4, sizeof(cl_uint), &n);
+    OpenCL_Test_Success(err, "clSetKernelArg");
+    Enqueue(queue, compact_scatter, nb_groups);
+
+    // The scan is exclusive: the last element is kept or not according to its flag.
+    int last_flag = 0;
+    cl_uint last_position = 0;
+    err  = clEnqueueReadBuffer(queue, *flags.Get_Device_Array(), CL_FALSE, (n-1) * sizeof(int), sizeof(int), &last_flag, 0, NULL, NULL);
+    err |= clEnqueueReadBuffer(queue, positions, CL_TRUE, (n-1) * sizeof(cl_uint), sizeof(cl_uint), &last_position, 0, NULL, NULL);
+    OpenCL_Test_Success(err, "clEnqueueReadBuffer");
+    clReleaseMemObject(positions);
+
+    return int(last_position) + (last_flag != 0 ? 1 : 0);
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Sort(OpenCL_Array<T> &array)
+/**
+ * Least significant digit first, ping-ponging between the array and a
+ * temporary buffer. There is an even number of passes: the result ends up
+ * in the array.
+ */
+{
+    const cl_uint n = cl_uint(array.Get_Size());
+    if (n <= 1)
+        return;
+
+    cl_command_queue queue  = array.Get_Command_Queue();
+    const cl_uint block     = cl_uint(local_size * items[SCAN_ELEMENTS]);
+    const size_t nb_groups  = (size_t(n) + block - 1) / block;
+    const cl_uint radix     = 16;
+    const cl_uint key_bits  = cl_uint(sizeof(typename Primitive_Type<T>::Key) * 8);
+
+    cl_mem buffers[2]   = {*array.Get_Device_Array(), Create_Buffer(n * sizeof(T))};
+    cl_mem histograms   = Create_Buffer(radix * nb_groups * sizeof(cl_uint));
+
+    cl_int err;
+    for (cl_uint shift = 0, pass = 0 ; shift < key_bits ; shift += 4, pass++)
+    {
+        cl_mem in  = buffers[pass % 2];
+        cl_mem out = buffers[(pass + 1) % 2];
+
+        err  = clSetKernelArg(radix_histogram->Get_Kernel(), 0, sizeof(cl_mem),  &in);
+        err |= clSetKernelArg(radix_histogram->Get_Kernel(), 1, sizeof(cl_mem),  &histograms);
+        err |= clSetKernelArg(radix_histogram->Get_Kernel(), 2, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(radix_histogram->Get_Kernel(), 3, sizeof(cl_uint), &shift);
+        err |= clSetKernelArg(radix_histogram->Get_Kernel(), 4, sizeof(cl_uint), &block);
+        err |= clSetKernelArg(radix_histogram->Get_Kernel(), 5, radix * sizeof(cl_uint), NULL);
+        OpenCL_Test_Success(err, "clSetKernelArg");
+        Enqueue(queue, radix_histogram, nb_groups);
+
+        Scan_Buffer(queue, histograms, histograms, cl_uint(radix * nb_groups), false, SCAN_INDICES);
+
+        err  = clSetKernelArg(radix_scatter->Get_Kernel(), 0, sizeof(cl_mem),  &in);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 1, sizeof(cl_mem),  &out);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 2, sizeof(cl_mem),  &histograms);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 3, sizeof(cl_uint), &n);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 4, sizeof(cl_uint), &shift);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 5, sizeof(cl_uint), &block);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 6, local_size * sizeof(cl_uint), NULL);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 7, local_size * sizeof(T),       NULL);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 8, local_size * sizeof(cl_uint), NULL);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 9,  radix * sizeof(cl_uint),     NULL);
+        err |= clSetKernelArg(radix_scatter->Get_Kernel(), 10, radix * sizeof(cl_uint),     NULL);
+        OpenCL_Test_Success(err, "clSetKernelArg");
+        Enqueue(queue, radix_scatter, nb_groups);
+    }
+
+    clReleaseMemObject(buffers[1]);
+    clReleaseMemObject(histograms);
+}
+
+// *****************************************************************************
+template <class T>
+T OpenCL_Primitives<T>::Reduce_Host(const T *array, const int n, const OpenCL_Reduce_Operation operation)
+{
+    T result = Reduce_Identity<T>(operation);
+    for (int i = 0 ; i < n ; i++)
+        result = Reduce_Operation(result, array[i], operation);
+    return result;
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Scan_Host(const T *input, T *output, const int n, const bool inclusive)
+{
+    T running = T(0);
+    for (int i = 0 ; i < n ; i++)
+    {
+        const T x = input[i];
+        output[i] = (inclusive ? T(running + x) : running);
+        running = T(running + x);
+    }
+}
+
+// *****************************************************************************
+template <class T>
+int OpenCL_Primitives<T>::Compact_Host(const T *input, const int *flags, T *output, const int n)
+{
+    int nb_kept = 0;
+    for (int i = 0 ; i < n ; i++)
+    {
+        if (flags[i] != 0)
+            output[nb_kept++] = input[i];
+    }
+    return nb_kept;
+}
+
+// *****************************************************************************
+template <class T>
+void OpenCL_Primitives<T>::Sort_Host(T *array, const int n)
+/**
+ * Same order as Sort(): by radix sort key.
+ */
+{
+    std::stable_sort(array, array + n, Key_Less<T>());
+}
+
+// *****************************************************************************
+template class OpenCL_Primitives<float>;
+template class OpenCL_Primitives<double>;
+template class OpenCL_Primitives<int>;
+template class OpenCL_Primitives<char>;
+
+// ********** End of file ***************************************
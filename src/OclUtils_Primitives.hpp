@@ -0,0 +1,122 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_PRIMITIVES_hpp
+#define INC_OCLUTILS_PRIMITIVES_hpp
+
+#include <CL/cl.h>
+
+#include "OclUtils.hpp"
+
+// *****************************************************************************
+// Data-parallel building blocks on the device buffers of OpenCL_Arrays:
+// reduction, inclusive/exclusive scan, stream compaction and radix sort.
+//
+//      OpenCL_Primitives<float> primitives;
+//      primitives.Initialize(device);
+//      const float total = primitives.Reduce(array, OPENCL_REDUCE_SUM);
+//      primitives.Sort(array);
+//
+// Commands go to the queue of the (first) array given, which must be an
+// in-order queue; only Reduce() and Compact() wait for them, to return their
+// result. Transfers between host
+// and device are left to the caller. All the kernels come from one program,
+// built for T at initialization. The work-group size is the largest power
+// of two fitting the device's max_work_group_size and local_mem_size (and
+// the kernels' own limits); each work-item handles as many consecutive
+// elements as the device's preferred vector width for T, so CPU devices get
+// enough work per item to vectorize while GPUs keep coalesced accesses.
+// The kernel arguments are shared: use one object per host thread.
+// Host versions (the "_Host" functions) give reference results.
+
+enum OpenCL_Reduce_Operation
+{
+    OPENCL_REDUCE_SUM,
+    OPENCL_REDUCE_MIN,
+    OPENCL_REDUCE_MAX
+};
+
+// *****************************************************************************
+template <class T>
+class OpenCL_Primitives
+{
+    private:
+        // Scans run on the elements (T) and on indices (cl_uint).
+        enum Scan_Kind
+        {
+            SCAN_ELEMENTS,
+            SCAN_INDICES,
+            NB_SCAN_KINDS
+        };
+
+        cl_context                      context;
+        cl_device_id                    device;
+        OpenCL_Kernel                  *program;                    // Built once, shared by every kernel
+        OpenCL_Kernel                  *reduce[3];                  // By OpenCL_Reduce_Operation
+        OpenCL_Kernel                  *scan_blocks[NB_SCAN_KINDS];
+        OpenCL_Kernel                  *add_offsets[NB_SCAN_KINDS];
+        OpenCL_Kernel                  *compact_flags;
+        OpenCL_Kernel                  *compact_scatter;
+        OpenCL_Kernel                  *radix_histogram;
+        OpenCL_Kernel                  *radix_scatter;
+
+        size_t                          local_size;                 // Work-group size of every kernel
+        cl_uint                         items[NB_SCAN_KINDS];       // Consecutive elements per work-item
+        size_t                          max_reduce_groups;
+
+        // Not copyable: the object owns the program and kernels.
+        OpenCL_Primitives(const OpenCL_Primitives &);
+        OpenCL_Primitives &             operator=(const OpenCL_Primitives &);
+
+        OpenCL_Kernel *                 Create_Kernel(const char *name);
+        cl_mem                          Create_Buffer(const size_t bytes);
+        void                            Enqueue(cl_command_queue queue, OpenCL_Kernel *kernel, const size_t nb_groups);
+        void                            Scan_Buffer(cl_command_queue queue, cl_mem input, cl_mem output,
+                                                    const cl_uint n, const bool inclusive, const Scan_Kind kind);
+
+    public:
+        OpenCL_Primitives();
+        ~OpenCL_Primitives();
+
+        // Build the kernels for "device" (and its context).
+        void                            Initialize(OpenCL_device &device);
+        void                            Release();
+
+        size_t                          Local_Size() const          { return local_size; }
+        cl_uint                         Items_per_Work_Item() const { return items[SCAN_ELEMENTS]; }
+
+        T                               Reduce(OpenCL_Array<T> &array, const OpenCL_Reduce_Operation operation);
+        // "output" can be "input".
+        void                            Scan(OpenCL_Array<T> &input, OpenCL_Array<T> &output, const bool inclusive = true);
+        // Copy to the beginning of "output" the elements of "input" whose flag is
+        // not zero, in order. "output" must be as large as "input". Returns the
+        // number of elements copied.
+        int                             Compact(OpenCL_Array<T> &input, OpenCL_Array<int> &flags, OpenCL_Array<T> &output);
+        // Ascending, stable, in place. Floating point values are ordered by
+        // sign and magnitude: -0 comes before +0 (NaNs go to the ends).
+        void                            Sort(OpenCL_Array<T> &array);
+
+        static T                        Reduce_Host(const T *array, const int n, const OpenCL_Reduce_Operation operation);
+        static void                     Scan_Host(const T *input, T *output, const int n, const bool inclusive = true);
+        static int                      Compact_Host(const T *input, const int *flags, T *output, const int n);
+        static void                     Sort_Host(T *array, const int n);
+};
+
+#endif // INC_OCLUTILS_PRIMITIVES_hpp
+
+// ********** End of file ***************************************
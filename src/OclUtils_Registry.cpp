@@ -0,0 +1,554 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>   // shm_open(), mmap()
+#include <sys/file.h>   // flock()
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>     // kill()
+#include <pthread.h>
+#include <time.h>
+
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <cmath>        // pow()
+#include <fstream>
+#include <sstream>
+#include <algorithm>    // std::min(), std::max()
+#include <map>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Registry.hpp"
+
+// *****************************************************************************
+// Name of the shared memory object (in /dev/shm on Linux). Bump the version
+// when the layout changes so that different library versions don't mix.
+const char   Registry_Name[]            = "/oclutils_registry_v2";
+const int    Registry_Magic             = 0x0C1E6157;
+
+// Weight of a new sample in the rolling utilization.
+const double Registry_Utilization_Weight = 0.25;
+
+// Minimum time (seconds) over which the busy time is measured before being published.
+const double Registry_Publish_Interval   = 1.0;
+
+// Minimum time (seconds) between two sweeps of the holders looking for dead processes.
+const double Registry_Purge_Interval     = 1.0;
+
+// *****************************************************************************
+// Devices held by this process, and their busy time since the last publication.
+// Kernel completion callbacks come from the drivers' threads.
+struct Tracked_Device
+{
+    std::string                         key;
+    double                              busy_time;
+    double                              window_start;
+    double                              last_completion;    // Of the last kernel run on the device
+};
+std::map<cl_device_id,Tracked_Device>   tracked_devices;
+pthread_mutex_t                         tracked_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// *****************************************************************************
+struct OpenCL_Registry::Shared_Data
+{
+    int                                 magic;
+    pthread_mutex_t                     mutex;
+    double                              last_purge;         // When the dead holders were last purged
+    int                                 nb_devices;
+    OpenCL_Registry_Device              devices[OPENCL_REGISTRY_MAX_DEVICES];
+};
+
+OpenCL_Registry *OpenCL_Registry::instance = NULL;
+
+// *****************************************************************************
+unsigned long long Process_Start_Time(const pid_t pid, char *state = NULL)
+/**
+ * Start time of a process (clock ticks since boot), 0 if unknown.
+ * Together with the pid, it identifies a process even if the pid is reused.
+ * @param state     If not NULL, set to the process' state ('R', 'S', 'Z', ...)
+ */
+{
+    char path[64];
+    sprintf(path, "/proc/%d/stat", int(pid));
+    std::ifstream file(path);
+    std::string stat;
+    if (not std::getline(file, stat))
+        return 0;
+
+    // The command name (2nd field) can contain spaces; skip it. Start time is the 22nd field.
+    const size_t end_of_name = stat.rfind(')');
+    if (end_of_name == std::string::npos)
+        return 0;
+    std::istringstream fields(stat.substr(end_of_name + 2));
+    std::string field;
+    for (int i = 3 ; i < 22 ; i++)
+    {
+        fields >> field;
+        if (i == 3 and state != NULL)
+            *state = field[0];
+    }
+    unsigned long long start = 0;
+    fields >> start;
+    return start;
+}
+
+// *****************************************************************************
+bool Is_Alive(const OpenCL_Registry_Holder &holder)
+{
+    if (kill(holder.pid, 0) == -1 and errno == ESRCH)
+        return false;
+
+    // A zombie (dead, not yet reaped by its parent) does not hold its locks anymore.
+    char state = ' ';
+    const unsigned long long start = Process_Start_Time(holder.pid, &state);
+    if (state == 'Z')
+        return false;
+    return (start == 0 or holder.process_start == 0 or start == holder.process_start);
+}
+
+// *****************************************************************************
+double Wall_Time()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    return double(t.tv_sec) + 1.0e-9 * double(t.tv_nsec);
+}
+
+// *****************************************************************************
+cl_ulong OpenCL_Registry_Device::Declared_Memory() const
+{
+    cl_ulong total = 0;
+    for (int i = 0 ; i < nb_holders ; i++)
+        total += holders[i].declared_memory;
+    return total;
+}
+
+// *****************************************************************************
+double OpenCL_Registry_Holder::Utilization(const double now) const
+/**
+ * Utilization is only published when kernels complete: a process that
+ * stopped launching kernels gets an idle sample per publication interval
+ * elapsed since.
+ */
+{
+    const double idle_intervals = (now - utilization_time) / Registry_Publish_Interval;
+    if (idle_intervals <= 1.0)
+        return utilization;
+    return utilization * pow(1.0 - Registry_Utilization_Weight, idle_intervals - 1.0);
+}
+
+// *****************************************************************************
+double OpenCL_Registry_Device::Utilization() const
+{
+    const double now = Wall_Time();
+    double total = 0.0;
+    for (int i = 0 ; i < nb_holders ; i++)
+        total += holders[i].Utilization(now);
+    return std::max(0.0, std::min(1.0, total));
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Create_Instance()
+{
+    instance = new OpenCL_Registry();
+}
+
+// *****************************************************************************
+OpenCL_Registry & OpenCL_Registry::Instance()
+{
+    // Devices are initialized concurrently: create the registry only once.
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, Create_Instance);
+    return *instance;
+}
+
+// *****************************************************************************
+OpenCL_Registry::OpenCL_Registry()
+/**
+ * Open (or create and initialize) the shared memory. On failure, the registry
+ * is just not available: locking still works through the lock files.
+ */
+{
+    shared = NULL;
+
+    int f = shm_open(Registry_Name, O_CREAT | O_RDWR, 0666);
+    if (f == -1)
+        return;
+    fchmod(f, 0666);    // Shared between users, like the lock files
+
+    // Only one process initializes the memory. A crash during it releases the lock.
+    flock(f, LOCK_EX);
+    struct stat info;
+    const bool must_initialize = (fstat(f, &info) == 0 and size_t(info.st_size) < sizeof(Shared_Data));
+    if (must_initialize and ftruncate(f, sizeof(Shared_Data)) == -1)
+    {
+        flock(f, LOCK_UN);
+        close(f);
+        return;
+    }
+
+    void *p = mmap(NULL, sizeof(Shared_Data), PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    if (p == MAP_FAILED)
+    {
+        flock(f, LOCK_UN);
+        close(f);
+        return;
+    }
+    Shared_Data *data = (Shared_Data *) p;
+
+    if (must_initialize or data->magic != Registry_Magic)
+    {
+        memset(data, 0, sizeof(Shared_Data));
+
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&data->mutex, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+
+        data->last_purge = 0.0;
+        data->nb_devices = 0;
+        __sync_synchronize();
+        data->magic = Registry_Magic;
+    }
+
+    flock(f, LOCK_UN);
+    close(f);           // The mapping stays valid
+
+    shared = data;
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Lock()
+{
+    const int err = pthread_mutex_lock(&shared->mutex);
+    if (err == EOWNERDEAD)
+    {
+        // A process died while holding the mutex. Entries are always written
+        // in a consistent order, and dead holders are purged right after.
+        pthread_mutex_consistent(&shared->mutex);
+        shared->last_purge = 0.0;
+    }
+
+    // Checking every holder's process in /proc is costly: do it periodically.
+    const double now = Wall_Time();
+    if (now - shared->last_purge >= Registry_Purge_Interval or now < shared->last_purge)
+    {
+        Purge_Dead_Holders();
+        shared->last_purge = now;
+    }
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Unlock()
+{
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Purge_Dead_Holders()
+{
+    for (int d = 0 ; d < shared->nb_devices ; d++)
+    {
+        OpenCL_Registry_Device &device = shared->devices[d];
+        for (int i = 0 ; i < device.nb_holders ; )
+        {
+            if (Is_Alive(device.holders[i]))
+                i++;
+            else
+                device.holders[i] = device.holders[--device.nb_holders];
+        }
+    }
+}
+
+// *****************************************************************************
+OpenCL_Registry_Device * OpenCL_Registry::Find(const std::string &key, const bool create)
+{
+    for (int d = 0 ; d < shared->nb_devices ; d++)
+    {
+        if (strncmp(shared->devices[d].key, key.c_str(), OPENCL_REGISTRY_KEY_LENGTH-1) == 0)
+            return &shared->devices[d];
+    }
+
+    if (not create or shared->nb_devices >= OPENCL_REGISTRY_MAX_DEVICES)
+        return NULL;
+
+    OpenCL_Registry_Device *device = &shared->devices[shared->nb_devices];
+    memset(device, 0, sizeof(OpenCL_Registry_Device));
+    strncpy(device->key, key.c_str(), OPENCL_REGISTRY_KEY_LENGTH-1);
+    shared->nb_devices++;
+    return device;
+}
+
+// *****************************************************************************
+OpenCL_Registry_Holder * OpenCL_Registry::Find_Self(OpenCL_Registry_Device *device)
+{
+    if (device == NULL)
+        return NULL;
+
+    const pid_t pid = getpid();
+    for (int i = 0 ; i < device->nb_holders ; i++)
+    {
+        if (device->holders[i].pid == pid)
+            return &device->holders[i];
+    }
+    return NULL;
+}
+
+// *****************************************************************************
+bool OpenCL_Registry::Register_Holder(const std::string &key)
+/**
+ * @return  false if the registry is not available or full
+ */
+{
+    if (not Is_Available())
+        return false;
+
+    Lock();
+    OpenCL_Registry_Device *device = Find(key, true);
+    bool registered = false;
+    if (device != NULL and Find_Self(device) != NULL)
+    {
+        registered = true;  // Already there (a sub-device and its parent can share a key)
+    }
+    else if (device != NULL and device->nb_holders < OPENCL_REGISTRY_MAX_HOLDERS)
+    {
+        OpenCL_Registry_Holder holder;
+        holder.pid              = getpid();
+        holder.process_start    = Process_Start_Time(holder.pid);
+        holder.start_time       = Wall_Time();
+        holder.declared_memory  = 0;
+        holder.utilization      = 0.0;
+        holder.utilization_time = holder.start_time;
+        device->holders[device->nb_holders] = holder;
+        __sync_synchronize();   // Entry complete before it is counted
+        device->nb_holders++;
+        registered = true;
+    }
+    Unlock();
+
+    return registered;
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Unregister_Holder(const std::string &key)
+{
+    if (not Is_Available())
+        return;
+
+    Lock();
+    OpenCL_Registry_Device *device = Find(key, false);
+    OpenCL_Registry_Holder *holder = Find_Self(device);
+    if (holder != NULL)
+        *holder = device->holders[--device->nb_holders];
+    Unlock();
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Declare_Memory(const std::string &key, const cl_ulong bytes)
+{
+    if (not Is_Available())
+        return;
+
+    Lock();
+    OpenCL_Registry_Holder *holder = Find_Self(Find(key, false));
+    if (holder != NULL)
+        holder->declared_memory = bytes;
+    Unlock();
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Publish_Utilization(const std::string &key, const double busy_fraction)
+/**
+ * @param busy_fraction     Fraction of the time the device was busy since the last call.
+ *                          Averaged with the previous values (exponential moving average).
+ */
+{
+    if (not Is_Available())
+        return;
+
+    Lock();
+    OpenCL_Registry_Holder *holder = Find_Self(Find(key, false));
+    if (holder != NULL)
+    {
+        const double now    = Wall_Time();
+        const double sample = std::max(0.0, std::min(1.0, busy_fraction));
+        holder->utilization      = Registry_Utilization_Weight * sample + (1.0 - Registry_Utilization_Weight) * holder->Utilization(now);
+        holder->utilization_time = now;
+    }
+    Unlock();
+}
+
+// *****************************************************************************
+bool OpenCL_Registry::Get_Device(const std::string &key, OpenCL_Registry_Device &device)
+{
+    if (not Is_Available())
+        return false;
+
+    Lock();
+    OpenCL_Registry_Device *entry = Find(key, false);
+    if (entry != NULL)
+        device = *entry;
+    Unlock();
+
+    return (entry != NULL);
+}
+
+// *****************************************************************************
+int OpenCL_Registry::Nb_Holders(const std::string &key)
+{
+    OpenCL_Registry_Device device;
+    if (not Get_Device(key, device))
+        return 0;
+    return device.nb_holders;
+}
+
+// *****************************************************************************
+std::vector<OpenCL_Registry_Device> OpenCL_Registry::Snapshot()
+{
+    std::vector<OpenCL_Registry_Device> devices;
+    if (not Is_Available())
+        return devices;
+
+    Lock();
+    devices.assign(shared->devices, shared->devices + shared->nb_devices);
+    Unlock();
+
+    return devices;
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Track_Device(const cl_device_id device, const std::string &key)
+{
+    pthread_mutex_lock(&tracked_devices_mutex);
+    Tracked_Device &tracked = tracked_devices[device];
+    tracked.key             = key;
+    tracked.busy_time       = 0.0;
+    tracked.window_start    = Wall_Time();
+    tracked.last_completion = 0.0;
+    pthread_mutex_unlock(&tracked_devices_mutex);
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Untrack_Device(const cl_device_id device)
+{
+    pthread_mutex_lock(&tracked_devices_mutex);
+    tracked_devices.erase(device);
+    pthread_mutex_unlock(&tracked_devices_mutex);
+}
+
+// *****************************************************************************
+bool OpenCL_Registry::Is_Tracked(const cl_device_id device)
+{
+    pthread_mutex_lock(&tracked_devices_mutex);
+    const bool is_tracked = (tracked_devices.find(device) != tracked_devices.end());
+    pthread_mutex_unlock(&tracked_devices_mutex);
+    return is_tracked;
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Add_Memory(const cl_device_id device, const long long bytes)
+/**
+ * @param bytes     Allocated (positive) or released (negative) memory
+ */
+{
+    pthread_mutex_lock(&tracked_devices_mutex);
+    std::map<cl_device_id,Tracked_Device>::iterator it = tracked_devices.find(device);
+    const std::string key = (it != tracked_devices.end() ? it->second.key : "");
+    pthread_mutex_unlock(&tracked_devices_mutex);
+    if (key == "")
+        return;
+
+    OpenCL_Registry &registry = Instance();
+    if (not registry.Is_Available())
+        return;
+
+    registry.Lock();
+    OpenCL_Registry_Holder *holder = registry.Find_Self(registry.Find(key, false));
+    if (holder != NULL)
+    {
+        if (bytes < 0 and cl_ulong(-bytes) > holder->declared_memory)
+            holder->declared_memory = 0;
+        else
+            holder->declared_memory += bytes;
+    }
+    registry.Unlock();
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Add_Busy_Time(const cl_device_id device, const double seconds, const double since_enqueued)
+/**
+ * Called when a kernel completes.
+ * @param seconds           Its execution time, negative if unknown: it then
+ *                          ran since it was enqueued or since the device's
+ *                          previous kernel completed, whichever is later.
+ * @param since_enqueued    Time elapsed since it was enqueued
+ */
+{
+    std::string key;
+    double busy_fraction = -1.0;
+
+    pthread_mutex_lock(&tracked_devices_mutex);
+    std::map<cl_device_id,Tracked_Device>::iterator it = tracked_devices.find(device);
+    if (it != tracked_devices.end())
+    {
+        Tracked_Device &tracked = it->second;
+        const double now     = Wall_Time();
+        const double started = std::max(now - since_enqueued, tracked.last_completion);
+        tracked.busy_time += (seconds >= 0.0 ? seconds : std::max(0.0, now - started));
+        tracked.last_completion = now;
+        const double elapsed = now - tracked.window_start;
+        if (elapsed >= Registry_Publish_Interval)
+        {
+            key                 = tracked.key;
+            busy_fraction       = tracked.busy_time / elapsed;
+            tracked.busy_time   = 0.0;
+            tracked.window_start= now;
+        }
+    }
+    pthread_mutex_unlock(&tracked_devices_mutex);
+
+    if (busy_fraction >= 0.0)
+        Instance().Publish_Utilization(key, busy_fraction);
+}
+
+// *****************************************************************************
+void OpenCL_Registry::Print()
+{
+    const std::vector<OpenCL_Registry_Device> devices = Snapshot();
+
+    std_cout << "OpenCL: Device registry (" << (Is_Available() ? "shared memory " : "not available") << (Is_Available() ? Registry_Name : "") << "):\n";
+    const double now = Wall_Time();
+    for (unsigned int d = 0 ; d < devices.size() ; d++)
+    {
+        std_cout << "    " << devices[d].key << ": " << devices[d].nb_holders << " holder(s), "
+                  << devices[d].Declared_Memory() << " bytes declared, utilization " << devices[d].Utilization() << "\n";
+        for (int i = 0 ; i < devices[d].nb_holders ; i++)
+        {
+            const OpenCL_Registry_Holder &holder = devices[d].holders[i];
+            std_cout << "        pid " << holder.pid << " since " << now - holder.start_time << " s, "
+                      << holder.declared_memory << " bytes, utilization " << holder.Utilization(now) << "\n";
+        }
+    }
+}
+
+// ********** End of file ***************************************
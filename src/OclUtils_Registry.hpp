@@ -0,0 +1,116 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_REGISTRY_hpp
+#define INC_OCLUTILS_REGISTRY_hpp
+
+#include <string>
+#include <vector>
+#include <sys/types.h>  // pid_t
+
+#include <CL/cl.h>
+
+// *****************************************************************************
+// Machine-wide registry of device usage, kept in POSIX shared memory and
+// protected by a robust process-shared mutex (a process dying while holding
+// it does not block the others). Every process locking a device registers
+// itself there; schedulers (or OpenCL_device's probe) can then know who uses
+// which device, how much memory they declared and how busy they keep it
+// without probing lock files. Holders that died are purged automatically.
+// The lock files stay authoritative: the registry only adds information.
+
+const int OPENCL_REGISTRY_MAX_DEVICES       = 64;
+const int OPENCL_REGISTRY_MAX_HOLDERS       = 32;
+const int OPENCL_REGISTRY_KEY_LENGTH        = 256;
+
+// *****************************************************************************
+struct OpenCL_Registry_Holder
+{
+    pid_t                               pid;
+    unsigned long long                  process_start;      // From /proc, to detect reused pids
+    double                              start_time;         // When the device was acquired (seconds since epoch)
+    cl_ulong                            declared_memory;    // Bytes the process expects to use on the device
+    double                              utilization;        // Rolling fraction of time the device is busy (0-1)
+    double                              utilization_time;   // When it was last published (seconds since epoch)
+
+    // Utilization decayed for the time nothing was published, as if the device was idle.
+    double                              Utilization(const double now) const;
+};
+
+// *****************************************************************************
+struct OpenCL_Registry_Device
+{
+    char                                key[OPENCL_REGISTRY_KEY_LENGTH];
+    int                                 nb_holders;
+    OpenCL_Registry_Holder              holders[OPENCL_REGISTRY_MAX_HOLDERS];
+
+    cl_ulong                            Declared_Memory() const;
+    double                              Utilization() const;    // Of all holders, at most 1
+};
+
+// *****************************************************************************
+class OpenCL_Registry
+{
+    public:
+        static OpenCL_Registry &        Instance();
+
+        bool                            Is_Available() const            { return shared != NULL; }
+
+        // Called by OpenCL_device::Lock() and Unlock(). "key" identifies the device (its lock file).
+        bool                            Register_Holder(const std::string &key);
+        void                            Unregister_Holder(const std::string &key);
+
+        // Information published by the current process on a device it holds.
+        void                            Declare_Memory(const std::string &key, const cl_ulong bytes);
+        void                            Publish_Utilization(const std::string &key, const double busy_fraction);
+
+        // Copy of a device's entry. Returns false if nobody ever registered on it.
+        bool                            Get_Device(const std::string &key, OpenCL_Registry_Device &device);
+        int                             Nb_Holders(const std::string &key);
+        std::vector<OpenCL_Registry_Device> Snapshot();
+        void                            Print();
+
+        // Usage measured by the library on the devices held by this process:
+        // OpenCL_Array adds the memory it allocates, OpenCL_Kernel the time its
+        // kernels keep the device busy. The utilization is published about
+        // once per second, when kernels complete. Static: nothing is mapped for
+        // devices that are not tracked.
+        static void                     Track_Device(const cl_device_id device, const std::string &key);
+        static void                     Untrack_Device(const cl_device_id device);
+        static bool                     Is_Tracked(const cl_device_id device);
+        static void                     Add_Memory(const cl_device_id device, const long long bytes);
+        static void                     Add_Busy_Time(const cl_device_id device, const double seconds, const double since_enqueued);
+
+    private:
+        struct Shared_Data;
+        Shared_Data                    *shared;
+
+        OpenCL_Registry();
+        void                            Lock();
+        void                            Unlock();
+        void                            Purge_Dead_Holders();
+        OpenCL_Registry_Device *        Find(const std::string &key, const bool create);
+        OpenCL_Registry_Holder *        Find_Self(OpenCL_Registry_Device *device);
+
+        static void                     Create_Instance();
+        static OpenCL_Registry         *instance;
+};
+
+#endif // INC_OCLUTILS_REGISTRY_hpp
+
+// ********** End of file ***************************************
@@ -0,0 +1,235 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Startup.hpp"
+
+OpenCL_Startup_Profile *OpenCL_Startup_Profile::instance = NULL;
+
+// *****************************************************************************
+bool Compare_Startup_Phases(const OpenCL_Startup_Phase &a, const OpenCL_Startup_Phase &b)
+{
+    return a.start < b.start;
+}
+
+// *****************************************************************************
+void OpenCL_Startup_Profile::Create_Instance()
+{
+    instance = new OpenCL_Startup_Profile();
+}
+
+// *****************************************************************************
+OpenCL_Startup_Profile & OpenCL_Startup_Profile::Instance()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, Create_Instance);
+    return *instance;
+}
+
+// *****************************************************************************
+OpenCL_Startup_Profile::OpenCL_Startup_Profile()
+{
+    pthread_mutex_init(&mutex, NULL);
+    recording = true;
+    truncated = false;
+}
+
+// *****************************************************************************
+void OpenCL_Startup_Profile::Record(const std::string &phase, const std::string &platform,
+                                    const std::string &device, const double start, const double end)
+{
+    OpenCL_Startup_Phase p;
+    p.phase     = phase;
+    p.platform  = platform;
+    p.device    = device;
+    p.start     = start;
+    p.duration  = (end > start ? end - start : 0.0);
+
+    pthread_mutex_lock(&mutex);
+    if (recording and int(phases.size()) >= OPENCL_STARTUP_MAX_PHASES)
+    {
+        recording = false;
+        truncated = true;
+    }
+    if (recording)
+        phases.push_back(p);
+    pthread_mutex_unlock(&mutex);
+}
+
+// *****************************************************************************
+void OpenCL_Startup_Profile::Stop()
+{
+    pthread_mutex_lock(&mutex);
+    recording = false;
+    pthread_mutex_unlock(&mutex);
+}
+
+// *****************************************************************************
+bool OpenCL_Startup_Profile::Is_Recording()
+{
+    pthread_mutex_lock(&mutex);
+    const bool is_recording = recording;
+    pthread_mutex_unlock(&mutex);
+    return is_recording;
+}
+
+// *****************************************************************************
+bool OpenCL_Startup_Profile::Is_Truncated()
+{
+    pthread_mutex_lock(&mutex);
+    const bool is_truncated = truncated;
+    pthread_mutex_unlock(&mutex);
+    return is_truncated;
+}
+
+// *****************************************************************************
+std::vector<OpenCL_Startup_Phase> OpenCL_Startup_Profile::Phases()
+{
+    pthread_mutex_lock(&mutex);
+    std::vector<OpenCL_Startup_Phase> sorted = phases;
+    pthread_mutex_unlock(&mutex);
+
+    std::stable_sort(sorted.begin(), sorted.end(), Compare_Startup_Phases);
+    return sorted;
+}
+
+// *****************************************************************************
+double OpenCL_Startup_Profile::Total(const std::string &phase, const std::string &platform,
+                                     const std::string &device)
+{
+    double total = 0.0;
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0 ; i < phases.size() ; i++)
+    {
+        if ((phase    == "" or phases[i].phase    == phase) and
+            (platform == "" or phases[i].platform == platform) and
+            (device   == "" or phases[i].device   == device))
+        {
+            total += phases[i].duration;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return total;
+}
+
+// *****************************************************************************
+double OpenCL_Startup_Profile::Wall_Time()
+{
+    double first = 0.0, last = 0.0;
+    pthread_mutex_lock(&mutex);
+    for (size_t i = 0 ; i < phases.size() ; i++)
+    {
+        if (i == 0 or phases[i].start < first)
+            first = phases[i].start;
+        if (i == 0 or phases[i].start + phases[i].duration > last)
+            last = phases[i].start + phases[i].duration;
+    }
+    pthread_mutex_unlock(&mutex);
+    return last - first;
+}
+
+// *****************************************************************************
+void OpenCL_Startup_Profile::Print()
+/**
+ * Every phase (start relative to the first one), then the total of each phase.
+ */
+{
+    const std::vector<OpenCL_Startup_Phase> sorted = Phases();
+    if (sorted.empty())
+    {
+        std_cout << "OpenCL: Startup profile: nothing recorded.\n" << std::flush;
+        return;
+    }
+
+    char line[512];
+    sprintf(line, "OpenCL: Startup profile (wall time: %.3f ms%s):\n", Wall_Time() * 1.0e3,
+            (Is_Truncated() ? ", truncated" : ""));
+    std_cout << line;
+    sprintf(line, "    %-14s %-24s %-32s %12s %14s\n", "phase", "platform", "device", "start (ms)", "duration (ms)");
+    std_cout << line;
+    std::vector<std::string> names;
+    for (size_t i = 0 ; i < sorted.size() ; i++)
+    {
+        const OpenCL_Startup_Phase &p = sorted[i];
+        sprintf(line, "    %-14s %-24.24s %-32.32s %12.3f %14.3f\n", p.phase.c_str(), p.platform.c_str(), p.device.c_str(),
+                (p.start - sorted[0].start) * 1.0e3, p.duration * 1.0e3);
+        std_cout << line;
+        if (std::find(names.begin(), names.end(), p.phase) == names.end())
+            names.push_back(p.phase);
+    }
+    std_cout << "OpenCL: Startup profile totals:\n";
+    for (size_t i = 0 ; i < names.size() ; i++)
+    {
+        sprintf(line, "    %-14s %14.3f ms\n", names[i].c_str(), Total(names[i]) * 1.0e3);
+        std_cout << line;
+    }
+    std_cout << std::flush;
+}
+
+// *****************************************************************************
+std::string OpenCL_Startup_Profile::JSON()
+/**
+ * {"wall_time": s, "truncated": bool, "phases": [{"phase": ..., "platform": ..., "device": ..., "start": s, "duration": s}, ...]}
+ * Starts are relative to the first phase's.
+ */
+{
+    const std::vector<OpenCL_Startup_Phase> sorted = Phases();
+
+    std::ostringstream out;
+    out.precision(9);
+    out << "{\n  \"wall_time\": " << Wall_Time() << ",\n  \"truncated\": " << (Is_Truncated() ? "true" : "false")
+        << ",\n  \"phases\": [";
+    for (size_t i = 0 ; i < sorted.size() ; i++)
+    {
+        const OpenCL_Startup_Phase &p = sorted[i];
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"phase\": \"" << p.phase << "\", \"platform\": \"" << Escape_JSON(p.platform)
+            << "\", \"device\": \"" << Escape_JSON(p.device) << "\", \"start\": " << p.start - sorted[0].start
+            << ", \"duration\": " << p.duration << "}";
+    }
+    out << "\n  ]\n}\n";
+    return out.str();
+}
+
+// *****************************************************************************
+bool OpenCL_Startup_Profile::Write(const std::string &path)
+{
+    std::ofstream file(path.c_str());
+    if (not file.is_open())
+        return false;
+    file << JSON();
+    file.close();
+    return not file.fail();
+}
+
+// *****************************************************************************
+void OpenCL_Startup_Profile::Clear()
+{
+    pthread_mutex_lock(&mutex);
+    phases.clear();
+    recording = true;
+    truncated = false;
+    pthread_mutex_unlock(&mutex);
+}
+
+// ********** End of file ***************************************
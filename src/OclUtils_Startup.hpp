@@ -0,0 +1,98 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_STARTUP_hpp
+#define INC_OCLUTILS_STARTUP_hpp
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+// *****************************************************************************
+// Where the time goes while OpenCL is initialized: every phase (platform and
+// device enumeration, information queries, lock probing, context creation,
+// program loading and building) is recorded with the platform and device it
+// concerns. Phases are recorded until Stop() is called (once the application
+// considers itself started) or until OPENCL_STARTUP_MAX_PHASES were recorded,
+// so that programs built later in long runs don't grow the profile forever.
+// Devices are initialized concurrently, so the phases' durations can add up
+// to more than the wall time; Wall_Time() is the time from the first phase's
+// start to the last one's end.
+
+const int OPENCL_STARTUP_MAX_PHASES     = 1024;
+
+// Phases recorded by the library
+#define OPENCL_STARTUP_ENUMERATION      "enumeration"
+#define OPENCL_STARTUP_PLATFORM_INFO    "platform_info"
+#define OPENCL_STARTUP_DEVICE_INFO      "device_info"
+#define OPENCL_STARTUP_LOCK_PROBE       "lock_probe"
+#define OPENCL_STARTUP_CONTEXT          "context"
+#define OPENCL_STARTUP_PROGRAM_LOAD     "program_load"
+#define OPENCL_STARTUP_BUILD            "build"
+
+// *****************************************************************************
+struct OpenCL_Startup_Phase
+{
+    std::string                         phase;
+    std::string                         platform;   // Empty when not specific to a platform
+    std::string                         device;     // Empty when not specific to a device
+    double                              start;      // Seconds (monotonic clock)
+    double                              duration;   // Seconds
+};
+
+// *****************************************************************************
+class OpenCL_Startup_Profile
+{
+    private:
+        pthread_mutex_t                 mutex;
+        std::vector<OpenCL_Startup_Phase> phases;
+        bool                            recording;
+        bool                            truncated;  // Stopped by OPENCL_STARTUP_MAX_PHASES
+
+        OpenCL_Startup_Profile();
+        static void                     Create_Instance();
+        static OpenCL_Startup_Profile  *instance;
+
+    public:
+        static OpenCL_Startup_Profile & Instance();
+
+        // "start" and "end" in seconds, from the same monotonic clock. Ignored once stopped.
+        void                            Record(const std::string &phase, const std::string &platform,
+                                               const std::string &device, const double start, const double end);
+        void                            Stop();
+        bool                            Is_Recording();
+        bool                            Is_Truncated();
+
+        // Recorded phases, in the order they started.
+        std::vector<OpenCL_Startup_Phase> Phases();
+        // Sum of the durations of a phase (all of them if "phase" is empty),
+        // restricted to a platform and/or a device if given.
+        double                          Total(const std::string &phase = "", const std::string &platform = "",
+                                              const std::string &device = "");
+        double                          Wall_Time();
+
+        void                            Print();
+        std::string                     JSON();
+        bool                            Write(const std::string &path);
+        // Forget the recorded phases and record again.
+        void                            Clear();
+};
+
+#endif // INC_OCLUTILS_STARTUP_hpp
+
+// ********** End of file ***************************************
@@ -0,0 +1,361 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#include <time.h>       // clock_gettime()
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "OclUtils.hpp"
+#include "OclUtils_Trace.hpp"
+
+OpenCL_Trace *OpenCL_Trace::instance = NULL;
+
+// *****************************************************************************
+// Information kept between the enqueue of a traced command and its completion.
+struct Traced_Event
+{
+    std::string                         name;
+    std::string                         category;
+    int                                 pid;
+    int                                 tid;
+    double                              enqueued;       // Host_Time()
+    bool                                calibrated;     // Is "clock_offset" known?
+    double                              clock_offset;   // From the device's profiling clock to Host_Time()
+};
+
+// *****************************************************************************
+std::string Escape_JSON(const std::string &s)
+{
+    std::string escaped;
+    for (size_t i = 0 ; i < s.size() ; i++)
+    {
+        const unsigned char c = (unsigned char) s[i];
+        if (c == '"' or c == '\\')
+        {
+            escaped += '\\';
+            escaped += s[i];
+        }
+        else if (c == '\n')
+            escaped += "\\n";
+        else if (c < 0x20)
+        {
+            char code[8];
+            sprintf(code, "\\u%04x", c);
+            escaped += code;
+        }
+        else
+            escaped += s[i];
+    }
+    return escaped;
+}
+
+// *****************************************************************************
+bool Calibrate_Device_Clock(cl_command_queue queue, double &offset)
+/**
+ * Offset (microseconds) from the profiling clock of the queue's device to
+ * Host_Time(). A marker's "queued" timestamp is taken while the host enqueues
+ * it: markers are enqueued on a queue of their own and the fastest enqueue
+ * brackets it best.
+ * @return false if the device's clock could not be read.
+ */
+{
+    cl_context context = NULL;
+    cl_device_id device = NULL;
+    if (clGetCommandQueueInfo(queue, CL_QUEUE_CONTEXT, sizeof(cl_context),   &context, NULL) != CL_SUCCESS or
+        clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE,  sizeof(cl_device_id), &device,  NULL) != CL_SUCCESS)
+        return false;
+
+    cl_int err;
+    cl_command_queue calibration_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    if (err != CL_SUCCESS)
+        return false;
+
+    double best_window = -1.0;
+    for (int i = 0 ; i < 5 and err == CL_SUCCESS ; i++)
+    {
+        cl_event marker;
+        const double before = OpenCL_Trace::Host_Time();
+#ifdef CL_VERSION_1_2
+        err = clEnqueueMarkerWithWaitList(calibration_queue, 0, NULL, &marker);
+#else
+        err = clEnqueueMarker(calibration_queue, &marker);
+#endif // #ifdef CL_VERSION_1_2
+        const double after = OpenCL_Trace::Host_Time();
+        if (err != CL_SUCCESS)
+            break;
+
+        cl_ulong queued_ns;
+        err = clWaitForEvents(1, &marker);
+        if (err == CL_SUCCESS)
+            err = clGetEventProfilingInfo(marker, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued_ns, NULL);
+        clReleaseEvent(marker);
+
+        if (err == CL_SUCCESS and (best_window < 0.0 or after - before < best_window))
+        {
+            best_window = after - before;
+            offset      = 0.5 * (before + after) - double(queued_ns) * 1.0e-3;
+        }
+    }
+    clReleaseCommandQueue(calibration_queue);
+
+    return (best_window >= 0.0);
+}
+
+#ifdef CL_VERSION_1_1
+// *****************************************************************************
+void CL_CALLBACK Traced_Event_Completed(cl_event event, cl_int status, void *data)
+/**
+ * The device's timestamps are aligned on the host's clock with the device's
+ * calibrated offset, or if it is unknown by assuming the command was queued
+ * when it was enqueued by the host.
+ */
+{
+    Traced_Event *traced = (Traced_Event *) data;
+
+    double start = traced->enqueued;
+    double end   = OpenCL_Trace::Host_Time();
+    cl_ulong queued_ns, start_ns, end_ns;
+    if (status == CL_COMPLETE and
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued_ns, NULL) == CL_SUCCESS and
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,  sizeof(cl_ulong), &start_ns,  NULL) == CL_SUCCESS and
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,    sizeof(cl_ulong), &end_ns,    NULL) == CL_SUCCESS and
+        end_ns >= start_ns)
+    {
+        const double offset = (traced->calibrated ? traced->clock_offset : traced->enqueued - double(queued_ns) * 1.0e-3);
+        start = double(start_ns) * 1.0e-3 + offset;
+        end   = double(end_ns)   * 1.0e-3 + offset;
+    }
+
+    OpenCL_Trace::Instance().Add_Span(traced->name, traced->category, traced->pid, traced->tid, start, end);
+
+    delete traced;
+    clReleaseEvent(event);
+}
+#endif // #ifdef CL_VERSION_1_1
+
+// *****************************************************************************
+void OpenCL_Trace::Create_Instance()
+{
+    instance = new OpenCL_Trace();
+}
+
+// *****************************************************************************
+OpenCL_Trace & OpenCL_Trace::Instance()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, Create_Instance);
+    return *instance;
+}
+
+// *****************************************************************************
+OpenCL_Trace::OpenCL_Trace()
+{
+    enabled = false;
+    pthread_mutex_init(&mutex, NULL);
+    process_names[0] = "Host";
+    Host_Time();    // Set the origin
+}
+
+// *****************************************************************************
+double OpenCL_Trace::Host_Time()
+{
+    static struct timespec origin = {0, 0};
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (origin.tv_sec == 0 and origin.tv_nsec == 0)
+        origin = now;
+    return double(now.tv_sec - origin.tv_sec) * 1.0e6 + double(now.tv_nsec - origin.tv_nsec) * 1.0e-3;
+}
+
+// *****************************************************************************
+void OpenCL_Trace::Queue_Track(cl_command_queue queue, int &pid, int &tid)
+/**
+ * Track of a queue: its device's process, its own thread. Called with the mutex held.
+ */
+{
+    cl_device_id device = NULL;
+    clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+
+    std::map<cl_device_id,int>::iterator d = device_pids.find(device);
+    if (d == device_pids.end())
+    {
+        d = device_pids.insert(std::make_pair(device, int(device_pids.size()) + 1)).first;
+        char name[256] = "";
+        clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name)-1, name, NULL);
+        process_names[d->second] = name;
+
+        double offset;
+        if (Calibrate_Device_Clock(queue, offset))
+            clock_offsets[d->second] = offset;
+    }
+    pid = d->second;
+
+    std::map<cl_command_queue,int>::iterator q = queue_tids.find(queue);
+    if (q == queue_tids.end())
+    {
+        q = queue_tids.insert(std::make_pair(queue, int(queue_tids.size()) + 1)).first;
+        char name[64];
+        sprintf(name, "Queue %d (%p)", q->second, (void *) queue);
+        thread_names[std::make_pair(pid, q->second)] = name;
+    }
+    tid = q->second;
+}
+
+// *****************************************************************************
+int OpenCL_Trace::Host_Thread_Track()
+/**
+ * Track of the calling host thread. Called with the mutex held.
+ */
+{
+    const pthread_t self = pthread_self();
+    for (size_t i = 0 ; i < host_threads.size() ; i++)
+    {
+        if (pthread_equal(host_threads[i], self))
+            return int(i) + 1;
+    }
+    host_threads.push_back(self);
+    const int tid = int(host_threads.size());
+    char name[64];
+    sprintf(name, "Thread %d", tid);
+    thread_names[std::make_pair(0, tid)] = name;
+    return tid;
+}
+
+// *****************************************************************************
+void OpenCL_Trace::Add_Span(const std::string &name, const std::string &category,
+                            const int pid, const int tid, const double start, const double end)
+{
+    Span span;
+    span.name       = name;
+    span.category   = category;
+    span.pid        = pid;
+    span.tid        = tid;
+    span.start      = start;
+    span.duration   = (end > start ? end - start : 0.0);
+
+    pthread_mutex_lock(&mutex);
+    spans.push_back(span);
+    pthread_mutex_unlock(&mutex);
+}
+
+// *****************************************************************************
+void OpenCL_Trace::Add_Host_Span(const std::string &name, const std::string &category,
+                                 const double start, const double end)
+{
+    if (not enabled)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    const int tid = Host_Thread_Track();
+    pthread_mutex_unlock(&mutex);
+
+    Add_Span(name, category, 0, tid, start, end);
+}
+
+// *****************************************************************************
+void OpenCL_Trace::Add_Event(cl_event event, cl_command_queue queue,
+                             const std::string &name, const std::string &category)
+{
+#ifdef CL_VERSION_1_1
+    if (not enabled or event == NULL)
+        return;
+
+    Traced_Event *traced = new Traced_Event;
+    traced->name        = name;
+    traced->category    = category;
+    traced->enqueued    = Host_Time();
+    pthread_mutex_lock(&mutex);
+    Queue_Track(queue, traced->pid, traced->tid);
+    std::map<int,double>::const_iterator offset = clock_offsets.find(traced->pid);
+    traced->calibrated  = (offset != clock_offsets.end());
+    traced->clock_offset= (traced->calibrated ? offset->second : 0.0);
+    pthread_mutex_unlock(&mutex);
+
+    clRetainEvent(event);
+    if (clSetEventCallback(event, CL_COMPLETE, Traced_Event_Completed, traced) != CL_SUCCESS)
+    {
+        delete traced;
+        clReleaseEvent(event);
+    }
+#endif // #ifdef CL_VERSION_1_1
+}
+
+// *****************************************************************************
+int OpenCL_Trace::Nb_Spans()
+{
+    pthread_mutex_lock(&mutex);
+    const int nb = int(spans.size());
+    pthread_mutex_unlock(&mutex);
+    return nb;
+}
+
+// *****************************************************************************
+void OpenCL_Trace::Clear()
+{
+    pthread_mutex_lock(&mutex);
+    spans.clear();
+    pthread_mutex_unlock(&mutex);
+}
+
+// *****************************************************************************
+bool OpenCL_Trace::Write(const std::string &path)
+/**
+ * Write the spans recorded so far (commands still running are not included).
+ */
+{
+    std::ofstream file(path.c_str());
+    if (not file.is_open())
+        return false;
+
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(3);
+
+    pthread_mutex_lock(&mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (std::map<int,std::string>::const_iterator it = process_names.begin() ; it != process_names.end() ; ++it)
+    {
+        out << (first ? "" : ",\n")
+            << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << it->first << ", \"tid\": 0, "
+            << "\"args\": {\"name\": \"" << Escape_JSON(it->second) << "\"}}";
+        first = false;
+    }
+    for (std::map<std::pair<int,int>,std::string>::const_iterator it = thread_names.begin() ; it != thread_names.end() ; ++it)
+    {
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << it->first.first << ", \"tid\": " << it->first.second << ", "
+            << "\"args\": {\"name\": \"" << Escape_JSON(it->second) << "\"}}";
+    }
+    for (size_t i = 0 ; i < spans.size() ; i++)
+    {
+        const Span &span = spans[i];
+        out << ",\n{\"name\": \"" << Escape_JSON(span.name) << "\", \"cat\": \"" << Escape_JSON(span.category) << "\", \"ph\": \"X\", "
+            << "\"ts\": " << span.start << ", \"dur\": " << span.duration << ", "
+            << "\"pid\": " << span.pid << ", \"tid\": " << span.tid << "}";
+    }
+    out << "\n]}\n";
+    pthread_mutex_unlock(&mutex);
+
+    file << out.str();
+    file.close();
+    return not file.fail();
+}
+
+// ********** End of file ***************************************
@@ -0,0 +1,103 @@
+/*
+ Copyright 2011 Nicolas Bigaouette <nbigaouette@gmail.com>
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+ https://github.com/nbigaouette/oclutils
+*/
+
+#ifndef INC_OCLUTILS_TRACE_hpp
+#define INC_OCLUTILS_TRACE_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <pthread.h>
+
+#include <CL/cl.h>
+
+// *****************************************************************************
+// Timeline of the library's activity, written in the Chrome trace-event
+// format (load it in chrome://tracing or https://ui.perfetto.dev). Kernel
+// launches and OpenCL_Array transfers are taken from their events' profiling
+// information (queues need CL_QUEUE_PROFILING_ENABLE, otherwise the host's
+// enqueue and completion times are used), aligned on the host's clock with an
+// offset calibrated once per device (with markers on a queue of its own). Every
+// device is a process of the trace and every queue one of its threads.
+// Builds and lock waits are host spans, one track per host thread.
+// Disabled by default: recording adds an event and a callback per command.
+class OpenCL_Trace
+{
+    private:
+        struct Span
+        {
+            std::string                 name;
+            std::string                 category;
+            int                         pid;
+            int                         tid;
+            double                      start;      // Microseconds since the trace's origin
+            double                      duration;   // Microseconds
+        };
+
+        bool                            enabled;
+        pthread_mutex_t                 mutex;
+        std::vector<Span>               spans;
+
+        // Tracks: pid 0 is the host, devices follow.
+        std::map<cl_device_id,int>      device_pids;
+        std::map<cl_command_queue,int>  queue_tids;
+        std::vector<pthread_t>          host_threads;
+        std::map<int,std::string>       process_names;
+        std::map<std::pair<int,int>,std::string> thread_names;
+
+        // Per device pid: offset from the device's profiling clock to Host_Time().
+        std::map<int,double>            clock_offsets;
+
+        OpenCL_Trace();
+        static void                     Create_Instance();
+        static OpenCL_Trace            *instance;
+
+        void                            Queue_Track(cl_command_queue queue, int &pid, int &tid);
+        int                             Host_Thread_Track();
+
+    public:
+        static OpenCL_Trace &           Instance();
+
+        void                            Enable(const bool _enabled = true)  { enabled = _enabled; }
+        bool                            Is_Enabled() const                  { return enabled; }
+
+        // Microseconds since the trace's origin (monotonic clock).
+        static double                   Host_Time();
+
+        // Host activity of the calling thread, "start" and "end" from Host_Time().
+        void                            Add_Host_Span(const std::string &name, const std::string &category,
+                                                      const double start, const double end);
+        // Device activity: recorded when the command completes. The event is retained meanwhile.
+        void                            Add_Event(cl_event event, cl_command_queue queue,
+                                                  const std::string &name, const std::string &category);
+        // Called from the events' completion callbacks.
+        void                            Add_Span(const std::string &name, const std::string &category,
+                                                 const int pid, const int tid, const double start, const double end);
+
+        int                             Nb_Spans();
+        void                            Clear();
+        bool                            Write(const std::string &path);
+};
+
+// *****************************************************************************
+// Escape a string to be written between double quotes in a JSON file.
+std::string Escape_JSON(const std::string &s);
+
+#endif // INC_OCLUTILS_TRACE_hpp
+
+// ********** End of file ***************************************